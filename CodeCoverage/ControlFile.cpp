@@ -0,0 +1,119 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include "ControlFile.h"
+
+ControlFile::ControlFile() : stopping(false)
+{
+}
+
+ControlFile::~ControlFile()
+{
+    Stop();
+}
+
+void ControlFile::Open(const std::string& path)
+{
+    this->path = path;
+    Load();
+}
+
+void ControlFile::Start(std::function<void()> changed)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    if (path.empty() || worker.joinable())
+    {
+        return;
+    }
+
+    this->changed = changed;
+    stopping = false;
+    worker = std::thread(&ControlFile::Run, this);
+}
+
+void ControlFile::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+}
+
+bool ControlFile::IsEnabled(const std::string& module, const std::string& type)
+{
+    std::lock_guard<std::mutex> guard(rulesMutex);
+
+    for (auto rule = rules.rbegin(); rule != rules.rend(); ++rule)
+    {
+        const auto& pattern = rule->pattern;
+        bool matches = pattern == "*" || pattern == module ||
+            (type.compare(0, pattern.length(), pattern) == 0 && (type.length() == pattern.length() || type[pattern.length()] == '.' || type[pattern.length()] == '+'));
+        if (matches)
+            return rule->enable;
+    }
+
+    return true;
+}
+
+// Re-reads the file, returning whether its contents changed.
+bool ControlFile::Load()
+{
+    std::ifstream input(path, std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    if (text == contents)
+        return false;
+
+    std::vector<Rule> parsed;
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        auto start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+        auto end = line.find_last_not_of(" \t\r");
+
+        Rule rule;
+        rule.enable = line[start] != '-';
+        if (line[start] == '+' || line[start] == '-')
+            start++;
+        rule.pattern = line.substr(start, end + 1 - start);
+        if (!rule.pattern.empty())
+            parsed.push_back(rule);
+    }
+
+    contents.swap(text);
+
+    std::lock_guard<std::mutex> guard(rulesMutex);
+    rules.swap(parsed);
+    return true;
+}
+
+void ControlFile::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        wake.wait_for(lock, std::chrono::milliseconds(PollMilliseconds), [this] { return stopping; });
+        if (stopping)
+        {
+            break;
+        }
+
+        lock.unlock();
+        if (Load())
+        {
+            printf("Coverage control file %s changed\r\n", path.c_str());
+            changed();
+        }
+        lock.lock();
+    }
+}
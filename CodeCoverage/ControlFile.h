@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runtime on/off switch for instrumentation, read from a text file that a
+// background thread polls. Each line is a rule: an optional '+' (enable) or
+// '-' (disable), then a module file name such as MyApp.dll, a namespace or
+// type name prefix such as MyApp.Services, which also covers nested types,
+// or '*' for everything. The last rule matching a method wins; methods no
+// rule matches stay enabled. Blank lines and lines starting with '#' are
+// ignored.
+class ControlFile
+{
+public:
+    // How often the file is checked for changes.
+    static constexpr int PollMilliseconds = 1000;
+
+    ControlFile();
+    ~ControlFile();
+
+    ControlFile(const ControlFile&) = delete;
+    ControlFile& operator= (const ControlFile&) = delete;
+
+    // Reads the rules once, so methods compiled before the first poll
+    // already follow them. A missing file enables everything.
+    void Open(const std::string& path);
+    bool IsOpen() const { return !path.empty(); }
+
+    // Polls the file, calling changed on the worker thread each time its
+    // rules differ from the last ones read.
+    void Start(std::function<void()> changed);
+    void Stop();
+
+    bool IsEnabled(const std::string& module, const std::string& type);
+
+private:
+    struct Rule
+    {
+        std::string pattern;
+        bool enable;
+    };
+
+    std::string path;
+    std::string contents;
+    std::vector<Rule> rules;
+    std::mutex rulesMutex;
+
+    std::function<void()> changed;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread worker;
+
+    bool Load();
+    void Run();
+};
@@ -1,68 +1,136 @@
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <mutex>
+#include <new>
 #include <fstream>
 #include "CorProfiler.h"
 #include "corhlpr.h"
 #include "CComPtr.h"
 #include "ILRewriter.h"
 #include "profiler_pal.h"
+#include "Utf8.h"
 
-static void STDMETHODCALLTYPE Enter(FunctionID functionId)
+// The IL passes the method's FunctionDetails rather than its FunctionID,
+// so a probe costs no lookup, and every instantiation of a generic method
+// lands on the same entry.
+static void STDMETHODCALLTYPE Enter(UINT_PTR context)
 {
-    CorProfiler::Get()->Enter(functionId);
+    CorProfiler::Get()->Enter(reinterpret_cast<FunctionDetails*>(context));
 }
 
-static void STDMETHODCALLTYPE Leave(FunctionID functionId)
+static void STDMETHODCALLTYPE Leave(UINT_PTR context)
 {
-    CorProfiler::Get()->Leave(functionId);
+    CorProfiler::Get()->Leave(reinterpret_cast<FunctionDetails*>(context));
 }
 
-void STDMETHODCALLTYPE CorProfiler::Enter(FunctionID functionId)
+// Every sampled assembly has a countdown per thread. The first
+// InlineSamplers assemblies use a plain thread-local array. The rest use a
+// table that each thread grows when it first calls into one of them; only
+// they touch it, so the common path skips its initialization check.
+static thread_local ULONG sampleCountdowns[CorProfiler::InlineSamplers];
+static thread_local std::vector<ULONG> overflowCountdowns;
+
+static ULONG& OverflowCountdown(ULONG samplerIndex)
 {
-    ModuleID module;
-    mdToken token;
-    mdTypeDef type;
-    ClassID classId;
-    auto functionResult = corProfilerInfo->GetFunctionInfo(functionId, &classId, &module, &token);
-    if (FAILED(functionResult)) {
+    auto index = samplerIndex - CorProfiler::InlineSamplers;
+    if (index >= overflowCountdowns.size())
+        overflowCountdowns.resize(index + 1, 0);
+    return overflowCountdowns[index];
+}
+
+// Sample mode probe. The IL passes the method's FunctionDetails, so the
+// common path is a thread-local decrement and branch, with no lookups and
+// no shared writes. That is about 3 ns a call against 8 ns for the locked
+// add of the inline counter and 5-8 ns for Enter ("harness --bench
+// profiler"), before the managed-to-native transition of the calli.
+static void STDMETHODCALLTYPE SampleEnter(UINT_PTR context)
+{
+    auto function = reinterpret_cast<FunctionDetails*>(context);
+    auto samplerIndex = function->module->samplerIndex;
+    auto& countdown = samplerIndex < CorProfiler::InlineSamplers ? sampleCountdowns[samplerIndex] : OverflowCountdown(samplerIndex);
+    if (countdown > 0)
+    {
+        countdown--;
         return;
     }
-    
-    corProfilerInfo->GetClassIDInfo(classId, &module, &type);
-    
-    auto mod = this->modules.find(module);
-    if(mod == this->modules.end()) return;
-    
-    auto t = mod->second->types.find(type);
-    if(t == mod->second->types.end()) return;
-    
-    auto func = t->second->functions.find(token);
-    if (func == t->second->functions.end()) return;
 
-    //printf("Enter %s\r\n", func->second->name.c_str());
-    func->second->invocations++;
+    countdown = function->module->samplingPeriod - 1;
+    CorProfiler::Get()->RecordSample(function);
 }
 
-void STDMETHODCALLTYPE CorProfiler::Leave(FunctionID functionId)
+void STDMETHODCALLTYPE CorProfiler::Enter(FunctionDetails* func)
 {
-    //printf("\r\nLeave %" UINT_PTR_FORMAT "", (UINT64)functionId);
+    if (this->mode == CoverageMode::HitOnce)
+    {
+        // Only the first call is recorded. The method is then queued to be
+        // recompiled from its original IL and stops calling in here.
+        if (func->hit.load(std::memory_order_relaxed) || func->hit.exchange(true))
+            return;
+
+        this->counters.Increment(func->slot);
+        this->rejitQueue.Enqueue(func->module->id, func->token);
+        return;
+    }
+
+    //printf("Enter %x\r\n", func->token);
+    this->counters.Increment(func->slot);
+}
+
+void CorProfiler::RecordSample(FunctionDetails* function)
+{
+    this->counters.Increment(function->slot);
 }
 
-std::string UnicodeToAnsi(const WCHAR* str) {
-#ifdef _WINDOWS
-    std::wstring ws(str);
-#else
-    std::basic_string<WCHAR> ws(str);
-#endif
-    return std::string(ws.begin(), ws.end());
+void STDMETHODCALLTYPE CorProfiler::Leave(FunctionDetails* func)
+{
+    //printf("\r\nLeave %x\r\n", func->token);
 }
 
+// Hands the rewriter a method's dense block array. The array lives in the
+// method's FunctionDetails and is sized once, so its address is stable.
+class MethodBlockStorage : public BlockStorage
+{
+private:
+    FunctionDetails* function;
+    ProbeKind kind;
+
+public:
+    MethodBlockStorage(FunctionDetails* function, ProbeKind kind) : function(function), kind(kind) {}
+
+    UINT_PTR Allocate(const std::vector<ILBlock>& blocks) override
+    {
+        // A method instrumented again after its probes were turned off keeps
+        // its hits, and a thread still running the old body keeps writing to
+        // live memory.
+        if (function->blocks.size() == blocks.size())
+        {
+            if (kind == ProbeKind::Flag && function->blockHits.size() == blocks.size())
+                return reinterpret_cast<UINT_PTR>(function->blockHits.data());
+            if (kind == ProbeKind::Counter && function->blockCounters.size() == blocks.size())
+                return reinterpret_cast<UINT_PTR>(function->blockCounters.data());
+        }
+
+        function->blocks = blocks;
+        if (kind == ProbeKind::Flag)
+        {
+            function->blockHits.assign(blocks.size(), 0);
+            return reinterpret_cast<UINT_PTR>(function->blockHits.data());
+        }
+
+        function->blockCounters.assign(blocks.size(), 0);
+        return reinterpret_cast<UINT_PTR>(function->blockCounters.data());
+    }
+};
+
 COR_SIGNATURE enterLeaveMethodSignature             [] = { IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I };
 
-void(STDMETHODCALLTYPE* EnterMethodAddress)(FunctionID) = &Enter;
-void(STDMETHODCALLTYPE *LeaveMethodAddress)(FunctionID) = &Leave;
+void(STDMETHODCALLTYPE* EnterMethodAddress)(UINT_PTR) = &Enter;
+void(STDMETHODCALLTYPE *LeaveMethodAddress)(UINT_PTR) = &Leave;
+void(STDMETHODCALLTYPE *SampleEnterMethodAddress)(UINT_PTR) = &SampleEnter;
 
-CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr)
+CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), mode(CoverageMode::Call), blockCoverage(false), lineCoverage(false),
+    defaultSamplingPeriod(100), nextSamplerIndex(0)
 {
 }
 
@@ -75,17 +143,40 @@ CorProfiler::~CorProfiler()
     }
 }
 
-CorProfiler* CorProfiler::_profiler = nullptr;
+std::atomic<CorProfiler*> CorProfiler::_profiler(nullptr);
 std::mutex singleton_mutex;
 
+// Every probe goes through here, so once the instance is published the
+// lookup is a single acquire load. The mutex only guards creation.
 CorProfiler* CorProfiler::Get()
 {
+    auto profiler = _profiler.load(std::memory_order_acquire);
+    if (profiler != nullptr)
+    {
+        return profiler;
+    }
+
     std::lock_guard<std::mutex> guard(singleton_mutex);
-    if (_profiler == nullptr)
+    profiler = _profiler.load(std::memory_order_relaxed);
+    if (profiler == nullptr)
     {
-        _profiler = new CorProfiler();
+        profiler = new CorProfiler();
+        _profiler.store(profiler, std::memory_order_release);
     }
-    return _profiler;
+    return profiler;
+}
+
+void* CorProfiler::operator new(size_t size)
+{
+    auto p = AlignedAlloc(size, alignof(CorProfiler));
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void CorProfiler::operator delete(void* p)
+{
+    AlignedFree(p);
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk)
@@ -97,6 +188,10 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
         return E_FAIL;
     }
 
+    // Publish this instance before any IL is rewritten, so probes never see
+    // an empty singleton.
+    _profiler.store(this, std::memory_order_release);
+
     DWORD eventMask = COR_PRF_MONITOR_JIT_COMPILATION                      |
                       COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST | /* helps the case where this profiler is used on Full CLR */
                       COR_PRF_DISABLE_INLINING |
@@ -107,6 +202,118 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
                         COR_PRF_MONITOR_THREADS |
                         COR_PRF_MONITOR_EXCEPTIONS;
 
+    const char* coverageMode = std::getenv("CODE_COVERAGE_MODE");
+    if (coverageMode && std::string(coverageMode) == "counter")
+        this->mode = CoverageMode::Counter;
+    else if (coverageMode && std::string(coverageMode) == "hitonce")
+        this->mode = CoverageMode::HitOnce;
+    else if (coverageMode && std::string(coverageMode) == "bitmap")
+        this->mode = CoverageMode::Bitmap;
+    else if (coverageMode && std::string(coverageMode) == "sample")
+        this->mode = CoverageMode::Sample;
+    else if (coverageMode && std::string(coverageMode) == "edge")
+        this->mode = CoverageMode::Edge;
+
+    // CODE_COVERAGE_SAMPLE_PERIOD sets N for every module, and
+    // CODE_COVERAGE_SAMPLE_PERIODS overrides it per module, as a comma
+    // separated list of Module.dll=N.
+    const char* samplePeriod = std::getenv("CODE_COVERAGE_SAMPLE_PERIOD");
+    if (samplePeriod && std::strtoul(samplePeriod, nullptr, 10) > 0)
+        this->defaultSamplingPeriod = std::strtoul(samplePeriod, nullptr, 10);
+
+    const char* samplePeriods = std::getenv("CODE_COVERAGE_SAMPLE_PERIODS");
+    if (samplePeriods)
+    {
+        std::string list(samplePeriods);
+        size_t start = 0;
+        while (start < list.length())
+        {
+            auto end = list.find(',', start);
+            if (end == std::string::npos)
+                end = list.length();
+
+            auto entry = list.substr(start, end - start);
+            auto equals = entry.find('=');
+            if (equals != std::string::npos)
+            {
+                auto period = std::strtoul(entry.c_str() + equals + 1, nullptr, 10);
+                if (period > 0)
+                    this->samplingPeriods[entry.substr(0, equals)] = period;
+            }
+            start = end + 1;
+        }
+    }
+
+    // CODE_COVERAGE_FILTER selects what is covered; see CoverageFilter.
+    // Without it, the modules in the comma separated CORECLR_PROFILER_DLL
+    // are covered in full.
+    const char* filterRules = std::getenv("CODE_COVERAGE_FILTER");
+    if (filterRules && *filterRules)
+    {
+        this->filter.Compile(filterRules);
+    }
+    else
+    {
+        const char* dll = std::getenv("CORECLR_PROFILER_DLL");
+        std::string list(dll ? dll : "CodeCoverage.Example.dll");
+        std::string rules;
+        size_t start = 0;
+        while (start <= list.length())
+        {
+            auto end = list.find(',', start);
+            if (end == std::string::npos)
+                end = list.length();
+
+            if (end > start)
+                rules += "+[" + list.substr(start, end - start) + "];";
+            start = end + 1;
+        }
+        this->filter.Compile(rules);
+    }
+
+    // Block probes are inline IL, so they pair with the inline modes only.
+    const char* blocks = std::getenv("CODE_COVERAGE_BLOCKS");
+    if (blocks && std::string(blocks) == "1")
+        this->blockCoverage = this->mode == CoverageMode::Counter || this->mode == CoverageMode::Bitmap;
+
+    const char* lines = std::getenv("CODE_COVERAGE_LINES");
+    if (lines && std::string(lines) == "1")
+        this->lineCoverage = true;
+
+    // CODE_COVERAGE_EDGE_SHM names the POSIX shared-memory segment, e.g.
+    // /dotnet-fuzz, that the fuzzer reads and clears between executions.
+    if (this->mode == CoverageMode::Edge)
+    {
+        const char* edgeShm = std::getenv("CODE_COVERAGE_EDGE_SHM");
+        this->edgeMap.Open(edgeShm ? edgeShm : "");
+    }
+
+    // CODE_COVERAGE_IL_CACHE names a file that keeps instrumented bodies
+    // between runs, so unchanged methods skip the rewriter.
+    const char* ilCachePath = std::getenv("CODE_COVERAGE_IL_CACHE");
+    if (ilCachePath && *ilCachePath)
+        this->ilCache.Open(ilCachePath);
+
+    // CODE_COVERAGE_CONTROL names a file of rules that turn probes on and
+    // off while the process runs; see ControlFile.
+    const char* controlPath = std::getenv("CODE_COVERAGE_CONTROL");
+    if (controlPath && *controlPath)
+    {
+        if (this->mode == CoverageMode::HitOnce)
+            printf("CODE_COVERAGE_CONTROL is ignored in hitonce mode\r\n");
+        else
+            this->controlFile.Open(controlPath);
+    }
+
+    if (this->mode == CoverageMode::HitOnce || this->controlFile.IsOpen())
+    {
+        eventMask |= COR_PRF_ENABLE_REJIT;
+        this->rejitQueue.Start(this->corProfilerInfo);
+    }
+
+    this->controlFile.Start([this] { ApplyControl(); });
+    this->metadataScanner.Start();
+
     auto hr = this->corProfilerInfo->SetEventMask(eventMask);
 
     return S_OK;
@@ -114,19 +321,86 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
 
 HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
 {
+    this->controlFile.Stop();
+    this->rejitQueue.Stop();
+    this->metadataScanner.Stop();
+    this->ilCache.Save();
+
+    // Modules still loaded are folded in like unloaded ones, so the reports
+    // only read the per-assembly coverage.
+    std::map<ModuleID, ModuleDetails*> loaded;
+    {
+        std::lock_guard<std::mutex> guard(this->controlMutex);
+        loaded.swap(this->modules);
+    }
+    for (const auto& [moduleId, module] : loaded)
+        RetireModule(module);
+
     std::ofstream results;
     results.open("coverage.csv");
 
-    for (const auto& [moduleId, module] : this->modules)
-    for (const auto& [classId, type] : module->types) 
-    for (const auto& [key, value] : type->functions) {
-        //if (value->invocations > 0) {
-            results << module->name.c_str() << "," << type->name.c_str() << "," << value->name.c_str() << "," << value->invocations << std::endl;
-            printf("(%s) %s.%s: %i\r\n", module->name.c_str(), type->name.c_str(), value->name.c_str(), value->invocations);
-        //}
-        delete value;
+    std::ofstream blockResults;
+    if (this->blockCoverage)
+        blockResults.open("coverage-blocks.csv");
+
+    for (auto& [key, module] : this->coverage)
+    {
+        // Every coverable method is listed, including those that never ran.
+        if (!module.methods)
+            continue;
+        const auto& methods = *module.methods;
+        auto count = static_cast<ULONG>(methods.names.size());
+
+        // Each row is module, type, method, invocations, resumes, source.
+        // Calls to a state machine's MoveNext are added to the resumes of the
+        // method that started it, whose own invocations are the logical
+        // calls. Other generated methods name the user method they belong to
+        // as their source.
+        std::vector<UINT64> resumes(count, 0);
+        for (ULONG rid = 1; rid < count; rid++) {
+            if (methods.resumes[rid] && methods.sources[rid] != 0)
+                resumes[methods.sources[rid]] += module.GetInvocations(this->counters, rid);
+        }
+
+        for (ULONG rid = 1; rid < count; rid++) {
+            if (methods.names[rid] == StringPool::Empty)
+                continue;
+
+            auto type = this->names.Get(methods.types[rid]);
+            auto name = this->names.Get(methods.names[rid]);
+            auto invocations = module.GetInvocations(this->counters, rid);
+            auto source = methods.sources[rid];
+            //if (invocations > 0) {
+                results << module.name.c_str() << "," << type << "," << name << "," << invocations << "," << resumes[rid] << ",";
+                if (source != 0 && methods.names[source] != StringPool::Empty)
+                    results << this->names.Get(methods.types[source]) << "." << this->names.Get(methods.names[source]);
+                results << std::endl;
+                printf("(%s) %s.%s: %llu\r\n", module.name.c_str(), type, name, (UINT64)invocations);
+            //}
+        }
+
+        if (!this->blockCoverage)
+            continue;
+
+        for (const auto& [rid, blocks] : module.blocks) {
+            if (methods.names[rid] == StringPool::Empty)
+                continue;
+
+            for (size_t i = 0; i < blocks.blocks.size(); i++) {
+                blockResults << module.name.c_str() << "," << this->names.Get(methods.types[rid]) << "," << this->names.Get(methods.names[rid]) << ","
+                    << blocks.blocks[i].start << "," << blocks.blocks[i].end << "," << blocks.hits[i] << std::endl;
+            }
+        }
     }
-    
+
+    if (this->blockCoverage)
+        blockResults.close();
+
+    if (this->lineCoverage)
+        WriteLineCoverage();
+
+    this->coverage.clear();
+
     results.close();
 
     if (this->corProfilerInfo != nullptr)
@@ -138,6 +412,68 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
     return S_OK;
 }
 
+// Translates hits into source lines through each module's portable PDB.
+// Sequence points are decoded here, and only for methods that were
+// JIT-compiled. A point takes the hits of the block containing its IL
+// offset when block coverage is on, or of its method otherwise; a line
+// reports the most hits of any point covering it.
+void CorProfiler::WriteLineCoverage()
+{
+    std::map<std::string, std::map<ULONG32, UINT64>> files;
+    std::vector<SequencePoint> points;
+
+    for (auto& [key, module] : this->coverage)
+    {
+        std::map<ULONG32, std::string> documents;
+
+        for (ULONG rid = 1; rid < module.instrumented.size(); rid++)
+        {
+            if (!module.instrumented[rid])
+                continue;
+
+            points.clear();
+            if (!module.pdb.GetSequencePoints(TokenFromRid(rid, mdtMethodDef), points))
+                continue;
+
+            auto invocations = module.GetInvocations(this->counters, rid);
+            auto blocks = module.blocks.find(rid);
+
+            for (const auto& point : points)
+            {
+                UINT64 hits = invocations;
+                if (blocks != module.blocks.end())
+                {
+                    const auto& ranges = blocks->second.blocks;
+                    auto block = std::upper_bound(ranges.begin(), ranges.end(), point.ilOffset,
+                        [](ULONG32 offset, const ILBlock& b) { return offset < b.start; });
+                    if (block != ranges.begin())
+                        hits = blocks->second.hits[(block - ranges.begin()) - 1];
+                }
+
+                auto document = documents.find(point.document);
+                if (document == documents.end())
+                    document = documents.emplace(point.document, module.pdb.GetDocumentName(point.document)).first;
+
+                auto& lines = files[document->second];
+                for (auto line = point.startLine; line <= point.endLine; line++)
+                {
+                    auto& lineHits = lines[line];
+                    lineHits = std::max(lineHits, hits);
+                }
+            }
+        }
+    }
+
+    std::ofstream results;
+    results.open("coverage-lines.csv");
+
+    for (const auto& [file, lines] : files)
+    for (const auto& [line, hits] : lines)
+        results << file << "," << line << "," << hits << std::endl;
+
+    results.close();
+}
+
 HRESULT STDMETHODCALLTYPE CorProfiler::AppDomainCreationStarted(AppDomainID appDomainId)
 {
     return S_OK;
@@ -183,30 +519,144 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadStarted(ModuleID moduleId)
     return S_OK;
 }
 
-bool ContainsPath(const std::string dllFilename, const std::string dll)
+// Full name of a type, with enclosing types joined by '+' as reflection
+// does.
+static std::string GetFullTypeName(IMetaDataImport* metadataImport, mdTypeDef type)
 {
-    auto start = 0U;
-    auto end = dll.find(",");
+    WCHAR name[256];
+    ULONG size;
+    DWORD flags;
+    mdToken baseType;
+    if (FAILED(metadataImport->GetTypeDefProps(type, name, 256, &size, &flags, &baseType)))
+        return "";
 
-    do
-    {
-        auto allowedName = dll.substr(start, end - start);
-        if (dllFilename.compare(allowedName) == 0)
-        {
-            return true;
-        }
-        start = end + 1;
-        end = dll.find(",", start);
-    }
-    while (end != std::string::npos);
-    
-    auto allowedName = dll.substr(start, dll.length() - start);
-    if (dllFilename.compare(allowedName) == 0)
+    mdTypeDef enclosing;
+    if (metadataImport->GetNestedClassProps(type, &enclosing) != S_OK)
+        return Utf16ToUtf8(name);
+
+    return GetFullTypeName(metadataImport, enclosing) + "+" + Utf16ToUtf8(name);
+}
+
+static bool IsGeneratedName(IMetaDataImport* metadataImport, mdTypeDef type)
+{
+    WCHAR name[256];
+    ULONG size;
+    DWORD flags;
+    mdToken baseType;
+    return SUCCEEDED(metadataImport->GetTypeDefProps(type, name, 256, &size, &flags, &baseType)) && name[0] == '<';
+}
+
+// Compiler-generated names keep the user method they came from between
+// angle brackets: <Run>d__4 (state machine), <Run>b__4_0 (lambda) and
+// <Run>g__Local|4_0 (local function). Empty for names that carry no
+// method, such as <>c and <>c__DisplayClass4_0, and for user names.
+static std::basic_string<WCHAR> GetSourceMethodName(const WCHAR* name)
+{
+    if (name[0] != '<')
+        return std::basic_string<WCHAR>();
+
+    auto end = name + 1;
+    while (*end != 0 && *end != '>')
+        end++;
+
+    if (*end != '>')
+        return std::basic_string<WCHAR>();
+    return std::basic_string<WCHAR>(name + 1, end);
+}
+
+// <Run>d__4 is the async or iterator state machine of Run.
+static bool IsStateMachineName(const WCHAR* name)
+{
+    if (name[0] != '<')
+        return false;
+
+    auto end = name + 1;
+    while (*end != 0 && *end != '>')
+        end++;
+
+    return end[0] == '>' && end[1] == 'd' && end[2] == '_' && end[3] == '_';
+}
+
+// The token of a System.Private.CoreLib type in the module: the type def in
+// CoreLib itself, else a type ref through *coreLib, an assembly ref that is
+// defined on first use.
+static HRESULT GetCoreLibType(IMetaDataImport* metadataImport, IMetaDataEmit* metadataEmit, LPCWSTR name, mdAssemblyRef* coreLib, mdToken* type)
+{
+    static const BYTE coreLibPublicKeyToken[] = { 0x7c, 0xec, 0x85, 0xd7, 0xbe, 0xa7, 0x79, 0x8e };
+
+    if (SUCCEEDED(metadataImport->FindTypeDefByName(name, mdTokenNil, type)))
+        return S_OK;
+
+    if (*coreLib == mdAssemblyRefNil)
     {
-        return true;
+        CComPtr<IMetaDataAssemblyEmit> assemblyEmit;
+        IfFailRet(metadataImport->QueryInterface(IID_IMetaDataAssemblyEmit, reinterpret_cast<void**>(&assemblyEmit)));
+
+        // Version 4.0.0.0 binds to whichever CoreLib the runtime has.
+        ASSEMBLYMETADATA version = {};
+        version.usMajorVersion = 4;
+        IfFailRet(assemblyEmit->DefineAssemblyRef(coreLibPublicKeyToken, sizeof(coreLibPublicKeyToken), W("System.Private.CoreLib"), &version, nullptr, 0, 0, coreLib));
     }
-    
-    return false;
+
+    return metadataEmit->DefineTypeRefByName(*coreLib, name, type);
+}
+
+// Defines a memberref to System.Threading.Interlocked.Increment(ref long)
+// for the counter probes.
+static HRESULT DefineIncrementRef(IMetaDataImport* metadataImport, mdMemberRef* incrementRef)
+{
+    static const COR_SIGNATURE signature[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT, 1, ELEMENT_TYPE_I8, ELEMENT_TYPE_BYREF, ELEMENT_TYPE_I8 };
+
+    CComPtr<IMetaDataEmit> metadataEmit;
+    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void**>(&metadataEmit)));
+
+    mdAssemblyRef coreLib = mdAssemblyRefNil;
+    mdToken interlocked;
+    IfFailRet(GetCoreLibType(metadataImport, metadataEmit, W("System.Threading.Interlocked"), &coreLib, &interlocked));
+
+    return metadataEmit->DefineMemberRef(interlocked, W("Increment"), signature, sizeof(signature), incrementRef);
+}
+
+// Defines the field the edge probes keep the previous block in: a
+// [ThreadStatic] uint32 on a new static class, <EdgeCoverage>, visible to
+// the rest of the module only.
+static HRESULT DefinePreviousLocation(IMetaDataImport* metadataImport, mdFieldDef* previousLocation)
+{
+    static const COR_SIGNATURE fieldSignature[] = { IMAGE_CEE_CS_CALLCONV_FIELD, ELEMENT_TYPE_U4 };
+    static const COR_SIGNATURE constructorSignature[] = { IMAGE_CEE_CS_CALLCONV_HASTHIS, 0, ELEMENT_TYPE_VOID };
+    static const BYTE noArguments[] = { 0x01, 0x00, 0x00, 0x00 };
+
+    CComPtr<IMetaDataEmit> metadataEmit;
+    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void**>(&metadataEmit)));
+
+    mdAssemblyRef coreLib = mdAssemblyRefNil;
+    mdToken object, threadStatic;
+    IfFailRet(GetCoreLibType(metadataImport, metadataEmit, W("System.Object"), &coreLib, &object));
+    IfFailRet(GetCoreLibType(metadataImport, metadataEmit, W("System.ThreadStaticAttribute"), &coreLib, &threadStatic));
+
+    mdTypeDef edgeCoverage;
+    IfFailRet(metadataEmit->DefineTypeDef(W("<EdgeCoverage>"), tdNotPublic | tdAbstract | tdSealed, object, nullptr, &edgeCoverage));
+    IfFailRet(metadataEmit->DefineField(edgeCoverage, W("previousLocation"), fdAssembly | fdStatic, fieldSignature, sizeof(fieldSignature), ELEMENT_TYPE_VOID, nullptr, 0, previousLocation));
+
+    mdMemberRef constructor;
+    mdCustomAttribute attribute;
+    IfFailRet(metadataEmit->DefineMemberRef(threadStatic, W(".ctor"), constructorSignature, sizeof(constructorSignature), &constructor));
+    return metadataEmit->DefineCustomAttribute(*previousLocation, constructor, noArguments, sizeof(noArguments), &attribute);
+}
+
+// The method of userType called name, if there is exactly one; generated
+// names don't say which overload they belong to.
+static mdMethodDef FindSourceMethod(IMetaDataImport* metadataImport, mdTypeDef userType, const std::basic_string<WCHAR>& name)
+{
+    HCORENUM position = nullptr;
+    mdMethodDef methods[2];
+    ULONG count = 0;
+    auto hr = metadataImport->EnumMethodsWithName(&position, userType, name.c_str(), methods, 2, &count);
+    metadataImport->CloseEnum(position);
+    if (FAILED(hr) || count != 1)
+        return mdMethodDefNil;
+
+    return methods[0];
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadFinished(ModuleID moduleId, HRESULT hrStatus)
@@ -222,86 +672,326 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadFinished(ModuleID moduleId, HRE
 
     hr = this->corProfilerInfo->GetModuleInfo2(moduleId, &baseAddress, 256, &size, name, &assemblyId, &flags);
 
-    const char* dll = std::getenv("CORECLR_PROFILER_DLL");
-    if (!dll)
-        dll = "CodeCoverage.Example.dll";
-    
-    
-    auto dllPath = UnicodeToAnsi(name);
+    auto dllPath = Utf16ToUtf8(name);
     auto dllFilename = dllPath.substr(dllPath.find_last_of("/\\") + 1);
-    
-    if (!ContainsPath(dllFilename, dll)) {
+
+    auto rules = this->filter.MatchModule(dllFilename);
+    if (rules == 0) {
         return S_OK;
     }
     
-    auto moduleDetails = new ModuleDetails(dllFilename);
-    this->modules[moduleId] = moduleDetails;
-
-    printf("Module loaded: %s (%llx)\r\n", UnicodeToAnsi(name).c_str(), (UINT64)moduleId);
+    printf("Module loaded: %s (%llx)\r\n", Utf16ToUtf8(name).c_str(), (UINT64)moduleId);
 
+    // Counter and edge probes use members the profiler adds to the module.
     CComPtr<IMetaDataImport> metadataImport;
-    hr = this->corProfilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, reinterpret_cast<IUnknown**>(&metadataImport));
+    auto openFlags = this->mode == CoverageMode::Counter || this->mode == CoverageMode::Edge ? ofRead | ofWrite : ofRead;
+    hr = this->corProfilerInfo->GetModuleMetaData(moduleId, openFlags, IID_IMetaDataImport, reinterpret_cast<IUnknown**>(&metadataImport));
+    if (FAILED(hr))
+        return S_OK;
+
+    // Added before the tables are sized, so they count the new type.
+    mdMemberRef incrementRef = mdMemberRefNil;
+    mdFieldDef previousLocation = mdFieldDefNil;
+    if ((this->mode == CoverageMode::Counter && FAILED(DefineIncrementRef(metadataImport, &incrementRef))) ||
+        (this->mode == CoverageMode::Edge && FAILED(DefinePreviousLocation(metadataImport, &previousLocation))))
+    {
+        printf("Unable to add probe members, skipping module %s\r\n", dllFilename.c_str());
+        return S_OK;
+    }
+
+    // MethodDef RIDs are dense, so the method table row count sizes a flat
+    // per-module table that Enter and JITCompilationStarted index directly.
+    CComPtr<IMetaDataTables> metadataTables;
+    ULONG methodCount, typeCount;
+    ULONG rowSize, columns, keyColumn;
+    const char* tableName;
+    if (FAILED(metadataImport->QueryInterface(IID_IMetaDataTables, reinterpret_cast<void**>(&metadataTables))) ||
+        FAILED(metadataTables->GetTableInfo(TypeFromToken(mdtMethodDef) >> 24, &rowSize, &methodCount, &columns, &keyColumn, &tableName)) ||
+        FAILED(metadataTables->GetTableInfo(TypeFromToken(mdtTypeDef) >> 24, &rowSize, &typeCount, &columns, &keyColumn, &tableName)))
+        return S_OK;
+
+    ModuleKey key;
+    key.name = dllFilename;
+    key.mvid = GUID();
+    metadataImport->GetScopeProps(nullptr, 0, nullptr, &key.mvid);
+
+    ModuleDetails* moduleDetails;
+    {
+        std::lock_guard<std::mutex> guard(this->controlMutex);
+
+        // A build loaded before, in another load context or before being
+        // unloaded, counts into the counters it already has.
+        auto coverage = this->coverage.find(key);
+        if (coverage == this->coverage.end())
+        {
+            // Bitmap mode keeps a byte per method instead of reserving counters.
+            auto counterBase = CounterStore::InvalidSlot;
+            if (this->mode != CoverageMode::Bitmap)
+            {
+                counterBase = this->counters.Reserve(methodCount + 1);
+                if (counterBase == CounterStore::InvalidSlot)
+                {
+                    printf("Counter store full, skipping module %s\r\n", dllFilename.c_str());
+                    return S_OK;
+                }
+            }
+
+            ULONG samplingPeriod = 1;
+            ULONG samplerIndex = 0;
+            if (this->mode == CoverageMode::Sample)
+            {
+                auto period = this->samplingPeriods.find(dllFilename);
+                samplingPeriod = period != this->samplingPeriods.end() ? period->second : this->defaultSamplingPeriod;
+                samplerIndex = this->nextSamplerIndex++;
+            }
+
+            // The portable PDB is expected next to the module, e.g. Foo.dll -> Foo.pdb.
+            auto extension = dllPath.find_last_of('.');
+            auto separator = dllPath.find_last_of("/\\");
+            auto pdbPath = (extension != std::string::npos && (separator == std::string::npos || extension > separator) ? dllPath.substr(0, extension) : dllPath) + ".pdb";
+
+            coverage = this->coverage.emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                std::forward_as_tuple(dllFilename, pdbPath, counterBase, samplingPeriod, samplerIndex)).first;
+        }
+
+        moduleDetails = new ModuleDetails(moduleId, dllFilename, key.mvid, methodCount, typeCount, &coverage->second);
+        moduleDetails->rules = rules;
+        moduleDetails->incrementRef = incrementRef;
+        moduleDetails->previousLocation = previousLocation;
+        if (this->mode == CoverageMode::Bitmap)
+            moduleDetails->hitMap.resize(methodCount + 1);
+
+        // Types and methods are not enumerated here. A method is looked up
+        // when it is first compiled, and the names the reports need are read
+        // by the metadata scanner, off the loader thread.
+        metadataImport->QueryInterface(IID_IMetaDataImport, reinterpret_cast<void**>(&moduleDetails->metadataImport));
+
+        this->modules[moduleId] = moduleDetails;
+    }
+
+    // The scan finds the module by ID, as it may have been unloaded by the
+    // time the task runs.
+    this->metadataScanner.Enqueue([this, moduleId]
+    {
+        ModuleDetails* module;
+        std::unique_lock<std::mutex> scan;
+        {
+            std::lock_guard<std::mutex> guard(this->controlMutex);
+            auto mod = this->modules.find(moduleId);
+            if (mod == this->modules.end())
+                return;
+            module = mod->second;
+            scan = std::unique_lock<std::mutex>(module->scanMutex);
+        }
+
+        if (module->methodTable.load() != nullptr)
+            return;
+
+        auto table = new MethodTable(module->methods.size());
+        ResolveMethods(module, *table);
+        module->methodTable.store(table, std::memory_order_release);
+    });
+
+    return S_OK;
+}
+
+// Interned full name of type, resolved once per module along with its
+// filter rules. Compiler-generated types nested in user types, such as
+// state machines and closures, are covered; top-level ones like <Module>
+// and <PrivateImplementationDetails>, and anything inside them, are not.
+// Nor are types the filter leaves out. The caller holds controlMutex.
+StringPool::Id CorProfiler::ResolveType(ModuleDetails* module, mdTypeDef type)
+{
+    auto rid = RidFromToken(type);
+    if (rid >= module->typeResolved.size())
+        return StringPool::Empty;
+    if (module->typeResolved[rid])
+        return module->typeNames[rid];
+
+    auto name = GetFullTypeName(module->metadataImport, type);
+    CoverageFilter::RuleSet rules = 0;
+    if (!name.empty() && name[0] != '<')
+        rules = this->filter.MatchType(module->rules, name);
+
+    module->typeResolved[rid] = 1;
+    module->typeRules[rid] = rules;
+    module->typeNames[rid] = rules != 0 ? this->names.Intern(name) : StringPool::Empty;
+    return module->typeNames[rid];
+}
+
+// Names every coverable method of the module, and links generated methods
+// to the user methods they came from.
+void CorProfiler::ResolveMethods(ModuleDetails* module, MethodTable& methods)
+{
+    IMetaDataImport* metadataImport = module->metadataImport;
 
     HCORENUM position = nullptr;
     mdTypeDef types[50];
     ULONG numTypes;
-    HRESULT typeResult;
-    do {
-        typeResult = metadataImport->EnumTypeDefs(&position, types, 50, &numTypes);
-        
-        if (typeResult == S_FALSE) break;
-    
+    while (SUCCEEDED(metadataImport->EnumTypeDefs(&position, types, 50, &numTypes)) && numTypes > 0)
+    {
         for (ULONG i = 0; i < numTypes; ++i)
         {
             ULONG size;
             WCHAR typeName[256];
             DWORD flags;
             mdToken baseType;
-            metadataImport->GetTypeDefProps(types[i], typeName, 256, &size, &flags, &baseType);
-            
-            if (typeName[0] == '<') {
+            if (FAILED(metadataImport->GetTypeDefProps(types[i], typeName, 256, &size, &flags, &baseType)))
                 continue;
+
+            StringPool::Id typeId;
+            CoverageFilter::RuleSet rules;
+            {
+                std::lock_guard<std::mutex> guard(this->controlMutex);
+                typeId = ResolveType(module, types[i]);
+                rules = module->typeRules[RidFromToken(types[i])];
             }
-            
-            auto ansiTypeName = UnicodeToAnsi(typeName);
-    
-            printf("Found Type %s (%i)\r\n", ansiTypeName.c_str(), types[i]);
-            
-            auto typeDetails = new ClassDetails(ansiTypeName);
-            moduleDetails->types[types[i]] = typeDetails;
-    
-            HCORENUM pos2 = nullptr;
+            if (typeId == StringPool::Empty)
+                continue;
+
+            // The user-written type generated code came from: the innermost
+            // enclosing type whose name isn't generated.
+            mdTypeDef userType = types[i];
+            while (userType != mdTypeDefNil && IsGeneratedName(metadataImport, userType))
+            {
+                if (metadataImport->GetNestedClassProps(userType, &userType) != S_OK)
+                    userType = mdTypeDefNil;
+            }
+
+            bool stateMachine = IsStateMachineName(typeName);
+
+            HCORENUM methodPosition = nullptr;
             mdMethodDef methodDef[50];
             ULONG tokens;
-    
-            hr = metadataImport->EnumMethods(&pos2, types[i], methodDef, 50, &tokens);
-    
-            for (ULONG j = 0; j < tokens; ++j)
+            while (SUCCEEDED(metadataImport->EnumMethods(&methodPosition, types[i], methodDef, 50, &tokens)) && tokens > 0)
             {
-                PCCOR_SIGNATURE sig;
-                ULONG blobSize, size, attributes;
-                WCHAR name[256];
-                DWORD flags;
-                ULONG codeRva;
-                mdTypeDef type;
-                metadataImport->GetMethodProps(methodDef[j], &type, name, 256, &size, &attributes, &sig, &blobSize, &codeRva, &flags);
-                
-                auto functionDetails = new FunctionDetails(UnicodeToAnsi(name));
-                typeDetails->functions[methodDef[j]] = functionDetails;
-                //printf("Found Method %i %s::%s\r\n", methodDef[j], UnicodeToAnsi(typeName).c_str(), UnicodeToAnsi(name).c_str());
-                this->functions[methodDef[j]] = new FunctionDetails(UnicodeToAnsi(typeName) + "::" + UnicodeToAnsi(name));
+                for (ULONG j = 0; j < tokens; ++j)
+                {
+                    WCHAR name[256];
+                    mdTypeDef type;
+                    if (FAILED(metadataImport->GetMethodProps(methodDef[j], &type, name, 256, &size, nullptr, nullptr, nullptr, nullptr, nullptr)))
+                        continue;
+
+                    auto rid = RidFromToken(methodDef[j]);
+                    if (rid >= methods.names.size())
+                        continue;
+
+                    auto nameId = this->names.Intern(name, Utf16Length(name));
+                    if (this->filter.HasMethodRules() && !this->filter.IncludesMethod(rules, this->names.Get(nameId)))
+                        continue;
+
+                    methods.types[rid] = typeId;
+                    methods.names[rid] = nameId;
+
+                    // Lambdas and local functions name their source method
+                    // themselves; the methods of a state machine take it
+                    // from the type, and each MoveNext is a resume.
+                    auto sourceName = GetSourceMethodName(name);
+                    if (sourceName.empty() && stateMachine)
+                    {
+                        sourceName = GetSourceMethodName(typeName);
+                        methods.resumes[rid] = strcmp(this->names.Get(nameId), "MoveNext") == 0;
+                    }
+                    if (!sourceName.empty() && userType != mdTypeDefNil)
+                        methods.sources[rid] = RidFromToken(FindSourceMethod(metadataImport, userType, sourceName));
+                }
             }
+            metadataImport->CloseEnum(methodPosition);
         }
-    } while (typeResult == S_OK);
-
-    return S_OK;
+    }
+    metadataImport->CloseEnum(position);
 }
 
+// Collectible assemblies load and unload all the time. What a load covered
+// is folded into its assembly's entry and the rest freed, so memory stays
+// bounded and a recycled ModuleID starts afresh. The module's code can no
+// longer run, so nothing still points at its FunctionDetails.
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
 {
+    ModuleDetails* module;
+    {
+        std::lock_guard<std::mutex> guard(this->controlMutex);
+        auto mod = this->modules.find(moduleId);
+        if (mod == this->modules.end())
+            return S_OK;
+
+        module = mod->second;
+        this->modules.erase(mod);
+    }
+
+    printf("Module unloaded: %s (%llx)\r\n", module->name.c_str(), (UINT64)moduleId);
+
+    // Hit-once probes and the control file may have queued ReJITs for the
+    // module, which must not reach the runtime once its ID is stale.
+    this->rejitQueue.Forget(moduleId);
+    RetireModule(module);
+
     return S_OK;
 }
 
+// Folds a load that is gone, or that is still there at shutdown, into its
+// assembly's coverage and frees it. The module is no longer in the map.
+void CorProfiler::RetireModule(ModuleDetails* module)
+{
+    // The scanner may be building the names; wait for it, or build them
+    // here if it never got to the module.
+    {
+        std::lock_guard<std::mutex> scan(module->scanMutex);
+        if (module->methodTable.load() == nullptr)
+        {
+            auto table = new MethodTable(module->methods.size());
+            ResolveMethods(module, *table);
+            module->methodTable.store(table);
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(this->controlMutex);
+    auto coverage = module->coverage;
+
+    // Every load of a build has the same methods and names.
+    if (!coverage->methods)
+        coverage->methods.reset(module->methodTable.exchange(nullptr));
+
+    if (!module->hitMap.empty())
+    {
+        if (coverage->hitMap.size() < module->hitMap.size())
+            coverage->hitMap.resize(module->hitMap.size());
+        for (size_t rid = 0; rid < module->hitMap.size(); rid++)
+            coverage->hitMap[rid] |= module->hitMap[rid];
+    }
+
+    for (auto func : module->methods)
+    {
+        if (func == nullptr || !func->instrumented)
+            continue;
+
+        auto rid = RidFromToken(func->token);
+        if (coverage->instrumented.size() < module->methods.size())
+            coverage->instrumented.resize(module->methods.size());
+        coverage->instrumented[rid] = 1;
+
+        if (func->blocks.empty())
+            continue;
+
+        // Counters add up; flags only say whether any load hit the block.
+        auto& blocks = coverage->blocks[rid];
+        if (blocks.blocks.size() != func->blocks.size())
+        {
+            blocks.blocks = func->blocks;
+            blocks.hits.assign(func->blocks.size(), 0);
+        }
+        for (size_t i = 0; i < func->blocks.size(); i++)
+        {
+            if (func->blockHits.empty())
+                blocks.hits[i] += func->blockCounters[i];
+            else
+                blocks.hits[i] |= func->blockHits[i];
+        }
+    }
+
+    delete module;
+}
+
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadFinished(ModuleID moduleId, HRESULT hrStatus)
 {
     return S_OK;
@@ -320,59 +1010,188 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ClassLoadStarted(ClassID classId)
 HRESULT STDMETHODCALLTYPE CorProfiler::ClassLoadFinished(ClassID classId, HRESULT hrStatus)
 {
     return S_OK;
+}
 
-    HRESULT hr;
-    ModuleID moduleId;
-    mdTypeDef typeDef;
-    ClassID parentClassId;
+HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadStarted(ClassID classId)
+{
+    return S_OK;
+}
 
-    hr = this->corProfilerInfo->GetClassIDInfo2(classId, &moduleId, &typeDef, &parentClassId, 0, nullptr, nullptr);
-    auto typeName = GetTypeName(typeDef, moduleId);
-    if (typeName.rfind("CodeCoverage.Example", 0) != 0) {
-        return S_OK;
-    }
+HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadFinished(ClassID classId, HRESULT hrStatus)
+{
+    return S_OK;
+}
 
-    printf("Class load finished: %s\r\n", typeName.c_str());
+HRESULT STDMETHODCALLTYPE CorProfiler::FunctionUnloadStarted(FunctionID functionId)
+{
+    return S_OK;
+}
 
+// Values of the process-specific operands in the IL for func. Everything
+// but the block storage, which only exists once the blocks are known.
+HRESULT CorProfiler::GetILParams(ModuleID moduleId, mdToken token, ModuleDetails* module, FunctionDetails* func, UINT64* params)
+{
+    for (int i = 0; i < ILParamCount; i++)
+        params[i] = 0;
 
-    CComPtr<IMetaDataImport> metadataImport;
-    hr = this->corProfilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, reinterpret_cast<IUnknown**>(&metadataImport));
+    params[ILParamFunctionId] = reinterpret_cast<UINT_PTR>(func);
+    if (this->mode == CoverageMode::Sample)
+    {
+        params[ILParamEnterProbe] = reinterpret_cast<UINT_PTR>(SampleEnterMethodAddress);
+    }
+    else
+    {
+        params[ILParamEnterProbe] = reinterpret_cast<UINT_PTR>(EnterMethodAddress);
+        params[ILParamExitProbe] = reinterpret_cast<UINT_PTR>(LeaveMethodAddress);
+    }
 
-    HCORENUM position = nullptr;
-    mdMethodDef methodDef[50];
-    ULONG tokens;
+    if (this->mode == CoverageMode::Bitmap)
+        params[ILParamMethodProbe] = reinterpret_cast<UINT_PTR>(&module->hitMap[RidFromToken(token)]);
+    else if (this->mode == CoverageMode::Counter)
+    {
+        params[ILParamMethodProbe] = reinterpret_cast<UINT_PTR>(this->counters.SharedSlot(func->slot));
+        params[ILParamIncrement] = module->incrementRef;
+    }
 
-    hr = metadataImport->EnumMethods(&position, typeDef, methodDef, 50, &tokens);
+    params[ILParamEdgeMap] = reinterpret_cast<UINT_PTR>(this->edgeMap.Map());
+    params[ILParamEdgePrevious] = module->previousLocation;
 
-    for (ULONG i = 0; i < tokens; ++i)
+    if (this->mode == CoverageMode::Call || this->mode == CoverageMode::HitOnce || this->mode == CoverageMode::Sample)
     {
-        PCCOR_SIGNATURE sig;
-        ULONG blobSize, size, attributes;
-        WCHAR name[256];
-        DWORD flags;
-        ULONG codeRva;
-        metadataImport->GetMethodProps(methodDef[i], &typeDef, name, 256, &size, &attributes, &sig, &blobSize, &codeRva, &flags);
+        CComPtr<IMetaDataImport> metadataImport;
+        IfFailRet(this->corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
 
-        printf("Found Method %s::%s\r\n", typeName.c_str(), UnicodeToAnsi(name).c_str());
-    }
+        CComPtr<IMetaDataEmit> metadataEmit;
+        IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
 
+        mdSignature enterLeaveMethodSignatureToken;
+        IfFailRet(metadataEmit->GetTokenFromSig(enterLeaveMethodSignature, sizeof(enterLeaveMethodSignature), &enterLeaveMethodSignatureToken));
+        params[ILParamSignature] = enterLeaveMethodSignatureToken;
+    }
 
     return S_OK;
 }
 
-HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadStarted(ClassID classId)
+HRESULT CorProfiler::RewriteFunction(ModuleID moduleId, mdToken token, ModuleDetails* module, FunctionDetails* func, const UINT64* params, ILCapture* capture, ICorProfilerFunctionControl* functionControl)
 {
-    return S_OK;
+    if (this->blockCoverage)
+    {
+        auto kind = this->mode == CoverageMode::Bitmap ? ProbeKind::Flag : ProbeKind::Counter;
+        MethodBlockStorage storage(func, kind);
+        return RewriteILWithBlockProbes(this->corProfilerInfo, functionControl, moduleId, token, kind, params[ILParamMethodProbe], static_cast<mdMemberRef>(params[ILParamIncrement]), &storage, capture);
+    }
+
+    if (this->mode == CoverageMode::Edge)
+    {
+        // Block IDs must not depend on load order or addresses, so the seed
+        // is derived from the module name and the method token only.
+        ULONG32 seed = 2166136261u;
+        for (auto c : module->name)
+            seed = (seed ^ static_cast<BYTE>(c)) * 16777619u;
+        seed ^= token;
+
+        return RewriteILWithEdgeProbes(this->corProfilerInfo, functionControl, moduleId, token, params[ILParamEdgeMap], static_cast<mdFieldDef>(params[ILParamEdgePrevious]), this->edgeMap.Size(), seed, capture);
+    }
+
+    if (this->mode == CoverageMode::Counter)
+    {
+        return RewriteILWithCounter(this->corProfilerInfo, functionControl, moduleId, token, params[ILParamMethodProbe], static_cast<mdMemberRef>(params[ILParamIncrement]), capture);
+    }
+
+    if (this->mode == CoverageMode::Bitmap)
+    {
+        return RewriteILWithFlag(this->corProfilerInfo, functionControl, moduleId, token, params[ILParamMethodProbe], capture);
+    }
+
+    return RewriteIL(this->corProfilerInfo, functionControl, moduleId, token, params[ILParamFunctionId], params[ILParamEnterProbe], params[ILParamExitProbe], static_cast<ULONG32>(params[ILParamSignature]), capture);
 }
 
-HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadFinished(ClassID classId, HRESULT hrStatus)
+// Called by the control worker when the rules change. Methods not yet
+// JIT-compiled pick the rules up when they are; the rest are queued for a
+// ReJIT or a revert, whichever gives them the body they now want.
+void CorProfiler::ApplyControl()
 {
-    return S_OK;
+    std::lock_guard<std::mutex> guard(this->controlMutex);
+
+    size_t rejits = 0;
+    size_t reverts = 0;
+    for (const auto& [moduleId, module] : this->modules)
+    {
+        for (ULONG rid = 1; rid < module->methods.size(); rid++)
+        {
+            auto func = module->methods[rid];
+            if (func == nullptr)
+                continue;
+
+            bool enabled = this->controlFile.IsEnabled(module->name, this->names.Get(ResolveType(module, func->type)));
+            if (enabled == func->probesEnabled)
+                continue;
+
+            func->probesEnabled = enabled;
+            if (enabled == func->jitInstrumented)
+            {
+                this->rejitQueue.EnqueueRevert(moduleId, TokenFromRid(rid, mdtMethodDef));
+                reverts++;
+            }
+            else
+            {
+                this->rejitQueue.Enqueue(moduleId, TokenFromRid(rid, mdtMethodDef));
+                rejits++;
+            }
+        }
+    }
+
+    printf("Coverage control: %zu methods to ReJIT, %zu to revert\r\n", rejits, reverts);
 }
 
-HRESULT STDMETHODCALLTYPE CorProfiler::FunctionUnloadStarted(FunctionID functionId)
+HRESULT CorProfiler::InstrumentFunction(ModuleID moduleId, mdToken token, ModuleDetails* module, FunctionDetails* func)
 {
-    return S_OK;
+    LPCBYTE methodBytes;
+    ULONG methodSize;
+    IfFailRet(this->corProfilerInfo->GetILFunctionBody(moduleId, token, &methodBytes, &methodSize));
+
+    UINT64 params[ILParamCount];
+    IfFailRet(GetILParams(moduleId, token, module, func, params));
+
+    if (!this->ilCache.IsOpen())
+    {
+        return RewriteFunction(moduleId, token, module, func, params, nullptr, nullptr);
+    }
+
+    ILCacheKey key;
+    key.mvid = module->mvid;
+    key.method = token;
+    key.mode = static_cast<ULONG32>(this->mode) | (this->blockCoverage ? 0x100 : 0);
+    if (this->mode == CoverageMode::Edge)
+    {
+        // Block IDs are masked to the map, which the fuzzer sizes.
+        key.mode |= this->edgeMap.SizeBits() << 16;
+    }
+    key.ilHash = ILCache::Hash(methodBytes, methodSize);
+
+    ILCacheEntry entry;
+    if (this->ilCache.Find(key, entry))
+    {
+        if (this->blockCoverage)
+        {
+            MethodBlockStorage storage(func, this->mode == CoverageMode::Bitmap ? ProbeKind::Flag : ProbeKind::Counter);
+            params[ILParamBlockStorage] = storage.Allocate(std::vector<ILBlock>(entry.blocks, entry.blocks + entry.blockCount));
+        }
+
+        // Fails if an address in this process no longer fits an operand the
+        // cached body narrowed to 32 bits; rewriting from scratch fixes that.
+        auto relocated = SetRelocatedILBody(this->corProfilerInfo, moduleId, token, entry.body, entry.bodySize, entry.relocations, entry.relocationCount, params);
+        this->ilCache.Release();
+        if (SUCCEEDED(relocated))
+            return S_OK;
+    }
+
+    ILCapture capture;
+    auto hr = RewriteFunction(moduleId, token, module, func, params, &capture, nullptr);
+    if (SUCCEEDED(hr))
+        this->ilCache.Store(key, capture, func->blocks);
+
+    return hr;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock)
@@ -382,40 +1201,83 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID function
     ClassID classId;
     ModuleID moduleId;
 
+    // classId is 0 for shared generic code; the module and token are all
+    // that's needed, since probes are per methodDef.
     IfFailRet(this->corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &token));
-    
-    if (classId == 0) {
-        printf("Skipping generic JIT\n");
-        return S_OK;
+
+    //printf("Function JIT Compilation Started. %s (%llx, %i)\r\n", GetMethodName(functionId).c_str(), (UINT64)moduleId, token);
+
+    // Tracking starts here: the method's entry is created, and its type
+    // resolved, the first time it is compiled. SetILFunctionBody replaces
+    // the IL of the methodDef, so the first instantiation to be compiled
+    // instruments it for all the others, which must not instrument the
+    // already instrumented body again.
+    ModuleDetails* module;
+    FunctionDetails* func;
+    {
+        std::lock_guard<std::mutex> guard(this->controlMutex);
+
+        auto mod = this->modules.find(moduleId);
+        if (mod == this->modules.end()) return S_OK;
+        module = mod->second;
+
+        auto rid = RidFromToken(token);
+        if (rid >= module->methods.size() || module->methods[rid] != nullptr) return S_OK;
+
+        mdTypeDef type;
+        WCHAR name[256];
+        ULONG size;
+        if (FAILED(module->metadataImport->GetMethodProps(token, &type, name, 256, &size, nullptr, nullptr, nullptr, nullptr, nullptr)))
+            return S_OK;
+
+        auto typeName = ResolveType(module, type);
+        if (typeName == StringPool::Empty) return S_OK;
+        if (this->filter.HasMethodRules())
+        {
+            char methodName[256 * MaxUtf8PerUtf16 + 1];
+            methodName[Utf16ToUtf8(name, Utf16Length(name), methodName)] = 0;
+            if (!this->filter.IncludesMethod(module->typeRules[RidFromToken(type)], methodName)) return S_OK;
+        }
+
+        // Still needed in bitmap mode, which probes hitMap directly: the
+        // control state, the original IL and the block flags live here.
+        auto slot = module->counterBase != CounterStore::InvalidSlot ? module->counterBase + rid : CounterStore::InvalidSlot;
+        func = new FunctionDetails(module, type, token, slot);
+        func->jitInstrumented = !this->controlFile.IsOpen() || this->controlFile.IsEnabled(module->name, this->names.Get(typeName));
+        func->probesEnabled = func->jitInstrumented;
+
+        // GetILFunctionBody returns our rewritten IL once SetILFunctionBody
+        // has been called, so keep the original for the ReJIT. It is saved
+        // before the entry is published, since the control worker may queue
+        // a ReJIT for the method as soon as it can see it.
+        if (func->jitInstrumented && (this->mode == CoverageMode::HitOnce || this->controlFile.IsOpen()))
+        {
+            LPCBYTE methodBytes;
+            ULONG methodSize;
+            if (SUCCEEDED(this->corProfilerInfo->GetILFunctionBody(moduleId, token, &methodBytes, &methodSize)))
+                func->originalIL.assign(methodBytes, methodBytes + methodSize);
+        }
+
+        module->methods[rid] = func;
+        if (!func->jitInstrumented)
+            return S_OK;
     }
-    mdTypeDef typeDef;
-    ClassID pParentClassId;
-    ULONG32 cNumTypeArgs;
-    ULONG32 pcNumTypeArgs;
-    ClassID typeArgs[50];  
-    IfFailRet(this->corProfilerInfo->GetClassIDInfo2(classId, &moduleId, &typeDef, &pParentClassId, 50, &pcNumTypeArgs, typeArgs));
-    
-    CComPtr<IMetaDataImport> metadataImport;
-    IfFailRet(this->corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
 
-    CComPtr<IMetaDataEmit> metadataEmit;
-    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
-    
-    auto mod = this->modules.find(moduleId);
-    if(mod == this->modules.end()) return S_OK;
-    
-    auto type = mod->second->types.find(typeDef);
-    if(type == mod->second->types.end()) return S_OK;
-    
-    auto func = type->second->functions.find(token);
-    if (func == type->second->functions.end()) return S_OK;
-    
-    //printf("Function JIT Compilation Started. %s (%llx, %i, %i)\r\n", GetMethodName(functionId).c_str(), (UINT64)moduleId, typeDef, token);
-    
-    mdSignature enterLeaveMethodSignatureToken;
-    metadataEmit->GetTokenFromSig(enterLeaveMethodSignature, sizeof(enterLeaveMethodSignature), &enterLeaveMethodSignatureToken);
+    hr = InstrumentFunction(moduleId, token, module, func);
+    {
+        std::lock_guard<std::mutex> guard(this->controlMutex);
+        if (SUCCEEDED(hr))
+        {
+            func->instrumented = true;
+        }
+        else
+        {
+            func->jitInstrumented = false;
+            func->probesEnabled = false;
+        }
+    }
 
-    return RewriteIL(this->corProfilerInfo, nullptr, moduleId, token, functionId, reinterpret_cast<ULONGLONG>(EnterMethodAddress), reinterpret_cast<ULONGLONG>(LeaveMethodAddress), enterLeaveMethodSignatureToken);
+    return hr;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
@@ -720,7 +1582,61 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ReJITCompilationStarted(FunctionID functi
 
 HRESULT STDMETHODCALLTYPE CorProfiler::GetReJITParameters(ModuleID moduleId, mdMethodDef methodId, ICorProfilerFunctionControl *pFunctionControl)
 {
-    return S_OK;
+    // Only methods already JIT-compiled are queued, so the entry exists.
+    // The original IL is taken under the lock, like the rest of the entry.
+    ModuleDetails* module;
+    FunctionDetails* func;
+    bool jitInstrumented;
+    std::vector<BYTE> originalIL;
+    {
+        std::lock_guard<std::mutex> guard(this->controlMutex);
+
+        auto mod = this->modules.find(moduleId);
+        if (mod == this->modules.end()) return S_OK;
+        module = mod->second;
+
+        func = module->GetMethod(methodId);
+        if (func == nullptr) return S_OK;
+
+        jitInstrumented = func->jitInstrumented;
+
+        // The method has been hit and is recompiled without probes, after
+        // which the saved IL is no longer needed. Runtime control keeps it,
+        // since probes may be turned back on with a revert and off again.
+        if (this->mode == CoverageMode::HitOnce)
+            originalIL.swap(func->originalIL);
+        else if (jitInstrumented)
+            originalIL = func->originalIL;
+    }
+
+    if (this->mode == CoverageMode::HitOnce)
+    {
+        if (originalIL.empty()) return S_OK;
+
+        // The runtime copies the body.
+        return pFunctionControl->SetILFunctionBody(static_cast<ULONG>(originalIL.size()), originalIL.data());
+    }
+
+    // Runtime control only asks for a ReJIT to give the method the opposite
+    // of the body it was first JIT-compiled with.
+    if (jitInstrumented)
+    {
+        // Probes are turned off.
+        if (originalIL.empty()) return E_FAIL;
+        return pFunctionControl->SetILFunctionBody(static_cast<ULONG>(originalIL.size()), originalIL.data());
+    }
+
+    UINT64 params[ILParamCount];
+    IfFailRet(GetILParams(moduleId, methodId, module, func, params));
+
+    auto hr = RewriteFunction(moduleId, methodId, module, func, params, nullptr, pFunctionControl);
+    if (SUCCEEDED(hr))
+    {
+        std::lock_guard<std::mutex> guard(this->controlMutex);
+        func->instrumented = true;
+    }
+
+    return hr;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ReJITCompilationFinished(FunctionID functionId, ReJITID rejitId, HRESULT hrStatus, BOOL fIsSafeToBlock)
@@ -778,7 +1694,7 @@ std::string CorProfiler::GetTypeName(mdTypeDef type, ModuleID module) const {
         DWORD flags;
         mdTypeDef baseType;
         if (SUCCEEDED(spMetadata->GetTypeDefProps(type, name, 256, &nameSize, &flags, &baseType))) {
-            return UnicodeToAnsi(name);
+            return Utf16ToUtf8(name);
         }
     }
     return "";
@@ -806,5 +1722,5 @@ std::string CorProfiler::GetMethodName(FunctionID function) const {
     if (FAILED(spMetadata->GetMethodProps(token, &type, name, 256, &size, &attributes, &sig, &blobSize, &codeRva, &flags)))
         return "Unknown Method Props";
 
-    return GetTypeName(type, module) + "::" + UnicodeToAnsi(name);
+    return GetTypeName(type, module) + "::" + Utf16ToUtf8(name);
 }
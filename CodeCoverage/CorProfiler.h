@@ -1,34 +1,227 @@
 #pragma once
 
 #include <atomic>
+#include <cstring>
 #include <functional>
+#include <memory>
 #include <string>
 #include <map>
+#include <mutex>
+#include <vector>
 #include "cor.h"
 #include "corprof.h"
+#include "CComPtr.h"
+#include "ControlFile.h"
+#include "CounterStore.h"
+#include "CoverageFilter.h"
+#include "EdgeMap.h"
+#include "ILCache.h"
+#include "ILRewriter.h"
+#include "MetadataScanner.h"
+#include "PortablePdb.h"
+#include "ReJitQueue.h"
+#include "StringPool.h"
 
+struct ModuleDetails;
+
+// Created when a method is first JIT-compiled; methods that never run are
+// not tracked at all.
 struct FunctionDetails
+{
+    ModuleDetails* module;
+    mdTypeDef type;
+    mdMethodDef token;
+    size_t slot;
+
+    // Guarded by CorProfiler::controlMutex: whether a body with probes was
+    // set, and the method body as it was before instrumentation, handed
+    // back to the runtime on ReJIT.
+    bool instrumented;
+    std::vector<BYTE> originalIL;
+
+    // Hit-once mode: set by the first Enter.
+    std::atomic<bool> hit;
+
+    // Block coverage: the method's basic blocks and one counter or flag per
+    // block, filled in when the method is JIT-compiled.
+    std::vector<ILBlock> blocks;
+    std::vector<UINT64> blockCounters;
+    std::vector<BYTE> blockHits;
+
+    // Guarded by CorProfiler::controlMutex: whether the first body the
+    // method was JIT-compiled with has probes, and whether probes are
+    // wanted now. When they differ the method runs a ReJIT body; setting
+    // them equal again means a revert. The IL belongs to the methodDef, so
+    // generic instantiations compiled later share the body.
+    bool jitInstrumented;
+    bool probesEnabled;
+
+    FunctionDetails(ModuleDetails* module, mdTypeDef type, mdMethodDef token, size_t slot): module(module), type(type), token(token), slot(slot),
+        instrumented(false), hit(false), jitInstrumented(false), probesEnabled(false) {}
+};
+
+// Every method of a module as the reports name it, read from metadata in
+// the background after the module loads. One column per field, indexed by
+// methodDef RID, with names held in the profiler's string pool. Methods
+// that are not covered have an empty name and are not listed.
+struct MethodTable
+{
+    std::vector<StringPool::Id> types;
+    std::vector<StringPool::Id> names;
+
+    // Compiler-generated methods (lambdas, local functions, state machine
+    // methods): the RID of the user-written method they belong to, or 0. A
+    // resume is a state machine's MoveNext, whose calls are resumes of the
+    // source method rather than invocations.
+    std::vector<ULONG> sources;
+    std::vector<BYTE> resumes;
+
+    explicit MethodTable(size_t count): types(count, StringPool::Empty), names(count, StringPool::Empty), sources(count, 0), resumes(count, 0) {}
+};
+
+// An assembly build, as opposed to one load of it.
+struct ModuleKey
 {
     std::string name;
-    ULONG invocations;
+    GUID mvid;
+
+    bool operator< (const ModuleKey& other) const
+    {
+        if (name != other.name)
+            return name < other.name;
+        return memcmp(&mvid, &other.mvid, sizeof(GUID)) < 0;
+    }
+};
 
-    FunctionDetails(std::string name): name(name), invocations(0) {}
+// The blocks of a method and their hits over every load.
+struct BlockCoverage
+{
+    std::vector<ILBlock> blocks;
+    std::vector<UINT64> hits;
 };
 
-struct ClassDetails
+// What the reports need of an assembly, created at its first load and kept
+// after it unloads. Every load of the same build shares the entry and its
+// range of counters, so hits add up across collectible load contexts and
+// memory grows with the number of distinct assemblies, not of loads. The
+// rest is folded in from ModuleDetails when a load goes away, under
+// CorProfiler::controlMutex.
+struct ModuleCoverage
 {
     std::string name;
-    std::map<mdToken, FunctionDetails*> functions;
+    size_t counterBase;
+    ULONG samplingPeriod;
+    std::unique_ptr<MethodTable> methods;
+
+    // Sample mode: the per-thread countdown this assembly uses, shared by
+    // all its loads as the counters are.
+    ULONG samplerIndex;
+
+    // Bitmap mode: the hit flags of every load, or'ed together.
+    std::vector<BYTE> hitMap;
+
+    // Indexed by methodDef RID: whether any load instrumented the method.
+    std::vector<BYTE> instrumented;
+
+    // Keyed by methodDef RID.
+    std::map<ULONG, BlockCoverage> blocks;
+
+    // Only opened if line coverage is exported.
+    PortablePdb pdb;
+
+    ModuleCoverage(std::string name, std::string pdbPath, size_t counterBase, ULONG samplingPeriod, ULONG samplerIndex): name(name), counterBase(counterBase), samplingPeriod(samplingPeriod),
+        samplerIndex(samplerIndex), pdb(pdbPath) {}
 
-    ClassDetails(std::string name): name(name) {}
+    UINT64 GetInvocations(CounterStore& counters, ULONG rid)
+    {
+        if (counterBase == CounterStore::InvalidSlot)
+            return rid < hitMap.size() ? hitMap[rid] : 0;
+        return counters.Read(counterBase + rid) * samplingPeriod;
+    }
 };
 
 struct ModuleDetails
 {
+    ModuleID id;
     std::string name;
-    std::map<ModuleID, ClassDetails*> types;
-    
-    ModuleDetails(std::string name): name(name) {}
+    GUID mvid;
+    CoverageFilter::RuleSet rules;
+    CComPtr<IMetaDataImport> metadataImport;
+
+    // Indexed by methodDef RID, null until the method is first compiled.
+    // Sized once at load so the table never moves; the counter slot of a
+    // method is counterBase + RID. Entries are added under
+    // CorProfiler::controlMutex.
+    std::vector<FunctionDetails*> methods;
+    size_t counterBase;
+
+    // Indexed by typeDef RID: each type's full name and the filter rules
+    // that apply to its methods, resolved on first use under
+    // CorProfiler::controlMutex. Types that are not covered resolve to an
+    // empty name.
+    std::vector<BYTE> typeResolved;
+    std::vector<StringPool::Id> typeNames;
+    std::vector<CoverageFilter::RuleSet> typeRules;
+
+    // Published by the metadata scanner once complete, null until then.
+    // Held while the table is built, so an unload waits for the scan.
+    std::atomic<MethodTable*> methodTable;
+    std::mutex scanMutex;
+
+    ModuleCoverage* coverage;
+
+    // Bitmap mode: one hit flag per methodDef RID, in place of counters. A
+    // byte rather than a bit, so setting a flag never needs a
+    // read-modify-write that could lose a concurrent hit. This byte is the
+    // only per-method cost of a module at load; FunctionDetails exists only
+    // for methods that are JIT-compiled, and names are pooled columns in
+    // the MethodTable, shared by every mode.
+    std::vector<BYTE> hitMap;
+
+    // Sample mode: one call in samplingPeriod is recorded, using the
+    // per-thread countdown at samplerIndex. Copied from the coverage so
+    // the probe reads them without another indirection.
+    ULONG samplingPeriod;
+    ULONG samplerIndex;
+
+    // Counter mode: memberref to Interlocked.Increment(ref long), defined in
+    // the module at load, which the inline counter probes call.
+    mdMemberRef incrementRef;
+
+    // Edge mode: the thread-static uint32 that the module's edge probes
+    // keep the location of the previous block in, shifted right by one as
+    // in AFL. Defined in the module at load.
+    mdFieldDef previousLocation;
+
+    ModuleDetails(ModuleID id, std::string name, GUID mvid, ULONG methodCount, ULONG typeCount, ModuleCoverage* coverage): id(id), name(name), mvid(mvid), rules(0),
+        methods(methodCount + 1, nullptr), counterBase(coverage->counterBase), typeResolved(typeCount + 1, 0), typeNames(typeCount + 1, StringPool::Empty), typeRules(typeCount + 1, 0),
+        methodTable(nullptr), coverage(coverage), samplingPeriod(coverage->samplingPeriod), samplerIndex(coverage->samplerIndex),
+        incrementRef(mdMemberRefNil), previousLocation(mdFieldDefNil) {}
+
+    ~ModuleDetails()
+    {
+        for (auto method : methods)
+            delete method;
+        delete methodTable.load();
+    }
+
+    FunctionDetails* GetMethod(mdMethodDef token)
+    {
+        auto rid = RidFromToken(token);
+        if (rid >= methods.size())
+            return nullptr;
+        return methods[rid];
+    }
+};
+
+enum class CoverageMode
+{
+    Call,       // calli into the native Enter probe on every invocation
+    Counter,    // inline IL interlocked increment of the method's counter, no native call
+    HitOnce,    // native probe until the first call, then ReJIT without probes
+    Bitmap,     // inline IL test-before-set of the method's hit flag
+    Sample,     // native probe that records one call in N per thread
+    Edge        // inline IL AFL-style edge probes into a shared-memory map
 };
 
 class CorProfiler : public ICorProfilerCallback8
@@ -36,14 +229,42 @@ class CorProfiler : public ICorProfilerCallback8
 private:
     std::atomic<int> refCount;
     ICorProfilerInfo8* corProfilerInfo;
+    CoverageMode mode;
+    bool blockCoverage;
+    bool lineCoverage;
+
+    ULONG defaultSamplingPeriod;
+    std::map<std::string, ULONG> samplingPeriods;
+    ULONG nextSamplerIndex;
 
     std::string GetTypeName(mdTypeDef type, ModuleID module) const;
     std::string GetMethodName(FunctionID function) const;
+    HRESULT GetILParams(ModuleID moduleId, mdToken token, ModuleDetails* module, FunctionDetails* func, UINT64* params);
+    HRESULT RewriteFunction(ModuleID moduleId, mdToken token, ModuleDetails* module, FunctionDetails* func, const UINT64* params, ILCapture* capture, ICorProfilerFunctionControl* functionControl);
+    HRESULT InstrumentFunction(ModuleID moduleId, mdToken token, ModuleDetails* module, FunctionDetails* func);
+    StringPool::Id ResolveType(ModuleDetails* module, mdTypeDef type);
+    void ResolveMethods(ModuleDetails* module, MethodTable& methods);
+    void RetireModule(ModuleDetails* module);
+    void WriteLineCoverage();
+    void ApplyControl();
 
-    static CorProfiler* _profiler;
+    static std::atomic<CorProfiler*> _profiler;
 
-    std::map<mdToken, FunctionDetails*> functions;
-    std::map<mdToken, ModuleDetails*> modules;
+    std::map<ModuleID, ModuleDetails*> modules;
+    std::map<ModuleKey, ModuleCoverage> coverage;
+    CoverageFilter filter;
+    StringPool names;
+    CounterStore counters;
+    ReJitQueue rejitQueue;
+    MetadataScanner metadataScanner;
+    EdgeMap edgeMap;
+    ILCache ilCache;
+
+    // Turns probes on and off at runtime; see ControlFile. controlMutex
+    // also guards the module and coverage maps and the lazily filled parts
+    // of modules.
+    ControlFile controlFile;
+    std::mutex controlMutex;
 
 public:
     CorProfiler();
@@ -51,8 +272,18 @@ public:
 
     static CorProfiler* Get();
 
-    void STDMETHODCALLTYPE Enter(FunctionID functionId);
-    void STDMETHODCALLTYPE Leave(FunctionID functionId);
+    // The counter store is aligned to cache lines, which new only honours
+    // from C++17 on.
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
+    void STDMETHODCALLTYPE Enter(FunctionDetails* function);
+    void STDMETHODCALLTYPE Leave(FunctionDetails* function);
+    void RecordSample(FunctionDetails* function);
+
+    // Countdowns are per thread and per sampled assembly. Those of the
+    // first this many assemblies are reached without a table lookup.
+    static constexpr ULONG InlineSamplers = 64;
 
 
     HRESULT STDMETHODCALLTYPE Initialize(IUnknown* pICorProfilerInfoUnk) override;
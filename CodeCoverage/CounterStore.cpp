@@ -0,0 +1,169 @@
+#include <cassert>
+#include <new>
+#include "CounterStore.h"
+#include "profiler_pal.h"
+
+thread_local CounterStore::ShardLease CounterStore::lease;
+std::atomic<size_t> CounterStore::nextId(0);
+
+CounterStore::Shard::Shard() : owned(false), next(nullptr)
+{
+    for (auto& chunk : chunks)
+    {
+        chunk.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+void* CounterStore::Shard::operator new(size_t size)
+{
+    auto p = AlignedAlloc(size, alignof(Shard));
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void CounterStore::Shard::operator delete(void* p)
+{
+    AlignedFree(p);
+}
+
+CounterStore::ShardLease::~ShardLease()
+{
+    for (auto& entry : entries)
+    {
+        entry.shard->owned.store(false, std::memory_order_release);
+    }
+}
+
+CounterStore::CounterStore() : id(nextId.fetch_add(1, std::memory_order_relaxed)), nextSlot(0), shards(nullptr)
+{
+    shared.owned.store(true, std::memory_order_relaxed);
+}
+
+size_t CounterStore::Reserve(size_t count)
+{
+    auto first = nextSlot.fetch_add(count, std::memory_order_relaxed);
+    if (first + count > MaxSlots)
+    {
+        return InvalidSlot;
+    }
+    return first;
+}
+
+void CounterStore::Increment(size_t slot)
+{
+    assert(slot < MaxSlots);
+
+    // Almost always a single entry, as the profiler has a single store.
+    Shard* shard = nullptr;
+    for (auto& entry : lease.entries)
+    {
+        if (entry.store == this->id)
+        {
+            shard = entry.shard;
+            break;
+        }
+    }
+
+    if (shard == nullptr)
+    {
+        shard = AcquireShard();
+    }
+
+    // Only the owning thread writes to a shard, so a relaxed load/store pair
+    // is exact and avoids a locked instruction.
+    auto chunk = GetChunk(shard, slot / SlotsPerChunk);
+    auto& counter = chunk[slot % SlotsPerChunk];
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+UINT64* CounterStore::SharedSlot(size_t slot)
+{
+    assert(slot < MaxSlots);
+    auto chunk = GetChunk(&shared, slot / SlotsPerChunk);
+    return reinterpret_cast<UINT64*>(&chunk[slot % SlotsPerChunk]);
+}
+
+UINT64 CounterStore::Read(size_t slot)
+{
+    if (slot >= MaxSlots)
+    {
+        return 0;
+    }
+
+    auto index = slot / SlotsPerChunk;
+    auto offset = slot % SlotsPerChunk;
+    UINT64 total = 0;
+
+    auto chunk = shared.chunks[index].load(std::memory_order_acquire);
+    if (chunk != nullptr)
+    {
+        total += chunk[offset].load(std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> guard(shardsMutex);
+    for (auto shard = shards; shard != nullptr; shard = shard->next)
+    {
+        chunk = shard->chunks[index].load(std::memory_order_acquire);
+        if (chunk != nullptr)
+        {
+            total += chunk[offset].load(std::memory_order_relaxed);
+        }
+    }
+
+    return total;
+}
+
+CounterStore::Shard* CounterStore::AcquireShard()
+{
+    std::lock_guard<std::mutex> guard(shardsMutex);
+
+    // Reuse a shard left behind by a thread that has exited, so thread churn
+    // does not grow the store.
+    Shard* shard = nullptr;
+    for (auto candidate = shards; candidate != nullptr; candidate = candidate->next)
+    {
+        bool expected = false;
+        if (candidate->owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+        {
+            shard = candidate;
+            break;
+        }
+    }
+
+    if (shard == nullptr)
+    {
+        shard = new Shard();
+        shard->owned.store(true, std::memory_order_relaxed);
+        shard->next = shards;
+        shards = shard;
+    }
+
+    lease.entries.push_back({ this->id, shard });
+    return shard;
+}
+
+std::atomic<UINT64>* CounterStore::GetChunk(Shard* shard, size_t index)
+{
+    auto chunk = shard->chunks[index].load(std::memory_order_acquire);
+    if (chunk != nullptr)
+    {
+        return chunk;
+    }
+
+    // Allocated and zeroed by the calling thread so the pages are first
+    // touched, and therefore placed, on its NUMA node.
+    auto fresh = new std::atomic<UINT64>[SlotsPerChunk];
+    for (size_t i = 0; i < SlotsPerChunk; i++)
+    {
+        fresh[i].store(0, std::memory_order_relaxed);
+    }
+
+    if (!shard->chunks[index].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+    {
+        // Another JIT thread populated the shared shard first.
+        delete[] fresh;
+        return chunk;
+    }
+    return fresh;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include "cor.h"
+
+// Invocation counters sharded per thread. Every thread that bumps a counter
+// owns a shard of its own, so increments never contend and are exact. Shard
+// chunks are allocated and zeroed by the owning thread on first use, which
+// keeps them on that thread's NUMA node under a first-touch policy. Readers
+// merge all shards lazily.
+//
+// Shard 0 is shared and is never handed to a thread: it backs the counter
+// addresses that are baked into IL by the inline counter probe, which keeps
+// them exact by incrementing them with Interlocked.Increment.
+//
+// Any number of stores may exist at once; a thread holds one lease per
+// store it has incremented.
+class CounterStore
+{
+public:
+    static constexpr size_t CacheLineSize = 64;
+    static constexpr size_t SlotsPerChunk = 4096;
+    static constexpr size_t MaxChunks = 1024;
+    static constexpr size_t MaxSlots = SlotsPerChunk * MaxChunks;
+    static constexpr size_t InvalidSlot = static_cast<size_t>(-1);
+
+    CounterStore();
+
+    CounterStore(const CounterStore&) = delete;
+    CounterStore& operator= (const CounterStore&) = delete;
+
+    // Reserves count consecutive slots and returns the first one, or
+    // InvalidSlot when the store is full.
+    size_t Reserve(size_t count);
+
+    // Adds one to slot in the calling thread's shard. slot must have been
+    // returned by Reserve, never InvalidSlot.
+    void Increment(size_t slot);
+
+    // Stable address of slot in the shared shard. Writers must increment it
+    // atomically.
+    UINT64* SharedSlot(size_t slot);
+
+    // Sum of slot over all shards.
+    UINT64 Read(size_t slot);
+
+private:
+    struct alignas(CacheLineSize) Shard
+    {
+        std::atomic<std::atomic<UINT64>*> chunks[MaxChunks];
+        std::atomic<bool> owned;
+        Shard* next;
+
+        Shard();
+
+        // Cache-line alignment, which new only honours from C++17 on.
+        static void* operator new(size_t size);
+        static void operator delete(void* p);
+    };
+
+    // The shards a thread owns, one per store, keyed by store ID rather
+    // than address so a store allocated where another one was freed does
+    // not inherit its shards. They are returned to their pools when the
+    // thread exits. Shards live for the lifetime of the process, so this
+    // never touches freed memory.
+    struct ShardLease
+    {
+        struct Entry
+        {
+            size_t store;
+            Shard* shard;
+        };
+
+        std::vector<Entry> entries;
+        ~ShardLease();
+    };
+
+    static thread_local ShardLease lease;
+    static std::atomic<size_t> nextId;
+
+    const size_t id;
+    std::atomic<size_t> nextSlot;
+    Shard shared;
+    Shard* shards;
+    std::mutex shardsMutex;
+
+    Shard* AcquireShard();
+    static std::atomic<UINT64>* GetChunk(Shard* shard, size_t index);
+};
@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include "CoverageFilter.h"
+
+CoverageFilter::CoverageFilter() : includes(0), anyType(0), anyMethod(0), methodRules(0)
+{
+}
+
+void CoverageFilter::Compile(const std::string& rules)
+{
+    std::vector<std::string> modulePatterns;
+    std::vector<std::string> typePatterns;
+    std::vector<std::string> methodPatterns;
+
+    size_t start = 0;
+    while (start < rules.length())
+    {
+        auto end = rules.find_first_of("; \t\r\n", start);
+        if (end == std::string::npos)
+            end = rules.length();
+
+        auto rule = rules.substr(start, end - start);
+        start = end + 1;
+        if (rule.empty())
+            continue;
+
+        if (modulePatterns.size() == MaxRules)
+        {
+            printf("Coverage filter: more than %zu rules, ignoring %s\r\n", MaxRules, rule.c_str());
+            continue;
+        }
+
+        RuleSet bit = RuleSet(1) << modulePatterns.size();
+        size_t position = 0;
+        if (rule[0] == '+' || rule[0] == '-')
+            position++;
+        if (rule[0] != '-')
+            includes |= bit;
+
+        std::string module = "*";
+        if (position < rule.length() && rule[position] == '[')
+        {
+            auto close = rule.find(']', position);
+            if (close == std::string::npos)
+            {
+                printf("Coverage filter: missing ']' in %s\r\n", rule.c_str());
+                includes &= ~bit;
+                continue;
+            }
+            module = rule.substr(position + 1, close - position - 1);
+            position = close + 1;
+        }
+
+        std::string type = rule.substr(position);
+        std::string method = "*";
+        auto separator = type.find("::");
+        if (separator != std::string::npos)
+        {
+            method = type.substr(separator + 2);
+            type.resize(separator);
+        }
+
+        if (module.empty())
+            module = "*";
+        if (type.empty())
+            type = "*";
+        if (method.empty())
+            method = "*";
+
+        if (type == "*")
+            anyType |= bit;
+        if (method == "*")
+            anyMethod |= bit;
+        else
+            methodRules |= bit;
+
+        modulePatterns.push_back(module);
+        typePatterns.push_back(type);
+        methodPatterns.push_back(method);
+    }
+
+    modules.Compile(modulePatterns);
+    types.Compile(typePatterns);
+    methods.Compile(methodPatterns);
+}
+
+CoverageFilter::RuleSet CoverageFilter::MatchModule(const std::string& module) const
+{
+    auto rules = modules.Match(module.c_str());
+    if ((rules & includes) == 0 || (rules & ~includes & anyType & anyMethod) != 0)
+        return 0;
+    return rules;
+}
+
+CoverageFilter::RuleSet CoverageFilter::MatchType(RuleSet module, const std::string& type) const
+{
+    auto rules = module & types.Match(type.c_str());
+    if ((rules & includes) == 0 || (rules & ~includes & anyMethod) != 0)
+        return 0;
+    return rules;
+}
+
+bool CoverageFilter::IncludesMethod(RuleSet type, const char* method) const
+{
+    auto rules = type & methods.Match(method);
+    return (rules & includes) != 0 && (rules & ~includes) == 0;
+}
+
+// Subset construction over the glob NFAs. An NFA state is a position in
+// one pattern; a DFA state is the sorted set of positions still alive.
+void CoverageFilter::Automaton::Compile(const std::vector<std::string>& patterns)
+{
+    transitions.clear();
+    accepting.clear();
+    fallback.clear();
+
+    // Every byte used literally gets a class of its own; the rest share
+    // class 0, which only '*' and '?' match. '*' and '?' never get a class,
+    // so there are at most 255 classes and each fits in a byte.
+    memset(classes, 0, sizeof(classes));
+    classCount = 1;
+    for (const auto& pattern : patterns)
+    {
+        for (auto c : pattern)
+        {
+            auto byte = static_cast<uint8_t>(c);
+            if (c != '*' && c != '?' && classes[byte] == 0)
+                classes[byte] = static_cast<uint8_t>(classCount++);
+        }
+    }
+    assert(classCount <= 255);
+
+    // Positions are numbered consecutively across the patterns.
+    std::vector<uint32_t> offsets;
+    uint32_t positions = 0;
+    for (const auto& pattern : patterns)
+    {
+        offsets.push_back(positions);
+        positions += static_cast<uint32_t>(pattern.length()) + 1;
+    }
+
+    // Adds the position, and those after any run of '*' it starts, which
+    // match the empty string.
+    auto close = [&](std::vector<uint32_t>& set, size_t k, size_t i)
+    {
+        set.push_back(offsets[k] + static_cast<uint32_t>(i));
+        while (i < patterns[k].length() && patterns[k][i] == '*')
+            set.push_back(offsets[k] + static_cast<uint32_t>(++i));
+    };
+
+    auto normalize = [](std::vector<uint32_t>& set)
+    {
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+    };
+
+    std::vector<std::vector<uint32_t>> states(1);
+    for (size_t k = 0; k < patterns.size(); k++)
+        close(states[0], k, 0);
+    normalize(states[0]);
+
+    std::map<std::vector<uint32_t>, uint32_t> known;
+    known[states[0]] = 0;
+
+    for (size_t state = 0; state < states.size(); state++)
+    {
+        RuleSet accepts = 0;
+        for (size_t k = 0; k < patterns.size(); k++)
+        {
+            auto end = offsets[k] + static_cast<uint32_t>(patterns[k].length());
+            if (std::binary_search(states[state].begin(), states[state].end(), end))
+                accepts |= RuleSet(1) << k;
+        }
+        accepting.push_back(accepts);
+
+        for (size_t c = 0; c < classCount; c++)
+        {
+            std::vector<uint32_t> next;
+            size_t k = 0;
+            for (auto position : states[state])
+            {
+                while (k + 1 < patterns.size() && position >= offsets[k + 1])
+                    k++;
+
+                size_t i = position - offsets[k];
+                if (i == patterns[k].length())
+                    continue;
+
+                auto p = patterns[k][i];
+                if (p == '*')
+                    close(next, k, i);
+                else if (p == '?' || classes[static_cast<uint8_t>(p)] == c)
+                    close(next, k, i + 1);
+            }
+            normalize(next);
+
+            auto found = known.find(next);
+            uint32_t target;
+            if (found != known.end())
+            {
+                target = found->second;
+            }
+            else if (states.size() == MaxStates)
+            {
+                printf("Coverage filter: rules need more than %zu states, matching them one by one\r\n", MaxStates);
+                transitions.clear();
+                accepting.clear();
+                fallback = patterns;
+                return;
+            }
+            else
+            {
+                target = static_cast<uint32_t>(states.size());
+                known[next] = target;
+                states.push_back(next);
+            }
+            transitions.push_back(target);
+        }
+    }
+}
+
+CoverageFilter::RuleSet CoverageFilter::Automaton::Match(const char* text) const
+{
+    if (!fallback.empty())
+    {
+        RuleSet rules = 0;
+        for (size_t k = 0; k < fallback.size(); k++)
+        {
+            if (MatchGlob(fallback[k].c_str(), text))
+                rules |= RuleSet(1) << k;
+        }
+        return rules;
+    }
+
+    uint32_t state = 0;
+    for (; *text != 0; text++)
+        state = transitions[state * classCount + classes[static_cast<uint8_t>(*text)]];
+    return accepting[state];
+}
+
+// Backtracks to the last '*' only, so a match is linear in the text for
+// each '*' in the pattern.
+bool CoverageFilter::Automaton::MatchGlob(const char* pattern, const char* text)
+{
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (*text != 0)
+    {
+        if (*pattern == '*')
+        {
+            star = ++pattern;
+            resume = text;
+        }
+        else if (*pattern != 0 && (*pattern == '?' || *pattern == *text))
+        {
+            pattern++;
+            text++;
+        }
+        else if (star != nullptr)
+        {
+            pattern = star;
+            text = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == 0;
+}
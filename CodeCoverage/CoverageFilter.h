@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Selects the modules, types and methods to cover. Rules are compiled once
+// into automata, so checking a name costs one table lookup per character
+// whatever the number of rules.
+//
+// Rules are separated by ';' or whitespace. Each is an optional '+'
+// (include) or '-' (exclude), then [module]type::method, where each part
+// is a glob in which '*' matches any run of characters and '?' any one.
+// A missing part matches everything: [MyApp.dll] is the whole module,
+// -[*]MyApp.Generated.* a namespace in every module and
+// [*]MyApp.Worker::Run one method. Type names are full names, with nested
+// types joined by '+'. A name is covered when an include rule matches it
+// and no exclude rule does.
+class CoverageFilter
+{
+public:
+    // One bit per rule: the rules that still apply to a module or type.
+    typedef uint64_t RuleSet;
+    static constexpr size_t MaxRules = 64;
+
+    CoverageFilter();
+
+    CoverageFilter(const CoverageFilter&) = delete;
+    CoverageFilter& operator= (const CoverageFilter&) = delete;
+
+    void Compile(const std::string& rules);
+
+    // The rules that apply to the module, or none if it is not covered.
+    RuleSet MatchModule(const std::string& module) const;
+
+    // Narrows the module's rules to those that apply to the type, or none
+    // if the type is not covered.
+    RuleSet MatchType(RuleSet module, const std::string& type) const;
+
+    // Whether the method of a type with the given rules is covered.
+    bool IncludesMethod(RuleSet type, const char* method) const;
+
+    // Whether any rule names methods; if not, every method of a covered
+    // type is covered and IncludesMethod need not be called.
+    bool HasMethodRules() const { return methodRules != 0; }
+
+private:
+    // A DFA over the patterns of one part of every rule. Characters that
+    // appear in no pattern share a class, which keeps the table small.
+    // Patterns with many '*' can need exponentially many states; past
+    // MaxStates the DFA is dropped and each pattern is matched in turn.
+    class Automaton
+    {
+    public:
+        static constexpr size_t MaxStates = 4096;
+
+        void Compile(const std::vector<std::string>& patterns);
+        RuleSet Match(const char* text) const;
+
+    private:
+        uint8_t classes[256];
+        size_t classCount;
+        std::vector<uint32_t> transitions;
+        std::vector<RuleSet> accepting;
+
+        // Only kept when the DFA was too large.
+        std::vector<std::string> fallback;
+
+        static bool MatchGlob(const char* pattern, const char* text);
+    };
+
+    Automaton modules;
+    Automaton types;
+    Automaton methods;
+
+    RuleSet includes;
+
+    // Rules whose type or method part is '*': an exclude among them rules
+    // out the whole module or type.
+    RuleSet anyType;
+    RuleSet anyMethod;
+
+    // Rules whose method part is not '*'.
+    RuleSet methodRules;
+};
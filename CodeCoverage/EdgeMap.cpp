@@ -0,0 +1,74 @@
+#include <cstdio>
+#include "EdgeMap.h"
+#ifndef WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+EdgeMap::EdgeMap() : map(nullptr), shared(false), sizeBits(DefaultSizeBits)
+{
+}
+
+EdgeMap::~EdgeMap()
+{
+#ifndef WIN32
+    // The segment belongs to the fuzzer, so it is unmapped but not unlinked.
+    if (shared)
+        munmap(map, Size());
+    else
+#endif
+        delete[] map;
+}
+
+bool EdgeMap::Open(const std::string& name)
+{
+#ifndef WIN32
+    if (!name.empty())
+    {
+        // Usually the fuzzer has created and sized the segment already, and
+        // resizing it would cut off or move what the fuzzer has mapped.
+        bool created = true;
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST)
+        {
+            created = false;
+            fd = shm_open(name.c_str(), O_RDWR, 0);
+        }
+
+        if (fd >= 0)
+        {
+            off_t available = 0;
+            struct stat status;
+            if (created)
+                available = ftruncate(fd, DefaultSize) == 0 ? DefaultSize : 0;
+            else if (fstat(fd, &status) == 0)
+                available = status.st_size;
+
+            // Up to 2^31 bytes, so block IDs stay positive int32 constants.
+            ULONG32 bits = 0;
+            while (bits < 31 && (static_cast<off_t>(2) << bits) <= available)
+                bits++;
+
+            void* view = MAP_FAILED;
+            if (available > 0)
+                view = mmap(nullptr, static_cast<size_t>(1) << bits, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (view != MAP_FAILED)
+            {
+                map = (BYTE*)view;
+                shared = true;
+                sizeBits = bits;
+                return true;
+            }
+        }
+        printf("Unable to map edge coverage segment %s, using private memory\r\n", name.c_str());
+    }
+#endif
+
+    map = new BYTE[DefaultSize]();
+    return false;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include "cor.h"
+
+// AFL-style edge coverage map. Every edge between basic blocks bumps the
+// byte at hash(previous block, current block). When named, the map lives in
+// a POSIX shared-memory segment so a fuzzer can read and reset it between
+// executions without restarting the runtime. The previous block is not
+// kept here but per thread, in a field the profiler adds to each module.
+class EdgeMap
+{
+public:
+    static constexpr ULONG32 DefaultSizeBits = 16;
+    static constexpr ULONG32 DefaultSize = 1 << DefaultSizeBits;
+
+    EdgeMap();
+    ~EdgeMap();
+
+    EdgeMap(const EdgeMap&) = delete;
+    EdgeMap& operator= (const EdgeMap&) = delete;
+
+    // Maps the segment called name. An existing segment keeps its size, and
+    // the map is the largest power of two that fits in it; a new one is
+    // created with DefaultSize. Falls back to process-private memory of
+    // DefaultSize if name is empty or the segment can't be mapped.
+    bool Open(const std::string& name);
+
+    BYTE* Map() const { return map; }
+
+    // A power of two, which block IDs are masked to.
+    ULONG32 Size() const { return 1u << sizeBits; }
+    ULONG32 SizeBits() const { return sizeBits; }
+
+private:
+    BYTE* map;
+    bool shared;
+    ULONG32 sizeBits;
+};
@@ -0,0 +1,552 @@
+#include <cstring>
+#include <random>
+#include <thread>
+#include "CounterStore.h"
+#include "CoverageFilter.h"
+#include "Harness.h"
+#include "StringPool.h"
+#include "Utf8.h"
+
+// The profiler's building blocks on their own: counters, the name pool,
+// UTF-16 conversion and the coverage filter, each against a plain
+// reference implementation.
+
+static void CheckCounterStore()
+{
+    SetCheckContext("CounterStore");
+    CounterStore counters;
+    auto first = counters.Reserve(10);
+    auto second = counters.Reserve(5);
+    CHECK_EQUAL(0, first);
+    CHECK_EQUAL(10, second);
+
+    // Increments from many threads, some of them on the same slots, add up
+    // exactly; shards of exited threads are reused and keep their counts.
+    const int threadCount = 8;
+    const int increments = 100000;
+    for (int round = 1; round <= 2; round++)
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadCount; t++)
+        {
+            threads.emplace_back([&counters, t, first, second]
+            {
+                for (int i = 0; i < increments; i++)
+                {
+                    counters.Increment(first + (i % 10));
+                    if (t % 2 == 0)
+                        counters.Increment(second + t / 2);
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        for (size_t slot = 0; slot < 10; slot++)
+            CHECK_EQUAL(round * threadCount * increments / 10, counters.Read(first + slot));
+        for (int t = 0; t < threadCount / 2; t++)
+            CHECK_EQUAL(round * increments, counters.Read(second + t));
+        CHECK_EQUAL(0, counters.Read(second + threadCount / 2));
+    }
+
+    // The shared shard backs the addresses baked into IL.
+    auto shared = counters.SharedSlot(second + 4);
+    CHECK(shared == counters.SharedSlot(second + 4));
+    *shared += 5;
+    CHECK_EQUAL(5, counters.Read(second + 4));
+    counters.Increment(second + 4);
+    CHECK_EQUAL(6, counters.Read(second + 4));
+
+    // Stores never see each other's counts.
+    CounterStore other;
+    auto slot = other.Reserve(1);
+    other.Increment(slot);
+    CHECK_EQUAL(1, other.Read(slot));
+    CHECK_EQUAL(2 * threadCount * increments / 10, counters.Read(slot));
+
+    auto last = counters.Reserve(CounterStore::MaxSlots - 15);
+    CHECK_EQUAL(15, last);
+    CHECK_EQUAL(CounterStore::InvalidSlot, counters.Reserve(1));
+    CHECK_EQUAL(CounterStore::InvalidSlot, other.Reserve(CounterStore::MaxSlots));
+}
+
+static std::string RandomName(std::mt19937& random, size_t length)
+{
+    std::string name;
+    for (size_t i = 0; i < length; i++)
+        name.push_back(static_cast<char>('A' + random() % 58));
+    return name;
+}
+
+static void CheckStringPool()
+{
+    SetCheckContext("StringPool");
+    StringPool pool;
+    CHECK_EQUAL(StringPool::Empty, pool.Intern(""));
+    CHECK_EQUAL(0, strlen(pool.Get(StringPool::Empty)));
+
+    auto id = pool.Intern("Program");
+    CHECK(id != StringPool::Empty);
+    CHECK_EQUAL(id, pool.Intern(std::string("Program")));
+    CHECK_EQUAL(id, pool.Intern("Programs", 7));
+    CHECK(strcmp(pool.Get(id), "Program") == 0);
+
+    auto wide = Widen("Program");
+    CHECK_EQUAL(id, pool.Intern(wide.data(), wide.length()));
+
+    // Metadata names are converted before they are looked up.
+    auto accented = Widen("Caf\xC3\xA9\xF0\x9F\x98\x80");
+    auto accentedId = pool.Intern(accented.data(), accented.length());
+    CHECK_EQUAL(accentedId, pool.Intern("Caf\xC3\xA9\xF0\x9F\x98\x80"));
+    CHECK(strcmp(pool.Get(accentedId), "Caf\xC3\xA9\xF0\x9F\x98\x80") == 0);
+
+    // Enough names to fill several chunks; every id keeps its name.
+    std::mt19937 random(17);
+    std::vector<std::string> names;
+    std::vector<StringPool::Id> ids;
+    for (int i = 0; i < 30000; i++)
+    {
+        names.push_back(RandomName(random, 50 + random() % 100));
+        ids.push_back(pool.Intern(names.back()));
+    }
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (!CHECK(strcmp(pool.Get(ids[i]), names[i].c_str()) == 0))
+            break;
+        CHECK_EQUAL(ids[i], pool.Intern(names[i]));
+    }
+    CHECK(strcmp(pool.Get(id), "Program") == 0);
+}
+
+// The conversion as the standard describes it, a code unit at a time.
+static size_t ReferenceUtf8(const WCHAR* text, size_t length, char* output)
+{
+    auto out = output;
+    for (size_t i = 0; i < length; i++)
+    {
+        uint32_t c = text[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < length && text[i + 1] >= 0xDC00 && text[i + 1] < 0xE000)
+        {
+            c = 0x10000 + ((c - 0xD800) << 10) + (text[++i] - 0xDC00);
+        }
+        else if (c >= 0xD800 && c < 0xE000)
+        {
+            c = 0xFFFD;
+        }
+
+        if (c < 0x80)
+        {
+            *out++ = static_cast<char>(c);
+        }
+        else if (c < 0x800)
+        {
+            *out++ = static_cast<char>(0xC0 | (c >> 6));
+            *out++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            *out++ = static_cast<char>(0xE0 | (c >> 12));
+            *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            *out++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            *out++ = static_cast<char>(0xF0 | (c >> 18));
+            *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            *out++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+    return out - output;
+}
+
+static std::string ReferenceUtf8(const std::basic_string<WCHAR>& text)
+{
+    std::string output(text.length() * MaxUtf8PerUtf16, '\0');
+    output.resize(ReferenceUtf8(text.data(), text.length(), &output[0]));
+    return output;
+}
+
+// Mostly ASCII, as names are, with every other kind of unit mixed in:
+// two and three byte characters, pairs, and lone surrogates.
+static std::basic_string<WCHAR> RandomUtf16(std::mt19937& random, size_t length)
+{
+    std::basic_string<WCHAR> text;
+    while (text.length() < length)
+    {
+        auto kind = random() % 20;
+        if (kind < 12)
+            text.push_back(static_cast<WCHAR>(0x20 + random() % 0x5F));
+        else if (kind < 14)
+            text.push_back(static_cast<WCHAR>(0x80 + random() % 0x780));
+        else if (kind < 16)
+            text.push_back(static_cast<WCHAR>(0xE000 + random() % 0x2000));
+        else if (kind < 18)
+        {
+            text.push_back(static_cast<WCHAR>(0xD800 + random() % 0x400));
+            text.push_back(static_cast<WCHAR>(0xDC00 + random() % 0x400));
+        }
+        else if (kind == 18)
+            text.push_back(static_cast<WCHAR>(0xD800 + random() % 0x400));
+        else
+            text.push_back(static_cast<WCHAR>(0xDC00 + random() % 0x400));
+    }
+    return text;
+}
+
+// Converts text placed alignment units into its buffer, so the SSE2 loads
+// start at every alignment.
+static bool CheckUtf8(const std::basic_string<WCHAR>& text, size_t alignment = 0)
+{
+    auto expected = ReferenceUtf8(text);
+    auto placed = std::basic_string<WCHAR>(alignment, 'x') + text;
+    std::vector<char> output(text.length() * MaxUtf8PerUtf16 + 16, '#');
+    auto written = Utf16ToUtf8(placed.data() + alignment, text.length(), output.data());
+    bool same = CHECK_EQUAL(expected.length(), written) && CHECK(memcmp(output.data(), expected.data(), written) == 0);
+    for (size_t i = text.length() * MaxUtf8PerUtf16; i < output.size(); i++)
+        same &= CHECK_EQUAL('#', output[i]);
+    return same;
+}
+
+static void CheckUtf16ToUtf8()
+{
+    SetCheckContext("Utf16ToUtf8");
+    std::mt19937 random(3);
+    for (int i = 0; i < 20000; i++)
+    {
+        auto text = RandomUtf16(random, random() % 48);
+        if (!CheckUtf8(text))
+            break;
+
+        auto terminated = text;
+        for (auto& unit : terminated)
+            unit = unit == 0 ? 1 : unit;
+        CHECK_EQUAL(terminated.length(), Utf16Length(terminated.c_str()));
+        CHECK(Utf16ToUtf8(terminated.c_str()) == ReferenceUtf8(terminated));
+    }
+
+    // A pair, a lone surrogate or a non-ASCII unit after every length of
+    // ASCII run up to two blocks, so it lands on each side of the eight-unit
+    // boundaries the SSE2 loop stops at, at every alignment. A pair at 7 and
+    // 8 must not be split by a block.
+    const std::basic_string<WCHAR> inserts[] = { { 0xD83D, 0xDE00 }, { 0xD83D }, { 0xDE00 }, { 0xD83D, 0xD83D, 0xDE00 }, { 0x00E9 }, { 0x4E2D } };
+    for (const auto& insert : inserts)
+    {
+        for (size_t position = 0; position <= 16; position++)
+        {
+            for (size_t suffix : { 0, 1, 7, 8, 9, 16 })
+            {
+                for (size_t alignment = 0; alignment < 8; alignment++)
+                {
+                    auto text = std::basic_string<WCHAR>(position, 'a') + insert + std::basic_string<WCHAR>(suffix, 'b');
+                    if (!CheckUtf8(text, alignment))
+                        return;
+                }
+            }
+        }
+    }
+}
+
+// Names as a profiled application's metadata holds them: module paths,
+// namespaces, nested and generic types, accessors, and compiler-generated
+// lambdas, closures and state machines, a few in other scripts.
+static const char* const RealNames[] =
+{
+    "/usr/share/dotnet/shared/Microsoft.NETCore.App/8.0.0/System.Private.CoreLib.dll",
+    "/app/bin/Release/net8.0/MyApp.Services.dll",
+    "System.Collections.Generic.Dictionary`2",
+    "System.Collections.Generic.Dictionary`2+Enumerator",
+    "System.Linq.Enumerable+WhereSelectListIterator`2",
+    "System.Runtime.CompilerServices.AsyncTaskMethodBuilder`1",
+    "System.Text.Json.Serialization.Converters.ObjectDefaultConverter`1",
+    "Microsoft.Extensions.DependencyInjection.ServiceCollectionServiceExtensions",
+    "MyApp.Services.Orders.OrderProcessor",
+    "MyApp.Services.Orders.OrderProcessor+Handler",
+    "MyApp.Services.Orders.OrderProcessor+<ProcessAsync>d__12",
+    "MyApp.Services.Orders.OrderProcessor+<>c__DisplayClass4_0",
+    "MyApp.Services.Orders.OrderProcessor+<>c",
+    "MyApp.Data.Repositories.CustomerRepository",
+    "MyApp.Program",
+    "<Module>",
+    ".ctor",
+    ".cctor",
+    "Main",
+    "MoveNext",
+    "SetStateMachine",
+    "Dispose",
+    "ToString",
+    "GetHashCode",
+    "Equals",
+    "get_Count",
+    "get_Item",
+    "set_Item",
+    "get_IsEnabled",
+    "add_PropertyChanged",
+    "TryGetValue",
+    "ProcessAsync",
+    "ValidateOrderLinesAsync",
+    "<ProcessAsync>b__12_0",
+    "<Main>g__LocalHelper|0_1",
+    "<.ctor>b__4_0",
+    "System.Collections.IEnumerator.get_Current",
+    "System.IDisposable.Dispose",
+    "MyApp.Localization.Größenberechnung",
+    "MyApp.Localization.ÜberweisungsService",
+    "MyApp.Локализация.ПрограммаЗапуска",
+    "MyApp.数据.订单处理器",
+    "ComputeΔ",
+    "Emoji😀Handler",
+};
+
+// A rule as the filter's documentation defines it, matched part by part.
+struct ReferenceRule
+{
+    bool include;
+    std::string module;
+    std::string type;
+    std::string method;
+};
+
+static bool ReferenceGlob(const char* pattern, const char* text)
+{
+    if (*pattern == 0)
+        return *text == 0;
+    if (*pattern == '*')
+        return ReferenceGlob(pattern + 1, text) || (*text != 0 && ReferenceGlob(pattern, text + 1));
+    return *text != 0 && (*pattern == '?' || *pattern == *text) && ReferenceGlob(pattern + 1, text + 1);
+}
+
+static bool ReferenceCovers(const std::vector<ReferenceRule>& rules, const std::string& module, const std::string& type, const std::string& method)
+{
+    bool included = false;
+    for (const auto& rule : rules)
+    {
+        if (ReferenceGlob(rule.module.c_str(), module.c_str()) && ReferenceGlob(rule.type.c_str(), type.c_str()) && ReferenceGlob(rule.method.c_str(), method.c_str()))
+        {
+            if (!rule.include)
+                return false;
+            included = true;
+        }
+    }
+    return included;
+}
+
+static bool Covers(const CoverageFilter& filter, const std::string& module, const std::string& type, const std::string& method)
+{
+    auto moduleRules = filter.MatchModule(module);
+    if (moduleRules == 0)
+        return false;
+    auto typeRules = filter.MatchType(moduleRules, type);
+    if (typeRules == 0)
+        return false;
+    return !filter.HasMethodRules() || filter.IncludesMethod(typeRules, method.c_str());
+}
+
+static std::string RandomText(std::mt19937& random, const char* alphabet, size_t maxLength)
+{
+    std::string text;
+    auto length = random() % (maxLength + 1);
+    for (size_t i = 0; i < length; i++)
+        text.push_back(alphabet[random() % strlen(alphabet)]);
+    return text;
+}
+
+static void CheckCoverageFilter()
+{
+    SetCheckContext("CoverageFilter examples");
+    {
+        CoverageFilter filter;
+        filter.Compile("[MyApp.dll]");
+        CHECK(filter.MatchModule("MyApp.dll") != 0);
+        CHECK(filter.MatchModule("Other.dll") == 0);
+        CHECK(!filter.HasMethodRules());
+    }
+    {
+        CoverageFilter filter;
+        filter.Compile("+[*] -[*]MyApp.Generated.*");
+        auto module = filter.MatchModule("MyApp.dll");
+        CHECK(filter.MatchType(module, "MyApp.Program") != 0);
+        CHECK(filter.MatchType(module, "MyApp.Generated.Strings") == 0);
+    }
+    {
+        CoverageFilter filter;
+        filter.Compile("[*]MyApp.Worker::Run;[*]MyApp.Outer+Inner");
+        CHECK(filter.HasMethodRules());
+        auto module = filter.MatchModule("MyApp.dll");
+        auto worker = filter.MatchType(module, "MyApp.Worker");
+        CHECK(filter.IncludesMethod(worker, "Run"));
+        CHECK(!filter.IncludesMethod(worker, "Stop"));
+        CHECK(filter.MatchType(module, "MyApp.Other") == 0);
+        auto inner = filter.MatchType(module, "MyApp.Outer+Inner");
+        CHECK(filter.IncludesMethod(inner, "Anything"));
+        CHECK(filter.MatchType(module, "MyApp.Outer") == 0);
+    }
+
+    // Random rules over a small alphabet, so patterns and names overlap a
+    // lot. The second pass adds a rule whose module pattern needs more
+    // states than the DFA allows, which makes the filter match modules one
+    // pattern at a time; it matches no type here, so the answers must not
+    // change.
+    std::mt19937 random(11);
+    for (int forceFallback = 0; forceFallback < 2; forceFallback++)
+    {
+        SetCheckContext(forceFallback ? "CoverageFilter random rules, per-rule matching" : "CoverageFilter random rules");
+        for (int trial = 0; trial < 300; trial++)
+        {
+            std::vector<ReferenceRule> rules;
+            std::string text;
+            auto count = 1 + random() % 6;
+            for (size_t i = 0; i < count; i++)
+            {
+                ReferenceRule rule = { random() % 3 != 0, RandomText(random, "ab.*?", 4), RandomText(random, "ab.+*?", 4), RandomText(random, "ab*?", 3) };
+                bool hasMethod = random() % 2 == 0;
+                text += rule.include ? "+[" : "-[";
+                text += rule.module + "]" + rule.type;
+                if (hasMethod)
+                    text += "::" + rule.method;
+                text += ";";
+
+                if (rule.module.empty())
+                    rule.module = "*";
+                if (rule.type.empty())
+                    rule.type = "*";
+                if (!hasMethod || rule.method.empty())
+                    rule.method = "*";
+                rules.push_back(rule);
+            }
+            if (forceFallback)
+                text += " -[*a????????????]zzz";
+
+            CoverageFilter filter;
+            {
+                QuietStdout quiet;
+                filter.Compile(text);
+            }
+            for (int name = 0; name < 200; name++)
+            {
+                auto module = RandomText(random, "ab.", 6);
+                auto type = RandomText(random, "ab.+", 6);
+                auto method = RandomText(random, "ab", 4);
+                if (!Check(Covers(filter, module, type, method) == ReferenceCovers(rules, module, type, method), (text + " on [" + module + "]" + type + "::" + method).c_str(), __FILE__, __LINE__))
+                    break;
+            }
+        }
+    }
+}
+
+void ComponentChecks()
+{
+    CheckCounterStore();
+    CheckStringPool();
+    CheckUtf16ToUtf8();
+    CheckCoverageFilter();
+    SetCheckContext("");
+}
+
+void ComponentBenchmarks()
+{
+    {
+        CounterStore counters;
+        auto slot = counters.Reserve(64);
+        for (int threadCount : { 1, 4, 16 })
+        {
+            const int increments = 10000000;
+            Stopwatch stopwatch;
+            std::vector<std::thread> threads;
+            for (int t = 0; t < threadCount; t++)
+            {
+                threads.emplace_back([&counters, slot]
+                {
+                    for (int i = 0; i < increments; i++)
+                        counters.Increment(slot + (i & 63));
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            printf("CounterStore::Increment, %2d threads  %7.1f M increments/s\n", threadCount, threadCount * (increments / 1e6) / stopwatch.Seconds());
+        }
+    }
+
+    {
+        std::mt19937 random(5);
+        std::vector<std::string> names;
+        for (int i = 0; i < 200000; i++)
+            names.push_back(RandomName(random, 8 + random() % 40));
+
+        StringPool pool;
+        Stopwatch stopwatch;
+        for (const auto& name : names)
+            KeepAlive(pool.Intern(name));
+        auto first = stopwatch.Seconds();
+        Stopwatch again;
+        for (const auto& name : names)
+            KeepAlive(pool.Intern(name));
+        printf("StringPool::Intern  %6.1f ns/new name  %6.1f ns/known name\n", first * 1e9 / names.size(), again.Seconds() * 1e9 / names.size());
+    }
+
+    {
+        std::mt19937 random(9);
+        std::vector<std::basic_string<WCHAR>> texts;
+        size_t units = 0;
+        for (int i = 0; i < 100000; i++)
+        {
+            texts.push_back(RandomUtf16(random, 8 + random() % 40));
+            units += texts.back().length();
+        }
+        std::vector<char> output(64 * MaxUtf8PerUtf16);
+        Stopwatch stopwatch;
+        for (int repeat = 0; repeat < 10; repeat++)
+        {
+            for (const auto& text : texts)
+                KeepAlive(Utf16ToUtf8(text.data(), text.length(), output.data()));
+        }
+        printf("Utf16ToUtf8, mixed text  %6.2f ns/unit\n", stopwatch.Seconds() * 1e9 / (10.0 * units));
+    }
+
+    {
+        std::mt19937 random(11);
+        std::vector<std::basic_string<WCHAR>> texts;
+        size_t units = 0;
+        const size_t nameCount = sizeof(RealNames) / sizeof(RealNames[0]);
+        for (int i = 0; i < 100000; i++)
+        {
+            texts.push_back(Widen(RealNames[random() % nameCount]));
+            units += texts.back().length();
+        }
+
+        std::vector<char> output(128 * MaxUtf8PerUtf16);
+        struct Converter
+        {
+            const char* name;
+            size_t (*convert)(const WCHAR*, size_t, char*);
+        };
+        const Converter converters[] =
+        {
+            { "Utf16ToUtf8", Utf16ToUtf8 },
+            { "scalar reference", ReferenceUtf8 },
+        };
+        for (const auto& converter : converters)
+        {
+            Stopwatch stopwatch;
+            for (int repeat = 0; repeat < 10; repeat++)
+            {
+                for (const auto& text : texts)
+                    KeepAlive(converter.convert(text.data(), text.length(), output.data()));
+            }
+            auto seconds = stopwatch.Seconds();
+            printf("%s, real names  %6.2f ns/unit  %6.1f ns/name\n", converter.name,
+                seconds * 1e9 / (10.0 * units), seconds * 1e9 / (10.0 * texts.size()));
+        }
+    }
+
+    {
+        CoverageFilter filter;
+        filter.Compile("+[*] -[*]System.* -[*]Microsoft.* -[*]*.Generated.* +[*]MyApp.*::Run*");
+        auto module = filter.MatchModule("MyApp.dll");
+        const int lookups = 1000000;
+        Stopwatch stopwatch;
+        for (int i = 0; i < lookups; i++)
+            KeepAlive(filter.MatchType(module, "MyApp.Services.Orders.OrderProcessor+Handler"));
+        printf("CoverageFilter::MatchType  %6.1f ns/type\n", stopwatch.Seconds() * 1e9 / lookups);
+    }
+}
@@ -0,0 +1,429 @@
+#include <algorithm>
+#include "corerror.h"
+#include "FakeMetaData.h"
+#include "Harness.h"
+
+FakeMetaData::FakeMetaData() : refCount(1), mvid(), customAttributes(0)
+{
+    AddType("<Module>");
+}
+
+FakeMetaData::~FakeMetaData()
+{
+}
+
+mdTypeDef FakeMetaData::AddType(const std::string& name, mdTypeDef enclosing)
+{
+    Type type = { Widen(name), enclosing, {} };
+    this->types.push_back(type);
+    return TokenFromRid(static_cast<ULONG>(this->types.size()), mdtTypeDef);
+}
+
+mdMethodDef FakeMetaData::AddMethod(mdTypeDef type, const std::string& name)
+{
+    Method method = { Widen(name), type };
+    this->methods.push_back(method);
+    auto token = TokenFromRid(static_cast<ULONG>(this->methods.size()), mdtMethodDef);
+    this->types[RidFromToken(type) - 1].methods.push_back(token);
+    return token;
+}
+
+size_t FakeMetaData::SignatureCount()
+{
+    std::lock_guard<std::mutex> guard(this->signatureMutex);
+    return this->signatures.size();
+}
+
+size_t FakeMetaData::ReferenceCount()
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    return this->assemblyRefs.size() + this->typeRefs.size() + this->memberRefs.size();
+}
+
+std::basic_string<WCHAR> FakeMetaData::DescribeReference(mdToken reference)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    auto found = FindReference(reference);
+    if (found == nullptr)
+        return std::basic_string<WCHAR>();
+
+    auto scope = DescribeScope(found->scope);
+    if (TypeFromToken(reference) == mdtMemberRef)
+        return scope + Widen("::") + found->name;
+    return scope + found->name;
+}
+
+std::vector<BYTE> FakeMetaData::MemberRefSignature(mdMemberRef memberRef)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    auto found = TypeFromToken(memberRef) == mdtMemberRef ? FindReference(memberRef) : nullptr;
+    return found != nullptr ? found->signature : std::vector<BYTE>();
+}
+
+std::basic_string<WCHAR> FakeMetaData::DescribeField(mdFieldDef field)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    auto found = FindField(field);
+    return found != nullptr ? DescribeScope(found->type) + Widen("::") + found->name : std::basic_string<WCHAR>();
+}
+
+DWORD FakeMetaData::FieldFlags(mdFieldDef field)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    auto found = FindField(field);
+    return found != nullptr ? found->flags : 0;
+}
+
+std::vector<BYTE> FakeMetaData::FieldSignature(mdFieldDef field)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    auto found = FindField(field);
+    return found != nullptr ? found->signature : std::vector<BYTE>();
+}
+
+std::vector<mdToken> FakeMetaData::FieldAttributes(mdFieldDef field)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    auto found = FindField(field);
+    return found != nullptr ? found->attributes : std::vector<mdToken>();
+}
+
+FakeMetaData::Field* FakeMetaData::FindField(mdFieldDef field)
+{
+    auto rid = RidFromToken(field);
+    if (TypeFromToken(field) != mdtFieldDef || rid == 0 || rid > this->fields.size())
+        return nullptr;
+    return &this->fields[rid - 1];
+}
+
+const FakeMetaData::Reference* FakeMetaData::FindReference(mdToken reference) const
+{
+    const std::vector<Reference>* references;
+    switch (TypeFromToken(reference))
+    {
+    case mdtAssemblyRef: references = &this->assemblyRefs; break;
+    case mdtTypeRef: references = &this->typeRefs; break;
+    case mdtMemberRef: references = &this->memberRefs; break;
+    default: return nullptr;
+    }
+
+    auto rid = RidFromToken(reference);
+    if (rid == 0 || rid > references->size())
+        return nullptr;
+    return &(*references)[rid - 1];
+}
+
+// [Assembly] for an assembly ref, [Assembly]Type for a type ref, and the
+// bare name for a type def.
+std::basic_string<WCHAR> FakeMetaData::DescribeScope(mdToken scope) const
+{
+    if (TypeFromToken(scope) == mdtTypeDef)
+    {
+        auto type = FindType(scope);
+        return type != nullptr ? type->name : std::basic_string<WCHAR>();
+    }
+
+    auto found = FindReference(scope);
+    if (found == nullptr)
+        return std::basic_string<WCHAR>();
+    if (TypeFromToken(scope) == mdtAssemblyRef)
+        return Widen("[") + found->name + Widen("]");
+    return DescribeScope(found->scope) + found->name;
+}
+
+mdToken FakeMetaData::AddReference(std::vector<Reference>& references, ULONG tokenType, mdToken scope, LPCWSTR name, PCCOR_SIGNATURE signature, ULONG signatureSize)
+{
+    Reference reference = { scope, name, std::vector<BYTE>(signature, signature + signatureSize) };
+    references.push_back(reference);
+    return TokenFromRid(static_cast<ULONG>(references.size()), tokenType);
+}
+
+const FakeMetaData::Type* FakeMetaData::FindType(mdTypeDef type) const
+{
+    auto rid = RidFromToken(type);
+    if (TypeFromToken(type) != mdtTypeDef || rid == 0 || rid > this->types.size())
+        return nullptr;
+    return &this->types[rid - 1];
+}
+
+// Hands out the next tokens of an enumeration, creating it on the first
+// call. S_FALSE once it is exhausted, as the runtime returns.
+HRESULT FakeMetaData::Next(HCORENUM* phEnum, const std::vector<mdToken>& tokens, mdToken rTokens[], ULONG cMax, ULONG* pcTokens)
+{
+    auto enumerator = static_cast<Enumerator*>(*phEnum);
+    if (enumerator == nullptr)
+    {
+        enumerator = new Enumerator{ tokens, 0 };
+        *phEnum = enumerator;
+    }
+
+    ULONG count = 0;
+    while (count < cMax && enumerator->position < enumerator->tokens.size())
+        rTokens[count++] = enumerator->tokens[enumerator->position++];
+
+    if (pcTokens)
+        *pcTokens = count;
+    return count > 0 ? S_OK : S_FALSE;
+}
+
+void FakeMetaData::CopyName(const std::basic_string<WCHAR>& name, LPWSTR buffer, ULONG size, ULONG* length)
+{
+    if (length)
+        *length = static_cast<ULONG>(name.length() + 1);
+    if (buffer == nullptr || size == 0)
+        return;
+
+    auto copied = std::min<size_t>(name.length(), size - 1);
+    std::copy(name.begin(), name.begin() + copied, buffer);
+    buffer[copied] = 0;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::QueryInterface(REFIID riid, void** ppvObject)
+{
+    if (riid == IID_IMetaDataImport || riid == IID_IUnknown)
+        *ppvObject = static_cast<IMetaDataImport*>(this);
+    else if (riid == IID_IMetaDataEmit)
+        *ppvObject = static_cast<IMetaDataEmit*>(this);
+    else if (riid == IID_IMetaDataTables)
+        *ppvObject = static_cast<IMetaDataTables*>(this);
+    else if (riid == IID_IMetaDataAssemblyEmit)
+        *ppvObject = static_cast<IMetaDataAssemblyEmit*>(this);
+    else
+    {
+        *ppvObject = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    this->AddRef();
+    return S_OK;
+}
+
+ULONG STDMETHODCALLTYPE FakeMetaData::AddRef()
+{
+    return ++this->refCount;
+}
+
+ULONG STDMETHODCALLTYPE FakeMetaData::Release()
+{
+    return --this->refCount;
+}
+
+void STDMETHODCALLTYPE FakeMetaData::CloseEnum(HCORENUM hEnum)
+{
+    delete static_cast<Enumerator*>(hEnum);
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::EnumTypeDefs(HCORENUM *phEnum, mdTypeDef rTypeDefs[], ULONG cMax, ULONG *pcTypeDefs)
+{
+    std::vector<mdToken> tokens;
+    if (*phEnum == nullptr)
+    {
+        for (ULONG rid = 2; rid <= this->types.size(); rid++)
+            tokens.push_back(TokenFromRid(rid, mdtTypeDef));
+    }
+    return Next(phEnum, tokens, rTypeDefs, cMax, pcTypeDefs);
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::GetScopeProps(LPWSTR szName, ULONG cchName, ULONG *pchName, GUID *pmvid)
+{
+    CopyName(Widen("Fake.dll"), szName, cchName, pchName);
+    if (pmvid)
+        *pmvid = this->mvid;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::GetTypeDefProps(mdTypeDef td, LPWSTR szTypeDef, ULONG cchTypeDef, ULONG *pchTypeDef, DWORD *pdwTypeDefFlags, mdToken *ptkExtends)
+{
+    auto type = FindType(td);
+    if (type == nullptr)
+        return CLDB_E_RECORD_NOTFOUND;
+
+    CopyName(type->name, szTypeDef, cchTypeDef, pchTypeDef);
+    if (pdwTypeDefFlags)
+        *pdwTypeDefFlags = type->enclosing != mdTypeDefNil ? tdNestedPublic : 0;
+    if (ptkExtends)
+        *ptkExtends = mdTokenNil;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::EnumMethods(HCORENUM *phEnum, mdTypeDef cl, mdMethodDef rMethods[], ULONG cMax, ULONG *pcTokens)
+{
+    auto type = FindType(cl);
+    if (type == nullptr)
+        return CLDB_E_RECORD_NOTFOUND;
+
+    return Next(phEnum, type->methods, rMethods, cMax, pcTokens);
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::EnumMethodsWithName(HCORENUM *phEnum, mdTypeDef cl, LPCWSTR szName, mdMethodDef rMethods[], ULONG cMax, ULONG *pcTokens)
+{
+    auto type = FindType(cl);
+    if (type == nullptr)
+        return CLDB_E_RECORD_NOTFOUND;
+
+    std::vector<mdToken> tokens;
+    if (*phEnum == nullptr)
+    {
+        for (auto method : type->methods)
+        {
+            if (this->methods[RidFromToken(method) - 1].name == szName)
+                tokens.push_back(method);
+        }
+    }
+    return Next(phEnum, tokens, rMethods, cMax, pcTokens);
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::GetMethodProps(mdMethodDef mb, mdTypeDef *pClass, LPWSTR szMethod, ULONG cchMethod, ULONG *pchMethod, DWORD *pdwAttr, PCCOR_SIGNATURE *ppvSigBlob, ULONG *pcbSigBlob, ULONG *pulCodeRVA, DWORD *pdwImplFlags)
+{
+    auto rid = RidFromToken(mb);
+    if (TypeFromToken(mb) != mdtMethodDef || rid == 0 || rid > this->methods.size())
+        return CLDB_E_RECORD_NOTFOUND;
+
+    static const COR_SIGNATURE voidSignature[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT, 0x00, ELEMENT_TYPE_VOID };
+    const auto& method = this->methods[rid - 1];
+    if (pClass)
+        *pClass = method.type;
+    CopyName(method.name, szMethod, cchMethod, pchMethod);
+    if (pdwAttr)
+        *pdwAttr = 0;
+    if (ppvSigBlob)
+        *ppvSigBlob = voidSignature;
+    if (pcbSigBlob)
+        *pcbSigBlob = sizeof(voidSignature);
+    if (pulCodeRVA)
+        *pulCodeRVA = 0;
+    if (pdwImplFlags)
+        *pdwImplFlags = 0;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::FindTypeDefByName(LPCWSTR szTypeDef, mdToken tkEnclosingClass, mdTypeDef *ptd)
+{
+    auto enclosing = tkEnclosingClass == mdTokenNil ? mdTypeDefNil : tkEnclosingClass;
+    for (size_t i = 0; i < this->types.size(); i++)
+    {
+        if (this->types[i].name == szTypeDef && this->types[i].enclosing == enclosing)
+        {
+            *ptd = TokenFromRid(static_cast<ULONG>(i + 1), mdtTypeDef);
+            return S_OK;
+        }
+    }
+    return CLDB_E_RECORD_NOTFOUND;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::GetNestedClassProps(mdTypeDef tdNestedClass, mdTypeDef *ptdEnclosingClass)
+{
+    auto type = FindType(tdNestedClass);
+    if (type == nullptr || type->enclosing == mdTypeDefNil)
+        return CLDB_E_RECORD_NOTFOUND;
+
+    *ptdEnclosingClass = type->enclosing;
+    return S_OK;
+}
+
+// The same signature always gets the same token, as in a real module.
+HRESULT STDMETHODCALLTYPE FakeMetaData::GetTokenFromSig(PCCOR_SIGNATURE pvSig, ULONG cbSig, mdSignature *pmsig)
+{
+    std::lock_guard<std::mutex> guard(this->signatureMutex);
+    std::vector<BYTE> signature(pvSig, pvSig + cbSig);
+    auto entry = this->signatures.find(signature);
+    if (entry == this->signatures.end())
+    {
+        auto token = TokenFromRid(static_cast<ULONG>(this->signatures.size() + 1), mdtSignature);
+        entry = this->signatures.emplace(signature, token).first;
+    }
+
+    *pmsig = entry->second;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::DefineTypeRefByName(mdToken tkResolutionScope, LPCWSTR szName, mdTypeRef *ptr)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    if (FindReference(tkResolutionScope) == nullptr)
+        return E_INVALIDARG;
+
+    *ptr = AddReference(this->typeRefs, mdtTypeRef, tkResolutionScope, szName, nullptr, 0);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::DefineMemberRef(mdToken tkImport, LPCWSTR szName, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdMemberRef *pmr)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    auto parent = TypeFromToken(tkImport) == mdtTypeDef ? FindType(tkImport) != nullptr : TypeFromToken(tkImport) == mdtTypeRef && FindReference(tkImport) != nullptr;
+    if (!parent)
+        return E_INVALIDARG;
+
+    *pmr = AddReference(this->memberRefs, mdtMemberRef, tkImport, szName, pvSigBlob, cbSigBlob);
+    return S_OK;
+}
+
+// Only types at the top level, which is all the profiler defines.
+HRESULT STDMETHODCALLTYPE FakeMetaData::DefineTypeDef(LPCWSTR szTypeDef, DWORD dwTypeDefFlags, mdToken tkExtends, mdToken rtkImplements[], mdTypeDef *ptd)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    Type type = { szTypeDef, mdTypeDefNil, {} };
+    this->types.push_back(type);
+    *ptd = TokenFromRid(static_cast<ULONG>(this->types.size()), mdtTypeDef);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::DefineField(mdTypeDef td, LPCWSTR szName, DWORD dwFieldFlags, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, DWORD dwCPlusTypeFlag, void const *pValue, ULONG cchValue, mdFieldDef *pmd)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    if (FindType(td) == nullptr)
+        return E_INVALIDARG;
+
+    Field field = { td, szName, dwFieldFlags, std::vector<BYTE>(pvSigBlob, pvSigBlob + cbSigBlob), {} };
+    this->fields.push_back(field);
+    *pmd = TokenFromRid(static_cast<ULONG>(this->fields.size()), mdtFieldDef);
+    return S_OK;
+}
+
+// Only on fields, which is all the profiler attributes.
+HRESULT STDMETHODCALLTYPE FakeMetaData::DefineCustomAttribute(mdToken tkOwner, mdToken tkCtor, void const *pCustomAttribute, ULONG cbCustomAttribute, mdCustomAttribute *pcv)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    auto field = FindField(tkOwner);
+    if (field == nullptr || FindReference(tkCtor) == nullptr)
+        return E_INVALIDARG;
+
+    field->attributes.push_back(tkCtor);
+    *pcv = TokenFromRid(++this->customAttributes, mdtCustomAttribute);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::DefineAssemblyRef(const void *pbPublicKeyOrToken, ULONG cbPublicKeyOrToken, LPCWSTR szName, const ASSEMBLYMETADATA *pMetaData, const void *pbHashValue, ULONG cbHashValue, DWORD dwAssemblyRefFlags, mdAssemblyRef *pmdar)
+{
+    std::lock_guard<std::mutex> guard(this->referenceMutex);
+    *pmdar = AddReference(this->assemblyRefs, mdtAssemblyRef, mdTokenNil, szName, nullptr, 0);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMetaData::GetTableInfo(ULONG ixTbl, ULONG *pcbRow, ULONG *pcRows, ULONG *pcCols, ULONG *piKey, const char **ppName)
+{
+    ULONG rows = 0;
+    const char* name = "";
+    if (ixTbl == TypeFromToken(mdtTypeDef) >> 24)
+    {
+        rows = TypeCount();
+        name = "TypeDef";
+    }
+    else if (ixTbl == TypeFromToken(mdtMethodDef) >> 24)
+    {
+        rows = MethodCount();
+        name = "Method";
+    }
+
+    if (pcbRow)
+        *pcbRow = 0;
+    if (pcRows)
+        *pcRows = rows;
+    if (pcCols)
+        *pcCols = 0;
+    if (piKey)
+        *piKey = static_cast<ULONG>(-1);
+    if (ppName)
+        *ppName = name;
+    return S_OK;
+}
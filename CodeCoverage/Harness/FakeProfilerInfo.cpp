@@ -0,0 +1,310 @@
+#include "FakeMetaData.h"
+#include "FakeProfilerInfo.h"
+#include "ILInterpreter.h"
+
+FakeMethodMalloc::FakeMethodMalloc() : refCount(1)
+{
+}
+
+size_t FakeMethodMalloc::BlockSize(const BYTE* body)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto block = this->sizes.find(body);
+    return block != this->sizes.end() ? block->second : 0;
+}
+
+HRESULT STDMETHODCALLTYPE FakeMethodMalloc::QueryInterface(REFIID riid, void** ppvObject)
+{
+    *ppvObject = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG STDMETHODCALLTYPE FakeMethodMalloc::AddRef()
+{
+    return ++this->refCount;
+}
+
+// Owned by FakeProfilerInfo; the count only shows the rewriter releases
+// what it gets.
+ULONG STDMETHODCALLTYPE FakeMethodMalloc::Release()
+{
+    return --this->refCount;
+}
+
+PVOID STDMETHODCALLTYPE FakeMethodMalloc::Alloc(ULONG cb)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    this->blocks.emplace_back(new BYTE[cb]);
+    auto block = this->blocks.back().get();
+    this->sizes[block] = cb;
+    return block;
+}
+
+FakeFunctionControl::FakeFunctionControl() : refCount(1)
+{
+}
+
+HRESULT STDMETHODCALLTYPE FakeFunctionControl::QueryInterface(REFIID riid, void** ppvObject)
+{
+    *ppvObject = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG STDMETHODCALLTYPE FakeFunctionControl::AddRef()
+{
+    return ++this->refCount;
+}
+
+ULONG STDMETHODCALLTYPE FakeFunctionControl::Release()
+{
+    return --this->refCount;
+}
+
+HRESULT STDMETHODCALLTYPE FakeFunctionControl::SetCodegenFlags(DWORD flags)
+{
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeFunctionControl::SetILFunctionBody(ULONG cbNewILMethodHeader, LPCBYTE pbNewILMethodHeader)
+{
+    this->body.assign(pbNewILMethodHeader, pbNewILMethodHeader + cbNewILMethodHeader);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeFunctionControl::SetILInstrumentedCodeMap(ULONG cILMapEntries, COR_IL_MAP* rgILMapEntries)
+{
+    return S_OK;
+}
+
+FakeProfilerInfo::FakeProfilerInfo() : refCount(1), eventMask(0), nextFunction(0x1000)
+{
+}
+
+FakeProfilerInfo::~FakeProfilerInfo()
+{
+}
+
+void FakeProfilerInfo::AddModule(ModuleID module, const std::string& path, FakeMetaData* metadata)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    this->modules[module] = Module{ path, metadata };
+}
+
+void FakeProfilerInfo::SetOriginalBody(ModuleID module, mdMethodDef method, const std::vector<BYTE>& body)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    this->bodies.push_back(body);
+    this->methods[std::make_pair(module, method)] = Method{ &this->bodies.back(), &this->bodies.back(), 0 };
+}
+
+FunctionID FakeProfilerInfo::AddFunction(ModuleID module, mdMethodDef method)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto function = this->nextFunction;
+    this->nextFunction += 0x10;
+    this->functions[function] = std::make_pair(module, method);
+    return function;
+}
+
+std::vector<BYTE> FakeProfilerInfo::CurrentBody(ModuleID module, mdMethodDef method)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto entry = this->methods.find(std::make_pair(module, method));
+    return entry != this->methods.end() ? *entry->second.current : std::vector<BYTE>();
+}
+
+bool FakeProfilerInfo::Rewritten(ModuleID module, mdMethodDef method)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto entry = this->methods.find(std::make_pair(module, method));
+    return entry != this->methods.end() && entry->second.current != entry->second.original;
+}
+
+ULONG FakeProfilerInfo::BodyRequests(ModuleID module, mdMethodDef method)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto entry = this->methods.find(std::make_pair(module, method));
+    return entry != this->methods.end() ? entry->second.requests : 0;
+}
+
+std::vector<std::pair<ModuleID, mdMethodDef>> FakeProfilerInfo::ReJitRequests()
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    return this->rejits;
+}
+
+std::vector<std::pair<ModuleID, mdMethodDef>> FakeProfilerInfo::RevertRequests()
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    return this->reverts;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::QueryInterface(REFIID riid, void** ppvObject)
+{
+    if (riid == __uuidof(ICorProfilerInfo8) ||
+        riid == __uuidof(ICorProfilerInfo7) ||
+        riid == __uuidof(ICorProfilerInfo6) ||
+        riid == __uuidof(ICorProfilerInfo5) ||
+        riid == __uuidof(ICorProfilerInfo4) ||
+        riid == __uuidof(ICorProfilerInfo3) ||
+        riid == __uuidof(ICorProfilerInfo2) ||
+        riid == __uuidof(ICorProfilerInfo)  ||
+        riid == IID_IUnknown)
+    {
+        *ppvObject = this;
+        this->AddRef();
+        return S_OK;
+    }
+
+    *ppvObject = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG STDMETHODCALLTYPE FakeProfilerInfo::AddRef()
+{
+    return ++this->refCount;
+}
+
+// Lives on the check's stack; the count is not used to free it.
+ULONG STDMETHODCALLTYPE FakeProfilerInfo::Release()
+{
+    return --this->refCount;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::GetEventMask(DWORD *pdwEvents)
+{
+    *pdwEvents = this->eventMask;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::SetEventMask(DWORD dwEvents)
+{
+    this->eventMask = dwEvents;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::GetFunctionInfo(FunctionID functionId, ClassID *pClassId, ModuleID *pModuleId, mdToken *pToken)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto function = this->functions.find(functionId);
+    if (function == this->functions.end())
+        return E_INVALIDARG;
+
+    // Shared generic code reports no class, so neither does the fake.
+    if (pClassId)
+        *pClassId = 0;
+    if (pModuleId)
+        *pModuleId = function->second.first;
+    if (pToken)
+        *pToken = function->second.second;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::GetModuleInfo(ModuleID moduleId, LPCBYTE *ppBaseLoadAddress, ULONG cchName, ULONG *pcchName, WCHAR szName[], AssemblyID *pAssemblyId)
+{
+    DWORD flags;
+    return GetModuleInfo2(moduleId, ppBaseLoadAddress, cchName, pcchName, szName, pAssemblyId, &flags);
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::GetModuleInfo2(ModuleID moduleId, LPCBYTE *ppBaseLoadAddress, ULONG cchName, ULONG *pcchName, WCHAR szName[], AssemblyID *pAssemblyId, DWORD *pdwModuleFlags)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto module = this->modules.find(moduleId);
+    if (module == this->modules.end())
+        return E_INVALIDARG;
+
+    const auto& path = module->second.path;
+    if (pcchName)
+        *pcchName = static_cast<ULONG>(path.length() + 1);
+    if (szName && cchName > 0)
+    {
+        ULONG i = 0;
+        for (; i < path.length() && i + 1 < cchName; i++)
+            szName[i] = static_cast<WCHAR>(static_cast<BYTE>(path[i]));
+        szName[i] = 0;
+    }
+    if (ppBaseLoadAddress)
+        *ppBaseLoadAddress = nullptr;
+    if (pAssemblyId)
+        *pAssemblyId = moduleId;
+    if (pdwModuleFlags)
+        *pdwModuleFlags = 0;
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::GetModuleMetaData(ModuleID moduleId, DWORD dwOpenFlags, REFIID riid, IUnknown **ppOut)
+{
+    FakeMetaData* metadata;
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        auto module = this->modules.find(moduleId);
+        if (module == this->modules.end())
+            return E_INVALIDARG;
+        metadata = module->second.metadata;
+    }
+    return metadata->QueryInterface(riid, reinterpret_cast<void**>(ppOut));
+}
+
+// The size is optional, as the rewriter passes none.
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::GetILFunctionBody(ModuleID moduleId, mdMethodDef methodId, LPCBYTE *ppMethodHeader, ULONG *pcbMethodSize)
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto entry = this->methods.find(std::make_pair(moduleId, methodId));
+    if (entry == this->methods.end())
+        return E_INVALIDARG;
+
+    entry->second.requests++;
+    *ppMethodHeader = entry->second.current->data();
+    if (pcbMethodSize)
+        *pcbMethodSize = static_cast<ULONG>(entry->second.current->size());
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::GetILFunctionBodyAllocator(ModuleID moduleId, IMethodMalloc **ppMalloc)
+{
+    this->malloc.AddRef();
+    *ppMalloc = &this->malloc;
+    return S_OK;
+}
+
+// Like the runtime, takes only memory from the body allocator, and works
+// out the size from the header.
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::SetILFunctionBody(ModuleID moduleId, mdMethodDef methodid, LPCBYTE pbNewILMethodHeader)
+{
+    auto available = this->malloc.BlockSize(pbNewILMethodHeader);
+    if (available == 0)
+        return E_INVALIDARG;
+
+    ILMethod method;
+    if (!method.Parse(pbNewILMethodHeader, available))
+        return COR_E_INVALIDPROGRAM;
+
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto entry = this->methods.find(std::make_pair(moduleId, methodid));
+    if (entry == this->methods.end())
+        return E_INVALIDARG;
+
+    this->bodies.emplace_back(pbNewILMethodHeader, pbNewILMethodHeader + method.size);
+    entry->second.current = &this->bodies.back();
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::RequestReJIT(ULONG cFunctions, ModuleID moduleIds[], mdMethodDef methodIds[])
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    for (ULONG i = 0; i < cFunctions; i++)
+        this->rejits.push_back(std::make_pair(moduleIds[i], methodIds[i]));
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE FakeProfilerInfo::RequestRevert(ULONG cFunctions, ModuleID moduleIds[], mdMethodDef methodIds[], HRESULT status[])
+{
+    std::lock_guard<std::mutex> guard(this->mutex);
+    for (ULONG i = 0; i < cFunctions; i++)
+    {
+        this->reverts.push_back(std::make_pair(moduleIds[i], methodIds[i]));
+        if (status)
+            status[i] = S_OK;
+    }
+    return S_OK;
+}
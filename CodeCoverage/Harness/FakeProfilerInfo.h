@@ -0,0 +1,223 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+
+class FakeMetaData;
+
+// Hands out IL memory the way the runtime's allocator does, and remembers
+// every block so SetILFunctionBody can tell a body from it. Blocks live as
+// long as the allocator.
+class FakeMethodMalloc : public IMethodMalloc
+{
+public:
+    FakeMethodMalloc();
+
+    // Size of the block starting at body, or 0 if it did not come from here.
+    size_t BlockSize(const BYTE* body);
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override;
+    ULONG STDMETHODCALLTYPE AddRef() override;
+    ULONG STDMETHODCALLTYPE Release() override;
+    PVOID STDMETHODCALLTYPE Alloc(ULONG cb) override;
+
+private:
+    std::atomic<int> refCount;
+    std::mutex mutex;
+    std::deque<std::unique_ptr<BYTE[]>> blocks;
+    std::map<const BYTE*, size_t> sizes;
+};
+
+// Collects the body a ReJIT sets, as the runtime's function control does.
+class FakeFunctionControl : public ICorProfilerFunctionControl
+{
+public:
+    FakeFunctionControl();
+
+    const std::vector<BYTE>& Body() const { return body; }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override;
+    ULONG STDMETHODCALLTYPE AddRef() override;
+    ULONG STDMETHODCALLTYPE Release() override;
+    HRESULT STDMETHODCALLTYPE SetCodegenFlags(DWORD flags) override;
+    HRESULT STDMETHODCALLTYPE SetILFunctionBody(ULONG cbNewILMethodHeader, LPCBYTE pbNewILMethodHeader) override;
+    HRESULT STDMETHODCALLTYPE SetILInstrumentedCodeMap(ULONG cILMapEntries, COR_IL_MAP* rgILMapEntries) override;
+
+private:
+    std::atomic<int> refCount;
+    std::vector<BYTE> body;
+};
+
+// Stands in for the runtime behind ICorProfilerInfo8: serves the modules,
+// functions and method bodies a check sets up, keeps the bodies the
+// profiler sets, and records ReJIT and revert requests. What the profiler
+// never calls returns E_NOTIMPL. Thread safe, as the profiler calls in from
+// its worker threads.
+class FakeProfilerInfo : public ICorProfilerInfo8
+{
+public:
+    FakeProfilerInfo();
+    ~FakeProfilerInfo();
+
+    FakeProfilerInfo(const FakeProfilerInfo&) = delete;
+    FakeProfilerInfo& operator= (const FakeProfilerInfo&) = delete;
+
+    // The metadata is not owned and must outlive the module.
+    void AddModule(ModuleID module, const std::string& path, FakeMetaData* metadata);
+    void SetOriginalBody(ModuleID module, mdMethodDef method, const std::vector<BYTE>& body);
+    FunctionID AddFunction(ModuleID module, mdMethodDef method);
+
+    // The body the JIT would compile now: the last one the profiler set, or
+    // the original. Empty for an unknown method.
+    std::vector<BYTE> CurrentBody(ModuleID module, mdMethodDef method);
+    bool Rewritten(ModuleID module, mdMethodDef method);
+    ULONG BodyRequests(ModuleID module, mdMethodDef method);
+
+    DWORD EventMask() const { return eventMask; }
+    std::vector<std::pair<ModuleID, mdMethodDef>> ReJitRequests();
+    std::vector<std::pair<ModuleID, mdMethodDef>> RevertRequests();
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override;
+    ULONG STDMETHODCALLTYPE AddRef() override;
+    ULONG STDMETHODCALLTYPE Release() override;
+
+    HRESULT STDMETHODCALLTYPE GetEventMask(DWORD *pdwEvents) override;
+    HRESULT STDMETHODCALLTYPE SetEventMask(DWORD dwEvents) override;
+    HRESULT STDMETHODCALLTYPE GetFunctionInfo(FunctionID functionId, ClassID *pClassId, ModuleID *pModuleId, mdToken *pToken) override;
+    HRESULT STDMETHODCALLTYPE GetModuleInfo(ModuleID moduleId, LPCBYTE *ppBaseLoadAddress, ULONG cchName, ULONG *pcchName, WCHAR szName[], AssemblyID *pAssemblyId) override;
+    HRESULT STDMETHODCALLTYPE GetModuleInfo2(ModuleID moduleId, LPCBYTE *ppBaseLoadAddress, ULONG cchName, ULONG *pcchName, WCHAR szName[], AssemblyID *pAssemblyId, DWORD *pdwModuleFlags) override;
+    HRESULT STDMETHODCALLTYPE GetModuleMetaData(ModuleID moduleId, DWORD dwOpenFlags, REFIID riid, IUnknown **ppOut) override;
+    HRESULT STDMETHODCALLTYPE GetILFunctionBody(ModuleID moduleId, mdMethodDef methodId, LPCBYTE *ppMethodHeader, ULONG *pcbMethodSize) override;
+    HRESULT STDMETHODCALLTYPE GetILFunctionBodyAllocator(ModuleID moduleId, IMethodMalloc **ppMalloc) override;
+    HRESULT STDMETHODCALLTYPE SetILFunctionBody(ModuleID moduleId, mdMethodDef methodid, LPCBYTE pbNewILMethodHeader) override;
+    HRESULT STDMETHODCALLTYPE RequestReJIT(ULONG cFunctions, ModuleID moduleIds[], mdMethodDef methodIds[]) override;
+    HRESULT STDMETHODCALLTYPE RequestRevert(ULONG cFunctions, ModuleID moduleIds[], mdMethodDef methodIds[], HRESULT status[]) override;
+
+    // ICorProfilerInfo, unused.
+    HRESULT STDMETHODCALLTYPE GetClassFromObject(ObjectID objectId, ClassID *pClassId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetClassFromToken(ModuleID moduleId, mdTypeDef typeDef, ClassID *pClassId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetCodeInfo(FunctionID functionId, LPCBYTE *pStart, ULONG *pcSize) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionFromIP(LPCBYTE ip, FunctionID *pFunctionId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionFromToken(ModuleID moduleId, mdToken token, FunctionID *pFunctionId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetHandleFromThread(ThreadID threadId, HANDLE *phThread) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetObjectSize(ObjectID objectId, ULONG *pcSize) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE IsArrayClass(ClassID classId, CorElementType *pBaseElemType, ClassID *pBaseClassId, ULONG *pcRank) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetThreadInfo(ThreadID threadId, DWORD *pdwWin32ThreadId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetCurrentThreadID(ThreadID *pThreadId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetClassIDInfo(ClassID classId, ModuleID *pModuleId, mdTypeDef *pTypeDefToken) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetEnterLeaveFunctionHooks(FunctionEnter *pFuncEnter, FunctionLeave *pFuncLeave, FunctionTailcall *pFuncTailcall) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetFunctionIDMapper(FunctionIDMapper *pFunc) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetTokenAndMetaDataFromFunction(FunctionID functionId, REFIID riid, IUnknown **ppImport, mdToken *pToken) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetAppDomainInfo(AppDomainID appDomainId, ULONG cchName, ULONG *pcchName, WCHAR szName[], ProcessID *pProcessId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetAssemblyInfo(AssemblyID assemblyId, ULONG cchName, ULONG *pcchName, WCHAR szName[], AppDomainID *pAppDomainId, ModuleID *pModuleId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetFunctionReJIT(FunctionID functionId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE ForceGC() override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetILInstrumentedCodeMap(FunctionID functionId, BOOL fStartJit, ULONG cILMapEntries, COR_IL_MAP rgILMapEntries[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetInprocInspectionInterface(IUnknown **ppicd) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetInprocInspectionIThisThread(IUnknown **ppicd) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetThreadContext(ThreadID threadId, ContextID *pContextId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE BeginInprocDebugging(BOOL fThisThreadOnly, DWORD *pdwProfilerContext) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE EndInprocDebugging(DWORD dwProfilerContext) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetILToNativeMapping(FunctionID functionId, ULONG32 cMap, ULONG32 *pcMap, COR_DEBUG_IL_TO_NATIVE_MAP map[]) override { return E_NOTIMPL; }
+
+    // ICorProfilerInfo2, unused.
+    HRESULT STDMETHODCALLTYPE DoStackSnapshot(ThreadID thread, StackSnapshotCallback *callback, ULONG32 infoFlags, void *clientData, BYTE context[], ULONG32 contextSize) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetEnterLeaveFunctionHooks2(FunctionEnter2 *pFuncEnter, FunctionLeave2 *pFuncLeave, FunctionTailcall2 *pFuncTailcall) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionInfo2(FunctionID funcId, COR_PRF_FRAME_INFO frameInfo, ClassID *pClassId, ModuleID *pModuleId, mdToken *pToken, ULONG32 cTypeArgs, ULONG32 *pcTypeArgs, ClassID typeArgs[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetStringLayout(ULONG *pBufferLengthOffset, ULONG *pStringLengthOffset, ULONG *pBufferOffset) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetClassLayout(ClassID classID, COR_FIELD_OFFSET rFieldOffset[], ULONG cFieldOffset, ULONG *pcFieldOffset, ULONG *pulClassSize) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetClassIDInfo2(ClassID classId, ModuleID *pModuleId, mdTypeDef *pTypeDefToken, ClassID *pParentClassId, ULONG32 cNumTypeArgs, ULONG32 *pcNumTypeArgs, ClassID typeArgs[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetCodeInfo2(FunctionID functionID, ULONG32 cCodeInfos, ULONG32 *pcCodeInfos, COR_PRF_CODE_INFO codeInfos[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetClassFromTokenAndTypeArgs(ModuleID moduleID, mdTypeDef typeDef, ULONG32 cTypeArgs, ClassID typeArgs[], ClassID *pClassID) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionFromTokenAndTypeArgs(ModuleID moduleID, mdMethodDef funcDef, ClassID classId, ULONG32 cTypeArgs, ClassID typeArgs[], FunctionID *pFunctionID) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE EnumModuleFrozenObjects(ModuleID moduleID, ICorProfilerObjectEnum **ppEnum) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetArrayObjectInfo(ObjectID objectId, ULONG32 cDimensions, ULONG32 pDimensionSizes[], int pDimensionLowerBounds[], BYTE **ppData) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetBoxClassLayout(ClassID classId, ULONG32 *pBufferOffset) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetThreadAppDomain(ThreadID threadId, AppDomainID *pAppDomainId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetRVAStaticAddress(ClassID classId, mdFieldDef fieldToken, void **ppAddress) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetAppDomainStaticAddress(ClassID classId, mdFieldDef fieldToken, AppDomainID appDomainId, void **ppAddress) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetThreadStaticAddress(ClassID classId, mdFieldDef fieldToken, ThreadID threadId, void **ppAddress) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetContextStaticAddress(ClassID classId, mdFieldDef fieldToken, ContextID contextId, void **ppAddress) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetStaticFieldInfo(ClassID classId, mdFieldDef fieldToken, COR_PRF_STATIC_TYPE *pFieldInfo) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetGenerationBounds(ULONG cObjectRanges, ULONG *pcObjectRanges, COR_PRF_GC_GENERATION_RANGE ranges[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetObjectGeneration(ObjectID objectId, COR_PRF_GC_GENERATION_RANGE *range) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetNotifiedExceptionClauseInfo(COR_PRF_EX_CLAUSE_INFO *pinfo) override { return E_NOTIMPL; }
+
+    // ICorProfilerInfo3, unused.
+    HRESULT STDMETHODCALLTYPE EnumJITedFunctions(ICorProfilerFunctionEnum **ppEnum) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE RequestProfilerDetach(DWORD dwExpectedCompletionMilliseconds) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetFunctionIDMapper2(FunctionIDMapper2 *pFunc, void *clientData) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetStringLayout2(ULONG *pStringLengthOffset, ULONG *pBufferOffset) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetEnterLeaveFunctionHooks3(FunctionEnter3 *pFuncEnter3, FunctionLeave3 *pFuncLeave3, FunctionTailcall3 *pFuncTailcall3) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetEnterLeaveFunctionHooks3WithInfo(FunctionEnter3WithInfo *pFuncEnter3WithInfo, FunctionLeave3WithInfo *pFuncLeave3WithInfo, FunctionTailcall3WithInfo *pFuncTailcall3WithInfo) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionEnter3Info(FunctionID functionId, COR_PRF_ELT_INFO eltInfo, COR_PRF_FRAME_INFO *pFrameInfo, ULONG *pcbArgumentInfo, COR_PRF_FUNCTION_ARGUMENT_INFO *pArgumentInfo) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionLeave3Info(FunctionID functionId, COR_PRF_ELT_INFO eltInfo, COR_PRF_FRAME_INFO *pFrameInfo, COR_PRF_FUNCTION_ARGUMENT_RANGE *pRetvalRange) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionTailcall3Info(FunctionID functionId, COR_PRF_ELT_INFO eltInfo, COR_PRF_FRAME_INFO *pFrameInfo) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE EnumModules(ICorProfilerModuleEnum **ppEnum) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetRuntimeInformation(USHORT *pClrInstanceId, COR_PRF_RUNTIME_TYPE *pRuntimeType, USHORT *pMajorVersion, USHORT *pMinorVersion, USHORT *pBuildNumber, USHORT *pQFEVersion, ULONG cchVersionString, ULONG *pcchVersionString, WCHAR szVersionString[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetThreadStaticAddress2(ClassID classId, mdFieldDef fieldToken, AppDomainID appDomainId, ThreadID threadId, void **ppAddress) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetAppDomainsContainingModule(ModuleID moduleId, ULONG32 cAppDomainIds, ULONG32 *pcAppDomainIds, AppDomainID appDomainIds[]) override { return E_NOTIMPL; }
+
+    // ICorProfilerInfo4, unused.
+    HRESULT STDMETHODCALLTYPE EnumThreads(ICorProfilerThreadEnum **ppEnum) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE InitializeCurrentThread() override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetCodeInfo3(FunctionID functionID, ReJITID reJitId, ULONG32 cCodeInfos, ULONG32 *pcCodeInfos, COR_PRF_CODE_INFO codeInfos[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionFromIP2(LPCBYTE ip, FunctionID *pFunctionId, ReJITID *pReJitId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetReJITIDs(FunctionID functionId, ULONG cReJitIds, ULONG *pcReJitIds, ReJITID reJitIds[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetILToNativeMapping2(FunctionID functionId, ReJITID reJitId, ULONG32 cMap, ULONG32 *pcMap, COR_DEBUG_IL_TO_NATIVE_MAP map[]) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE EnumJITedFunctions2(ICorProfilerFunctionEnum **ppEnum) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetObjectSize2(ObjectID objectId, SIZE_T *pcSize) override { return E_NOTIMPL; }
+
+    // ICorProfilerInfo5, unused.
+    HRESULT STDMETHODCALLTYPE GetEventMask2(DWORD *pdwEventsLow, DWORD *pdwEventsHigh) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE SetEventMask2(DWORD dwEventsLow, DWORD dwEventsHigh) override { return E_NOTIMPL; }
+
+    // ICorProfilerInfo6, unused.
+    HRESULT STDMETHODCALLTYPE EnumNgenModuleMethodsInliningThisMethod(ModuleID inlinersModuleId, ModuleID inlineeModuleId, mdMethodDef inlineeMethodId, BOOL *incompleteData, ICorProfilerMethodEnum **ppEnum) override { return E_NOTIMPL; }
+
+    // ICorProfilerInfo7, unused.
+    HRESULT STDMETHODCALLTYPE ApplyMetaData(ModuleID moduleId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetInMemorySymbolsLength(ModuleID moduleId, DWORD *pCountSymbolBytes) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE ReadInMemorySymbols(ModuleID moduleId, DWORD symbolsReadOffset, BYTE *pSymbolBytes, DWORD countSymbolBytes, DWORD *pCountSymbolBytesRead) override { return E_NOTIMPL; }
+
+    // ICorProfilerInfo8, unused.
+    HRESULT STDMETHODCALLTYPE IsFunctionDynamic(FunctionID functionId, BOOL *isDynamic) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetFunctionFromIP3(LPCBYTE ip, FunctionID *functionId, ReJITID *pReJitId) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE GetDynamicFunctionInfo(FunctionID functionId, ModuleID *moduleId, PCCOR_SIGNATURE *ppvSig, ULONG *pbSig, ULONG cchName, ULONG *pcchName, WCHAR wszName[]) override { return E_NOTIMPL; }
+
+private:
+    struct Module
+    {
+        std::string path;
+        FakeMetaData* metadata;
+    };
+
+    // Bodies are never freed, so a pointer GetILFunctionBody returned stays
+    // valid after the profiler replaces the body, as in the runtime.
+    struct Method
+    {
+        const std::vector<BYTE>* original;
+        const std::vector<BYTE>* current;
+        ULONG requests;
+    };
+
+    std::atomic<int> refCount;
+    std::atomic<DWORD> eventMask;
+    std::mutex mutex;
+    std::map<ModuleID, Module> modules;
+    std::map<std::pair<ModuleID, mdMethodDef>, Method> methods;
+    std::map<FunctionID, std::pair<ModuleID, mdMethodDef>> functions;
+    std::deque<std::vector<BYTE>> bodies;
+    std::vector<std::pair<ModuleID, mdMethodDef>> rejits;
+    std::vector<std::pair<ModuleID, mdMethodDef>> reverts;
+    FunctionID nextFunction;
+    FakeMethodMalloc malloc;
+};
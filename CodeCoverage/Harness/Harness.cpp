@@ -0,0 +1,170 @@
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Harness.h"
+
+// Runs the profiler's code outside a runtime. Fakes of the profiling and
+// metadata interfaces stand in for the CLR, and rewritten method bodies
+// are executed by an IL interpreter, so probes write to real counters.
+//
+//   harness                     every check
+//   harness --bench             every benchmark
+//   harness [--bench] suite...  only the named suites
+//
+// Suites are rewriter, relax, components and profiler. Exits non-zero if a
+// check failed.
+
+static int checks = 0;
+static int failures = 0;
+static std::string checkContext;
+
+bool Check(bool condition, const char* expression, const char* file, int line)
+{
+    checks++;
+    if (!condition)
+    {
+        failures++;
+        printf("FAILED %s:%d: %s [%s]\n", file, line, expression, checkContext.c_str());
+    }
+    return condition;
+}
+
+bool CheckEqual(long long expected, long long actual, const char* expression, const char* file, int line)
+{
+    checks++;
+    if (expected != actual)
+    {
+        failures++;
+        printf("FAILED %s:%d: %s is %lld, expected %lld [%s]\n", file, line, expression, actual, expected, checkContext.c_str());
+    }
+    return expected == actual;
+}
+
+void SetCheckContext(const std::string& context)
+{
+    checkContext = context;
+}
+
+int Failures()
+{
+    return failures;
+}
+
+std::basic_string<WCHAR> Widen(const std::string& utf8)
+{
+    std::basic_string<WCHAR> text;
+    for (size_t i = 0; i < utf8.length();)
+    {
+        auto lead = static_cast<BYTE>(utf8[i]);
+        size_t length = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+        uint32_t codePoint = length == 1 ? lead : lead & (0xFF >> (length + 1));
+        for (size_t k = 1; k < length && i + k < utf8.length(); k++)
+            codePoint = (codePoint << 6) | (static_cast<BYTE>(utf8[i + k]) & 0x3F);
+        i += length;
+
+        if (codePoint >= 0x10000)
+        {
+            codePoint -= 0x10000;
+            text.push_back(static_cast<WCHAR>(0xD800 + (codePoint >> 10)));
+            text.push_back(static_cast<WCHAR>(0xDC00 + (codePoint & 0x3FF)));
+        }
+        else
+        {
+            text.push_back(static_cast<WCHAR>(codePoint));
+        }
+    }
+    return text;
+}
+
+std::string TemporaryDirectory()
+{
+    char path[] = "/tmp/codecoverage-harness.XXXXXX";
+    if (mkdtemp(path) == nullptr)
+    {
+        perror("mkdtemp");
+        exit(2);
+    }
+    return path;
+}
+
+void RemoveDirectory(const std::string& path)
+{
+    auto directory = opendir(path.c_str());
+    if (directory == nullptr)
+        return;
+
+    while (auto entry = readdir(directory))
+    {
+        std::string name(entry->d_name);
+        if (name != "." && name != "..")
+            unlink((path + "/" + name).c_str());
+    }
+    closedir(directory);
+    rmdir(path.c_str());
+}
+
+QuietStdout::QuietStdout()
+{
+    fflush(stdout);
+    this->saved = dup(STDOUT_FILENO);
+    auto null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+}
+
+QuietStdout::~QuietStdout()
+{
+    fflush(stdout);
+    dup2(this->saved, STDOUT_FILENO);
+    close(this->saved);
+}
+
+struct Suite
+{
+    const char* name;
+    void (*checks)();
+    void (*benchmarks)();
+};
+
+static const Suite suites[] =
+{
+    { "rewriter", RewriterChecks, RewriterBenchmarks },
+    { "relax", RelaxChecks, RelaxBenchmarks },
+    { "components", ComponentChecks, ComponentBenchmarks },
+    { "profiler", ProfilerChecks, ProfilerBenchmarks },
+};
+
+int main(int argc, char** argv)
+{
+    bool benchmarks = false;
+    std::vector<std::string> names;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bench") == 0)
+            benchmarks = true;
+        else
+            names.push_back(argv[i]);
+    }
+
+    for (const auto& suite : suites)
+    {
+        bool selected = names.empty();
+        for (const auto& name : names)
+            selected |= name == suite.name;
+        if (!selected)
+            continue;
+
+        printf("== %s %s\n", suite.name, benchmarks ? "benchmarks" : "checks");
+        fflush(stdout);
+        if (benchmarks)
+            suite.benchmarks();
+        else
+            suite.checks();
+    }
+
+    if (!benchmarks)
+        printf("%s: %d checks, %d failed\n", failures == 0 ? "PASSED" : "FAILED", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "cor.h"
+
+// Records a failed expectation with where it was made. Checks carry on
+// after a failure, so one run reports everything that is wrong.
+#define CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+#define CHECK_EQUAL(expected, actual) CheckEqual(static_cast<long long>(expected), static_cast<long long>(actual), #actual, __FILE__, __LINE__)
+
+bool Check(bool condition, const char* expression, const char* file, int line);
+bool CheckEqual(long long expected, long long actual, const char* expression, const char* file, int line);
+int Failures();
+
+// Named in every failure reported until it is changed, e.g. the method and
+// mode a check is running.
+void SetCheckContext(const std::string& context);
+
+// UTF-8 to the UTF-16 metadata names are in; surrogate pairs included.
+std::basic_string<WCHAR> Widen(const std::string& utf8);
+
+// A fresh, empty directory, and its removal with everything in it.
+std::string TemporaryDirectory();
+void RemoveDirectory(const std::string& path);
+
+// The profiler reports progress on stdout; checks silence it while they
+// call in, to keep their own output readable.
+class QuietStdout
+{
+public:
+    QuietStdout();
+    ~QuietStdout();
+
+private:
+    int saved;
+};
+
+class Stopwatch
+{
+public:
+    Stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+    double Seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+// Keeps the optimizer from dropping a benchmark's work.
+template<class T>
+inline void KeepAlive(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Each suite checks or measures one part of the profiler; see Harness.cpp.
+void RewriterChecks();
+void RewriterBenchmarks();
+void RelaxChecks();
+void RelaxBenchmarks();
+void ComponentChecks();
+void ComponentBenchmarks();
+void ProfilerChecks();
+void ProfilerBenchmarks();
@@ -0,0 +1,233 @@
+#include <climits>
+#include <cstring>
+#include "ILBuilder.h"
+
+#define OPERAND_SWITCH 0x80
+
+static const BYTE s_OperandSizes[] =
+{
+#define InlineNone           0
+#define ShortInlineVar       1
+#define InlineVar            2
+#define ShortInlineI         1
+#define InlineI              4
+#define InlineI8             8
+#define ShortInlineR         4
+#define InlineR              8
+#define ShortInlineBrTarget  1
+#define InlineBrTarget       4
+#define InlineMethod         4
+#define InlineField          4
+#define InlineType           4
+#define InlineString         4
+#define InlineSig            4
+#define InlineRVA            4
+#define InlineTok            4
+#define InlineSwitch         (4 | OPERAND_SWITCH)
+
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,flow) args,
+#include "opcode.def"
+#undef OPDEF
+
+#undef InlineNone
+#undef ShortInlineVar
+#undef InlineVar
+#undef ShortInlineI
+#undef InlineI
+#undef InlineI8
+#undef ShortInlineR
+#undef InlineR
+#undef ShortInlineBrTarget
+#undef InlineBrTarget
+#undef InlineMethod
+#undef InlineField
+#undef InlineType
+#undef InlineString
+#undef InlineSig
+#undef InlineRVA
+#undef InlineTok
+#undef InlineSwitch
+};
+
+unsigned OperandSize(unsigned opcode)
+{
+    return opcode < CEE_COUNT ? (s_OperandSizes[opcode] & ~OPERAND_SWITCH) : 0;
+}
+
+bool IsShortBranch(unsigned opcode)
+{
+    return (opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S) || opcode == CEE_LEAVE_S;
+}
+
+bool IsBranch(unsigned opcode)
+{
+    return IsShortBranch(opcode) || (opcode >= CEE_BR && opcode <= CEE_BLT_UN) || opcode == CEE_LEAVE;
+}
+
+ILBuilder::ILBuilder() : localVarSig(0), maxStack(8)
+{
+}
+
+ILBuilder::Label ILBuilder::NewLabel()
+{
+    this->labels.push_back(UINT_MAX);
+    return static_cast<Label>(this->labels.size() - 1);
+}
+
+void ILBuilder::Mark(Label label)
+{
+    this->labels[label] = static_cast<unsigned>(this->instructions.size());
+}
+
+void ILBuilder::Emit(unsigned opcode, INT64 operand)
+{
+    Instruction instruction = { opcode, operand, {}, 0 };
+    this->instructions.push_back(instruction);
+}
+
+void ILBuilder::Branch(unsigned opcode, Label target)
+{
+    Instruction instruction = { opcode, 0, { target }, 0 };
+    this->instructions.push_back(instruction);
+}
+
+void ILBuilder::Switch(const std::vector<Label>& targets)
+{
+    Instruction instruction = { CEE_SWITCH, static_cast<INT64>(targets.size()), targets, 0 };
+    this->instructions.push_back(instruction);
+}
+
+void ILBuilder::AddClause(CorExceptionFlag flags, Label tryBegin, Label tryEnd, Label handlerBegin, Label handlerEnd, DWORD classToken)
+{
+    Clause clause = { flags, tryBegin, tryEnd, handlerBegin, handlerEnd, classToken };
+    this->clauses.push_back(clause);
+}
+
+unsigned ILBuilder::EncodedSize(const Instruction& instruction)
+{
+    unsigned size = (instruction.opcode >= 0x100 ? 2 : 1) + OperandSize(instruction.opcode);
+    if (instruction.opcode == CEE_SWITCH)
+        size += static_cast<unsigned>(instruction.targets.size()) * sizeof(INT32);
+    return size;
+}
+
+unsigned ILBuilder::CodeSize() const
+{
+    unsigned size = 0;
+    for (const auto& instruction : this->instructions)
+        size += EncodedSize(instruction);
+    return size;
+}
+
+std::vector<BYTE> ILBuilder::Build() const
+{
+    std::vector<unsigned> offsets;
+    unsigned codeSize = 0;
+    for (const auto& instruction : this->instructions)
+    {
+        offsets.push_back(codeSize);
+        codeSize += EncodedSize(instruction);
+    }
+    offsets.push_back(codeSize);
+
+    std::vector<unsigned> labelOffsets;
+    for (auto index : this->labels)
+    {
+        if (index == UINT_MAX)
+            return std::vector<BYTE>();
+        labelOffsets.push_back(offsets[index]);
+    }
+
+    std::vector<BYTE> code(codeSize);
+    for (size_t i = 0; i < this->instructions.size(); i++)
+    {
+        const auto& instruction = this->instructions[i];
+        BYTE* out = &code[offsets[i]];
+        unsigned next = offsets[i + 1];
+
+        if (instruction.opcode >= 0x100)
+            *out++ = CEE_PREFIX1;
+        *out++ = static_cast<BYTE>(instruction.opcode & 0xFF);
+
+        if (instruction.opcode == CEE_SWITCH)
+        {
+            INT32 count = static_cast<INT32>(instruction.targets.size());
+            memcpy(out, &count, sizeof(count));
+            out += sizeof(count);
+            for (auto target : instruction.targets)
+            {
+                INT32 delta = static_cast<INT32>(labelOffsets[target] - next);
+                memcpy(out, &delta, sizeof(delta));
+                out += sizeof(delta);
+            }
+            continue;
+        }
+
+        if (IsBranch(instruction.opcode))
+        {
+            INT32 delta = static_cast<INT32>(labelOffsets[instruction.targets[0]] - next);
+            if (IsShortBranch(instruction.opcode))
+            {
+                if (delta != static_cast<INT8>(delta))
+                    return std::vector<BYTE>();
+                *out = static_cast<BYTE>(static_cast<INT8>(delta));
+            }
+            else
+            {
+                memcpy(out, &delta, sizeof(delta));
+            }
+            continue;
+        }
+
+        memcpy(out, &instruction.operand, OperandSize(instruction.opcode));
+    }
+
+    std::vector<BYTE> body;
+    if (this->clauses.empty() && this->localVarSig == 0 && this->maxStack <= 8 && codeSize < 64)
+    {
+        body.push_back(static_cast<BYTE>(CorILMethod_TinyFormat | (codeSize << 2)));
+        body.insert(body.end(), code.begin(), code.end());
+        return body;
+    }
+
+    IMAGE_COR_ILMETHOD_FAT header;
+    memset(&header, 0, sizeof(header));
+    header.Flags = CorILMethod_FatFormat | CorILMethod_InitLocals | (this->clauses.empty() ? 0 : CorILMethod_MoreSects);
+    header.Size = sizeof(header) / sizeof(DWORD);
+    header.MaxStack = this->maxStack;
+    header.CodeSize = codeSize;
+    header.LocalVarSigTok = this->localVarSig;
+
+    body.resize(sizeof(header));
+    memcpy(body.data(), &header, sizeof(header));
+    body.insert(body.end(), code.begin(), code.end());
+    if (this->clauses.empty())
+        return body;
+
+    body.resize((body.size() + 3) & ~size_t(3));
+
+    IMAGE_COR_ILMETHOD_SECT_FAT section;
+    section.Kind = CorILMethod_Sect_EHTable | CorILMethod_Sect_FatFormat;
+    section.DataSize = static_cast<unsigned>(sizeof(section) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * this->clauses.size());
+    auto position = body.size();
+    body.resize(position + sizeof(section));
+    memcpy(&body[position], &section, sizeof(section));
+
+    for (const auto& clause : this->clauses)
+    {
+        IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT fat;
+        memset(&fat, 0, sizeof(fat));
+        fat.Flags = clause.flags;
+        fat.TryOffset = labelOffsets[clause.tryBegin];
+        fat.TryLength = labelOffsets[clause.tryEnd] - labelOffsets[clause.tryBegin];
+        fat.HandlerOffset = labelOffsets[clause.handlerBegin];
+        fat.HandlerLength = labelOffsets[clause.handlerEnd] - labelOffsets[clause.handlerBegin];
+        fat.ClassToken = clause.classToken;
+
+        position = body.size();
+        body.resize(position + sizeof(fat));
+        memcpy(&body[position], &fat, sizeof(fat));
+    }
+
+    return body;
+}
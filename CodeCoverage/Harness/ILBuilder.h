@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include "cor.h"
+#include "corhlpr.h"
+
+// The same opcode numbering ILRewriter uses: one-byte opcodes are their
+// byte, two-byte ones are 0x100 plus the byte after CEE_PREFIX1.
+typedef enum
+{
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) c,
+#include "opcode.def"
+#undef OPDEF
+    CEE_COUNT
+} OPCODE;
+
+// Bytes of inline operand after the opcode; a switch reports its count
+// only, the targets follow it.
+unsigned OperandSize(unsigned opcode);
+bool IsBranch(unsigned opcode);
+bool IsShortBranch(unsigned opcode);
+
+// Assembles synthetic method bodies, header and EH section included, the
+// way a compiler would lay them out. Branches keep the form they are given
+// in; Build fails if a short one does not reach its label.
+class ILBuilder
+{
+public:
+    typedef unsigned Label;
+
+    ILBuilder();
+
+    Label NewLabel();
+    void Mark(Label label);
+
+    void Emit(unsigned opcode, INT64 operand = 0);
+    void Branch(unsigned opcode, Label target);
+    void Switch(const std::vector<Label>& targets);
+
+    void AddClause(CorExceptionFlag flags, Label tryBegin, Label tryEnd, Label handlerBegin, Label handlerEnd, DWORD classToken = 0);
+
+    // Without locals and with a small stack the body gets a tiny header.
+    void SetLocals(mdSignature localVarSig) { this->localVarSig = localVarSig; }
+    void SetMaxStack(unsigned maxStack) { this->maxStack = maxStack; }
+
+    unsigned CodeSize() const;
+
+    // The encoded body, or an empty one if a label is unmarked or a short
+    // branch is out of range.
+    std::vector<BYTE> Build() const;
+
+private:
+    struct Instruction
+    {
+        unsigned opcode;
+        INT64 operand;
+        std::vector<Label> targets;
+        unsigned offset;
+    };
+
+    struct Clause
+    {
+        CorExceptionFlag flags;
+        Label tryBegin;
+        Label tryEnd;
+        Label handlerBegin;
+        Label handlerEnd;
+        DWORD classToken;
+    };
+
+    std::vector<Instruction> instructions;
+    std::vector<Clause> clauses;
+    std::vector<unsigned> labels;
+    mdSignature localVarSig;
+    unsigned maxStack;
+
+    static unsigned EncodedSize(const Instruction& instruction);
+};
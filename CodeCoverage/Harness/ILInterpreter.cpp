@@ -0,0 +1,609 @@
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include "ILBuilder.h"
+#include "ILInterpreter.h"
+
+// Generous for the synthetic methods; only a broken branch gets near it.
+static const UINT64 StepLimit = 100000000;
+
+bool ILMethod::Parse(const BYTE* body, size_t available)
+{
+    this->clauses.clear();
+    if (available < 1)
+        return false;
+
+    if ((body[0] & 3) == CorILMethod_TinyFormat)
+    {
+        unsigned codeSize = body[0] >> 2;
+        if (1 + codeSize > available)
+            return false;
+
+        this->code.assign(body + 1, body + 1 + codeSize);
+        this->maxStack = 8;
+        this->localVarSig = 0;
+        this->tiny = true;
+        this->size = 1 + codeSize;
+        return true;
+    }
+
+    IMAGE_COR_ILMETHOD_FAT header;
+    if ((body[0] & 3) != CorILMethod_FatFormat || available < sizeof(header))
+        return false;
+    memcpy(&header, body, sizeof(header));
+
+    size_t headerSize = header.Size * sizeof(DWORD);
+    if (headerSize < sizeof(header) || headerSize + header.CodeSize > available)
+        return false;
+
+    this->code.assign(body + headerSize, body + headerSize + header.CodeSize);
+    this->maxStack = header.MaxStack;
+    this->localVarSig = header.LocalVarSigTok;
+    this->tiny = false;
+    this->size = headerSize + header.CodeSize;
+
+    bool more = (header.Flags & CorILMethod_MoreSects) != 0;
+    while (more)
+    {
+        this->size = (this->size + 3) & ~size_t(3);
+        if (this->size + 4 > available)
+            return false;
+
+        const BYTE* section = body + this->size;
+        bool fat = (section[0] & CorILMethod_Sect_FatFormat) != 0;
+        unsigned dataSize = fat ? (section[1] | (section[2] << 8) | (section[3] << 16)) : section[1];
+        if (dataSize < 4 || this->size + dataSize > available)
+            return false;
+
+        if ((section[0] & CorILMethod_Sect_KindMask) == CorILMethod_Sect_EHTable)
+        {
+            unsigned clauseSize = fat ? sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) : 12;
+            for (unsigned at = 4; at + clauseSize <= dataSize; at += clauseSize)
+            {
+                const BYTE* p = section + at;
+                IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT clause;
+                memset(&clause, 0, sizeof(clause));
+                if (fat)
+                {
+                    memcpy(&clause, p, sizeof(clause));
+                }
+                else
+                {
+                    clause.Flags = static_cast<CorExceptionFlag>(p[0] | (p[1] << 8));
+                    clause.TryOffset = p[2] | (p[3] << 8);
+                    clause.TryLength = p[4];
+                    clause.HandlerOffset = p[5] | (p[6] << 8);
+                    clause.HandlerLength = p[7];
+                    memcpy(&clause.ClassToken, p + 8, sizeof(DWORD));
+                }
+                this->clauses.push_back(clause);
+            }
+        }
+
+        more = (section[0] & CorILMethod_Sect_MoreSects) != 0;
+        this->size += dataSize;
+    }
+
+    return true;
+}
+
+static INT64 ReadOperand(const BYTE* p, unsigned size)
+{
+    switch (size)
+    {
+    case 1: return static_cast<INT8>(p[0]);
+    case 2: { INT16 v; memcpy(&v, p, sizeof(v)); return v; }
+    case 4: { INT32 v; memcpy(&v, p, sizeof(v)); return v; }
+    case 8: { INT64 v; memcpy(&v, p, sizeof(v)); return v; }
+    }
+    return 0;
+}
+
+bool DecodeIL(const ILMethod& method, std::vector<ILInstruction>& instructions, std::string& error)
+{
+    char message[128];
+    const auto& code = method.code;
+    unsigned codeSize = static_cast<unsigned>(code.size());
+
+    instructions.clear();
+    std::vector<bool> starts(codeSize + 1, false);
+    starts[codeSize] = true;
+
+    unsigned offset = 0;
+    while (offset < codeSize)
+    {
+        ILInstruction instruction;
+        instruction.offset = offset;
+        starts[offset] = true;
+
+        unsigned opcode = code[offset++];
+        if (opcode == CEE_PREFIX1)
+        {
+            if (offset >= codeSize)
+            {
+                error = "truncated two-byte opcode";
+                return false;
+            }
+            opcode = 0x100 + code[offset++];
+        }
+        if (opcode >= CEE_COUNT)
+        {
+            snprintf(message, sizeof(message), "unknown opcode 0x%x at IL_%04x", opcode, instruction.offset);
+            error = message;
+            return false;
+        }
+        instruction.opcode = opcode;
+
+        unsigned size = OperandSize(opcode);
+        if (offset + size > codeSize)
+        {
+            snprintf(message, sizeof(message), "truncated operand at IL_%04x", instruction.offset);
+            error = message;
+            return false;
+        }
+        instruction.operand = ReadOperand(&code[offset], size);
+        offset += size;
+
+        if (opcode == CEE_SWITCH)
+        {
+            auto count = static_cast<UINT32>(instruction.operand);
+            if (offset + size_t(count) * sizeof(INT32) > codeSize)
+            {
+                snprintf(message, sizeof(message), "truncated switch table at IL_%04x", instruction.offset);
+                error = message;
+                return false;
+            }
+            unsigned base = offset + count * sizeof(INT32);
+            for (UINT32 i = 0; i < count; i++)
+                instruction.targets.push_back(base + static_cast<INT32>(ReadOperand(&code[offset + i * sizeof(INT32)], sizeof(INT32))));
+            offset = base;
+        }
+        else if (IsBranch(opcode))
+        {
+            instruction.targets.push_back(offset + static_cast<INT32>(instruction.operand));
+        }
+
+        instruction.next = offset;
+        instructions.push_back(instruction);
+    }
+
+    for (const auto& instruction : instructions)
+    {
+        for (auto target : instruction.targets)
+        {
+            if (target >= codeSize || !starts[target])
+            {
+                snprintf(message, sizeof(message), "branch at IL_%04x lands inside an instruction (IL_%04x)", instruction.offset, target);
+                error = message;
+                return false;
+            }
+        }
+    }
+
+    for (const auto& clause : method.clauses)
+    {
+        unsigned boundaries[] = { clause.TryOffset, clause.TryOffset + clause.TryLength, clause.HandlerOffset, clause.HandlerOffset + clause.HandlerLength,
+            (clause.Flags & COR_ILEXCEPTION_CLAUSE_FILTER) ? clause.FilterOffset : clause.TryOffset };
+        for (auto boundary : boundaries)
+        {
+            if (boundary > codeSize || !starts[boundary])
+            {
+                snprintf(message, sizeof(message), "EH boundary IL_%04x is not an instruction start", boundary);
+                error = message;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+ILInterpreter::ILInterpreter(mdSignature probeSignature, mdMemberRef incrementRef, mdFieldDef threadStaticField) : probeSignature(probeSignature),
+    incrementRef(incrementRef), threadStaticField(threadStaticField), threadStaticValue(0), steps(0), method(nullptr)
+{
+}
+
+void ILInterpreter::Reset()
+{
+    this->executed.clear();
+    this->steps = 0;
+}
+
+bool ILInterpreter::Fail(const char* message, unsigned offset)
+{
+    char text[160];
+    snprintf(text, sizeof(text), "%s at IL_%04x", message, offset);
+    this->error = text;
+    return false;
+}
+
+bool ILInterpreter::Pop(Value& value)
+{
+    if (this->stack.empty())
+        return false;
+    value = this->stack.back();
+    this->stack.pop_back();
+    return true;
+}
+
+bool ILInterpreter::Run(const ILMethod& method, const std::vector<INT32>& args, INT64& result)
+{
+    this->error.clear();
+    this->method = &method;
+    if (!DecodeIL(method, this->instructions, this->error))
+        return false;
+
+    this->offsetToInstruction.assign(method.code.size() + 1, UINT_MAX);
+    for (unsigned i = 0; i < this->instructions.size(); i++)
+        this->offsetToInstruction[this->instructions[i].offset] = i;
+
+    if (this->executed.size() < method.code.size())
+        this->executed.resize(method.code.size());
+
+    Value zero = { Type::Int32, 0 };
+    this->stack.clear();
+    this->locals.assign(16, zero);
+    this->args = args;
+
+    result = 0;
+    return Execute(0, false, result);
+}
+
+// Runs the finally handlers a leave from one offset to another exits, the
+// innermost first, as clauses are ordered.
+bool ILInterpreter::Leave(unsigned from, unsigned to)
+{
+    for (const auto& clause : this->method->clauses)
+    {
+        if ((clause.Flags & COR_ILEXCEPTION_CLAUSE_FINALLY) == 0)
+            continue;
+
+        bool inside = from >= clause.TryOffset && from < clause.TryOffset + clause.TryLength;
+        bool targetInside = to >= clause.TryOffset && to < clause.TryOffset + clause.TryLength;
+        if (!inside || targetInside)
+            continue;
+
+        std::vector<Value> saved;
+        saved.swap(this->stack);
+        INT64 ignored;
+        if (!Execute(clause.HandlerOffset, true, ignored))
+            return false;
+        this->stack.swap(saved);
+    }
+    return true;
+}
+
+bool ILInterpreter::Execute(unsigned offset, bool inFinally, INT64& result)
+{
+    unsigned index = this->offsetToInstruction[offset];
+
+    for (;;)
+    {
+        if (index >= this->instructions.size())
+            return Fail("fell off the end of the method", offset);
+
+        const auto& instruction = this->instructions[index];
+        offset = instruction.offset;
+        if (++this->steps > StepLimit)
+            return Fail("step limit reached", offset);
+        this->executed[offset]++;
+
+        unsigned opcode = instruction.opcode;
+        unsigned target = instruction.next;
+        Value a, b;
+
+        switch (opcode)
+        {
+        case CEE_NOP:
+            break;
+
+        case CEE_LDARG_0:
+        case CEE_LDARG_1:
+        case CEE_LDARG_2:
+        case CEE_LDARG_3:
+        case CEE_LDARG_S:
+        {
+            auto arg = opcode == CEE_LDARG_S ? static_cast<unsigned>(instruction.operand & 0xFF) : opcode - CEE_LDARG_0;
+            if (arg >= this->args.size())
+                return Fail("ldarg of a missing argument", offset);
+            Value value = { Type::Int32, this->args[arg] };
+            this->stack.push_back(value);
+            break;
+        }
+
+        case CEE_LDLOC_0:
+        case CEE_LDLOC_1:
+        case CEE_LDLOC_2:
+        case CEE_LDLOC_3:
+        case CEE_LDLOC_S:
+        {
+            auto local = opcode == CEE_LDLOC_S ? static_cast<unsigned>(instruction.operand & 0xFF) : opcode - CEE_LDLOC_0;
+            if (local >= this->locals.size())
+                return Fail("ldloc out of range", offset);
+            this->stack.push_back(this->locals[local]);
+            break;
+        }
+
+        case CEE_STLOC_0:
+        case CEE_STLOC_1:
+        case CEE_STLOC_2:
+        case CEE_STLOC_3:
+        case CEE_STLOC_S:
+        {
+            auto local = opcode == CEE_STLOC_S ? static_cast<unsigned>(instruction.operand & 0xFF) : opcode - CEE_STLOC_0;
+            if (local >= this->locals.size() || !Pop(a))
+                return Fail("bad stloc", offset);
+            this->locals[local] = a;
+            break;
+        }
+
+        case CEE_LDC_I4_M1:
+        case CEE_LDC_I4_0:
+        case CEE_LDC_I4_1:
+        case CEE_LDC_I4_2:
+        case CEE_LDC_I4_3:
+        case CEE_LDC_I4_4:
+        case CEE_LDC_I4_5:
+        case CEE_LDC_I4_6:
+        case CEE_LDC_I4_7:
+        case CEE_LDC_I4_8:
+        {
+            Value value = { Type::Int32, static_cast<INT64>(opcode) - CEE_LDC_I4_0 };
+            this->stack.push_back(value);
+            break;
+        }
+
+        case CEE_LDC_I4_S:
+        case CEE_LDC_I4:
+        {
+            Value value = { Type::Int32, instruction.operand };
+            this->stack.push_back(value);
+            break;
+        }
+
+        case CEE_LDC_I8:
+        {
+            Value value = { Type::Int64, instruction.operand };
+            this->stack.push_back(value);
+            break;
+        }
+
+        case CEE_DUP:
+            if (this->stack.empty())
+                return Fail("dup on an empty stack", offset);
+            this->stack.push_back(this->stack.back());
+            break;
+
+        case CEE_POP:
+            if (!Pop(a))
+                return Fail("pop on an empty stack", offset);
+            break;
+
+        case CEE_ADD:
+        case CEE_SUB:
+        case CEE_MUL:
+        case CEE_AND:
+        case CEE_OR:
+        case CEE_XOR:
+        {
+            if (!Pop(b) || !Pop(a))
+                return Fail("stack underflow", offset);
+
+            Type type;
+            if (a.type == Type::Int32 && b.type == Type::Int32)
+                type = Type::Int32;
+            else if (a.type == Type::Int64 && b.type == Type::Int64)
+                type = Type::Int64;
+            else if (a.type != Type::Int64 && b.type != Type::Int64)
+                type = Type::NativeInt;
+            else
+                return Fail("int64 operand mixed with a narrower one", offset);
+
+            UINT64 x = a.value, y = b.value, r = 0;
+            switch (opcode)
+            {
+            case CEE_ADD: r = x + y; break;
+            case CEE_SUB: r = x - y; break;
+            case CEE_MUL: r = x * y; break;
+            case CEE_AND: r = x & y; break;
+            case CEE_OR:  r = x | y; break;
+            case CEE_XOR: r = x ^ y; break;
+            }
+            Value value = { type, type == Type::Int32 ? static_cast<INT32>(r) : static_cast<INT64>(r) };
+            this->stack.push_back(value);
+            break;
+        }
+
+        case CEE_CEQ:
+        {
+            if (!Pop(b) || !Pop(a))
+                return Fail("stack underflow", offset);
+            Value value = { Type::Int32, a.value == b.value ? 1 : 0 };
+            this->stack.push_back(value);
+            break;
+        }
+
+        case CEE_CONV_I8:
+        case CEE_CONV_I:
+        case CEE_CONV_U:
+        {
+            if (!Pop(a))
+                return Fail("stack underflow", offset);
+            if (a.type == Type::Int32 && opcode == CEE_CONV_U)
+                a.value = static_cast<UINT32>(a.value);
+            a.type = opcode == CEE_CONV_I8 ? Type::Int64 : Type::NativeInt;
+            this->stack.push_back(a);
+            break;
+        }
+
+        case CEE_LDIND_U1:
+        case CEE_LDIND_I4:
+        case CEE_LDIND_U4:
+        case CEE_LDIND_I8:
+        {
+            if (!Pop(a) || a.type != Type::NativeInt)
+                return Fail("indirect load needs a native int address", offset);
+
+            auto address = reinterpret_cast<const void*>(static_cast<UINT_PTR>(a.value));
+            Value value = { Type::Int32, 0 };
+            if (opcode == CEE_LDIND_U1)
+            {
+                value.value = *static_cast<const volatile BYTE*>(address);
+            }
+            else if (opcode == CEE_LDIND_I8)
+            {
+                value.type = Type::Int64;
+                value.value = *static_cast<const volatile INT64*>(address);
+            }
+            else
+            {
+                value.value = *static_cast<const volatile INT32*>(address);
+            }
+            this->stack.push_back(value);
+            break;
+        }
+
+        case CEE_STIND_I1:
+        case CEE_STIND_I4:
+        case CEE_STIND_I8:
+        {
+            if (!Pop(b) || !Pop(a) || a.type != Type::NativeInt)
+                return Fail("indirect store needs a native int address", offset);
+            if ((opcode == CEE_STIND_I8) != (b.type == Type::Int64))
+                return Fail("indirect store of the wrong width", offset);
+
+            auto address = reinterpret_cast<void*>(static_cast<UINT_PTR>(a.value));
+            if (opcode == CEE_STIND_I1)
+                *static_cast<volatile BYTE*>(address) = static_cast<BYTE>(b.value);
+            else if (opcode == CEE_STIND_I4)
+                *static_cast<volatile INT32*>(address) = static_cast<INT32>(b.value);
+            else
+                *static_cast<volatile INT64*>(address) = b.value;
+            break;
+        }
+
+        case CEE_BR_S:
+        case CEE_BR:
+            target = instruction.targets[0];
+            break;
+
+        case CEE_BRTRUE_S:
+        case CEE_BRTRUE:
+        case CEE_BRFALSE_S:
+        case CEE_BRFALSE:
+        {
+            if (!Pop(a))
+                return Fail("stack underflow", offset);
+            bool isTrue = a.type == Type::Int32 ? static_cast<INT32>(a.value) != 0 : a.value != 0;
+            if (isTrue == (opcode == CEE_BRTRUE_S || opcode == CEE_BRTRUE))
+                target = instruction.targets[0];
+            break;
+        }
+
+        case CEE_BEQ_S:
+        case CEE_BEQ:
+        case CEE_BNE_UN_S:
+        case CEE_BNE_UN:
+        case CEE_BLT_S:
+        case CEE_BLT:
+        case CEE_BGE_S:
+        case CEE_BGE:
+        {
+            if (!Pop(b) || !Pop(a))
+                return Fail("stack underflow", offset);
+            bool taken;
+            if (opcode == CEE_BEQ_S || opcode == CEE_BEQ)
+                taken = a.value == b.value;
+            else if (opcode == CEE_BNE_UN_S || opcode == CEE_BNE_UN)
+                taken = a.value != b.value;
+            else if (opcode == CEE_BLT_S || opcode == CEE_BLT)
+                taken = a.value < b.value;
+            else
+                taken = a.value >= b.value;
+            if (taken)
+                target = instruction.targets[0];
+            break;
+        }
+
+        case CEE_SWITCH:
+        {
+            if (!Pop(a) || a.type != Type::Int32)
+                return Fail("switch needs an int32", offset);
+            auto value = static_cast<UINT32>(a.value);
+            if (value < instruction.targets.size())
+                target = instruction.targets[value];
+            break;
+        }
+
+        case CEE_LEAVE_S:
+        case CEE_LEAVE:
+            target = instruction.targets[0];
+            this->stack.clear();
+            if (!Leave(offset, target))
+                return false;
+            break;
+
+        case CEE_ENDFINALLY:
+            if (!inFinally)
+                return Fail("endfinally outside a finally handler", offset);
+            this->stack.clear();
+            return true;
+
+        case CEE_RET:
+            if (inFinally)
+                return Fail("ret inside a finally handler", offset);
+            if (this->stack.size() > 1)
+                return Fail("stack not empty at ret", offset);
+            result = this->stack.empty() ? 0 : this->stack.back().value;
+            this->stack.clear();
+            return true;
+
+        case CEE_CALLI:
+        {
+            if (static_cast<mdSignature>(instruction.operand) != this->probeSignature)
+                return Fail("calli with an unexpected signature", offset);
+            if (!Pop(b) || !Pop(a) || a.type == Type::Int32 || b.type == Type::Int32)
+                return Fail("calli needs a native int argument and target", offset);
+            auto probe = reinterpret_cast<Probe>(static_cast<UINT_PTR>(b.value));
+            probe(static_cast<UINT_PTR>(a.value));
+            break;
+        }
+
+        case CEE_LDSFLD:
+        {
+            if (static_cast<mdFieldDef>(instruction.operand) != this->threadStaticField)
+                return Fail("load of an unexpected field", offset);
+            Value value = { Type::Int32, this->threadStaticValue };
+            this->stack.push_back(value);
+            break;
+        }
+
+        case CEE_STSFLD:
+            if (static_cast<mdFieldDef>(instruction.operand) != this->threadStaticField)
+                return Fail("store to an unexpected field", offset);
+            if (!Pop(a) || a.type != Type::Int32)
+                return Fail("the field needs an int32", offset);
+            this->threadStaticValue = static_cast<INT32>(a.value);
+            break;
+
+        case CEE_CALL:
+        {
+            if (static_cast<mdMemberRef>(instruction.operand) != this->incrementRef)
+                return Fail("call to an unexpected method", offset);
+            if (!Pop(a) || a.type != Type::NativeInt)
+                return Fail("Increment needs a native int address", offset);
+            auto counter = reinterpret_cast<INT64*>(static_cast<UINT_PTR>(a.value));
+            this->stack.push_back({ Type::Int64, __sync_add_and_fetch(counter, 1) });
+            break;
+        }
+
+        default:
+            return Fail("unsupported opcode", offset);
+        }
+
+        if (this->stack.size() > this->method->maxStack)
+            return Fail("stack deeper than the header's max stack", offset);
+
+        index = this->offsetToInstruction[target];
+    }
+}
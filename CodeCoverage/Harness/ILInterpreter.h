@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "cor.h"
+#include "corhlpr.h"
+
+// A method body as the runtime reads it: header, code and EH clauses, with
+// tiny EH clauses widened.
+struct ILMethod
+{
+    std::vector<BYTE> code;
+    unsigned maxStack;
+    mdSignature localVarSig;
+    bool tiny;
+    std::vector<IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT> clauses;
+
+    // Bytes the header, code and sections take.
+    size_t size;
+
+    // False if the header or a section is malformed or runs past the end.
+    bool Parse(const BYTE* body, size_t available);
+};
+
+struct ILInstruction
+{
+    unsigned offset;
+    unsigned next;
+    unsigned opcode;
+    INT64 operand;
+
+    // Branch and switch targets, as code offsets.
+    std::vector<unsigned> targets;
+};
+
+// Splits the code into instructions. Fails on unknown opcodes, truncated
+// operands, and branch targets or EH boundaries that are not the start of
+// an instruction.
+bool DecodeIL(const ILMethod& method, std::vector<ILInstruction>& instructions, std::string& error);
+
+// Runs the subset of IL that synthetic methods and the profiler's probes
+// use: constants, locals and arguments, integer arithmetic, indirect loads
+// and stores to native memory, branches, switch, leave through finally
+// handlers, calli to native probes taking one native int, calls to
+// Interlocked.Increment(ref long), done atomically, and one thread-static
+// uint32 field, which lives in the interpreter, as each runs on one
+// thread and keeps it from one Run to the next. Stack values
+// carry their IL type, so a probe that mixes int32 and native int wrongly
+// fails here as the JIT would reject it.
+class ILInterpreter
+{
+public:
+    typedef void (STDMETHODCALLTYPE *Probe)(UINT_PTR);
+
+    ILInterpreter(mdSignature probeSignature, mdMemberRef incrementRef, mdFieldDef threadStaticField);
+
+    // Executes the method; the result is 0 for a void return.
+    bool Run(const ILMethod& method, const std::vector<INT32>& args, INT64& result);
+
+    const std::string& Error() const { return error; }
+
+    // Indexed by code offset: how many times the instruction there ran,
+    // summed over every Run since the last Reset.
+    const std::vector<UINT64>& Executed() const { return executed; }
+    UINT64 Steps() const { return steps; }
+    void Reset();
+
+private:
+    enum class Type { Int32, Int64, NativeInt };
+
+    struct Value
+    {
+        Type type;
+        INT64 value;
+    };
+
+    mdSignature probeSignature;
+    mdMemberRef incrementRef;
+    mdFieldDef threadStaticField;
+    INT64 threadStaticValue;
+    std::string error;
+    std::vector<UINT64> executed;
+    UINT64 steps;
+
+    const ILMethod* method;
+    std::vector<ILInstruction> instructions;
+    std::vector<unsigned> offsetToInstruction;
+    std::vector<Value> stack;
+    std::vector<Value> locals;
+    std::vector<INT32> args;
+
+    bool Execute(unsigned offset, bool inFinally, INT64& result);
+    bool Leave(unsigned from, unsigned to);
+    bool Pop(Value& value);
+    bool Fail(const char* message, unsigned offset);
+};
@@ -0,0 +1,785 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include "CorProfiler.h"
+#include "EdgeMap.h"
+#include "FakeMetaData.h"
+#include "FakeProfilerInfo.h"
+#include "Harness.h"
+#include "ILInterpreter.h"
+#include "SyntheticMethods.h"
+
+// Drives CorProfiler the way the runtime would: Initialize, a module load,
+// JIT compilation of its methods, the methods running, and Shutdown. The
+// reports it writes are then checked against what the interpreter ran.
+
+static const ModuleID CoveredModule = 0x2000;
+static const ModuleID OtherModule = 0x3000;
+static const ModuleID FirstEmptyModule = 0x10000;
+
+// The native probes, as the rewritten IL's calli reaches them.
+extern void(STDMETHODCALLTYPE* EnterMethodAddress)(UINT_PTR);
+extern void(STDMETHODCALLTYPE* SampleEnterMethodAddress)(UINT_PTR);
+
+struct ProfilerOptions
+{
+    const char* mode;
+    const char* samplePeriod;
+    bool blocks;
+    std::string ilCache;
+    std::string edgeShm;
+
+    // Covered modules without methods, loaded ahead of the covered one so
+    // that it gets a later sampler.
+    size_t emptyModules;
+};
+
+static void SetEnvironment(const char* name, const char* value)
+{
+    if (value != nullptr && *value != 0)
+        setenv(name, value, 1);
+    else
+        unsetenv(name);
+}
+
+// A module with every synthetic method on Fake.Program, plus the state
+// machine of Loop, whose MoveNext runs the same body.
+struct FakeModule
+{
+    FakeMetaData metadata;
+    std::vector<SyntheticMethod> methods;
+    std::vector<mdMethodDef> tokens;
+    mdTypeDef program;
+    mdMethodDef moveNext;
+
+    FakeModule() : methods(SyntheticMethods())
+    {
+        this->program = this->metadata.AddType("Fake.Program");
+        for (const auto& method : this->methods)
+            this->tokens.push_back(this->metadata.AddMethod(this->program, method.name));
+
+        auto stateMachine = this->metadata.AddType("<Loop>d__1", this->program);
+        this->moveNext = this->metadata.AddMethod(stateMachine, "MoveNext");
+        auto loop = this->methods[2];
+        loop.name = "MoveNext";
+        loop.runs = { { 3 }, { 4 } };
+        this->methods.push_back(loop);
+        this->tokens.push_back(this->moveNext);
+    }
+
+    void Load(FakeProfilerInfo& info, ModuleID module)
+    {
+        info.AddModule(module, module == CoveredModule ? "/app/Fake.Example.dll" : "/app/Other.dll", &this->metadata);
+        for (size_t i = 0; i < this->methods.size(); i++)
+            info.SetOriginalBody(module, this->tokens[i], this->methods[i].body);
+    }
+};
+
+struct ReportRow
+{
+    UINT64 invocations;
+    UINT64 resumes;
+    std::string source;
+};
+
+static std::vector<std::vector<std::string>> ReadCsv(const std::string& path)
+{
+    std::vector<std::vector<std::string>> rows;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, ','))
+            fields.push_back(field);
+        if (!line.empty() && line.back() == ',')
+            fields.push_back("");
+        rows.push_back(fields);
+    }
+    return rows;
+}
+
+static UINT64 SumBytes(const std::string& shm)
+{
+    UINT64 sum = 0;
+    auto fd = shm_open(shm.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    size_t size = status.st_size;
+    auto map = static_cast<const BYTE*>(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    for (size_t i = 0; i < size; i++)
+        sum += map[i];
+    munmap(const_cast<BYTE*>(map), size);
+    return sum;
+}
+
+static off_t SegmentSize(const char* shm)
+{
+    struct stat status;
+    auto fd = shm_open(shm, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    auto size = fstat(fd, &status) == 0 ? status.st_size : -1;
+    close(fd);
+    return size;
+}
+
+// Everything one profiler session saw.
+struct Session
+{
+    std::map<std::string, ReportRow> report;
+    std::map<std::string, std::vector<std::vector<std::string>>> blocks;
+    std::vector<std::vector<UINT64>> executed;
+    std::vector<ULONG> bodyRequests;
+    UINT64 edgeBumps;
+    size_t references;
+};
+
+static Session RunProfiler(const ProfilerOptions& options)
+{
+    Session session = Session();
+    SetEnvironment("CODE_COVERAGE_MODE", options.mode);
+    SetEnvironment("CODE_COVERAGE_SAMPLE_PERIOD", options.samplePeriod);
+    SetEnvironment("CODE_COVERAGE_SAMPLE_PERIODS", nullptr);
+    SetEnvironment("CODE_COVERAGE_FILTER", nullptr);
+    SetEnvironment("CODE_COVERAGE_BLOCKS", options.blocks ? "1" : nullptr);
+    SetEnvironment("CODE_COVERAGE_LINES", nullptr);
+    SetEnvironment("CODE_COVERAGE_EDGE_SHM", options.edgeShm.c_str());
+    SetEnvironment("CODE_COVERAGE_IL_CACHE", options.ilCache.c_str());
+    SetEnvironment("CODE_COVERAGE_CONTROL", nullptr);
+
+    FakeProfilerInfo info;
+    FakeModule module;
+    FakeModule other;
+    module.Load(info, CoveredModule);
+    other.Load(info, OtherModule);
+
+    std::string covered = "Fake.Example.dll";
+    std::vector<std::unique_ptr<FakeMetaData>> empty;
+    for (size_t i = 0; i < options.emptyModules; i++)
+    {
+        auto name = "Empty" + std::to_string(i) + ".dll";
+        covered += "," + name;
+        empty.emplace_back(new FakeMetaData());
+        info.AddModule(FirstEmptyModule + i, "/app/" + name, empty.back().get());
+    }
+    SetEnvironment("CORECLR_PROFILER_DLL", covered.c_str());
+
+    auto profiler = new CorProfiler();
+    profiler->AddRef();
+    {
+        QuietStdout quiet;
+        CHECK(SUCCEEDED(profiler->Initialize(&info)));
+        for (size_t i = 0; i < options.emptyModules; i++)
+            CHECK(SUCCEEDED(profiler->ModuleLoadFinished(FirstEmptyModule + i, S_OK)));
+        CHECK(SUCCEEDED(profiler->ModuleLoadFinished(CoveredModule, S_OK)));
+        CHECK(SUCCEEDED(profiler->ModuleLoadFinished(OtherModule, S_OK)));
+    }
+    CHECK((info.EventMask() & COR_PRF_MONITOR_JIT_COMPILATION) != 0);
+
+    // Counter probes call Interlocked.Increment through a memberref that
+    // the profiler adds to each covered module at load, and edge probes
+    // keep the previous block in a thread-static field it adds.
+    mdMemberRef incrementRef = mdMemberRefNil;
+    mdFieldDef previousLocation = mdFieldDefNil;
+    if (strcmp(options.mode, "counter") == 0)
+    {
+        incrementRef = TokenFromRid(1, mdtMemberRef);
+        std::vector<BYTE> signature = { IMAGE_CEE_CS_CALLCONV_DEFAULT, 1, ELEMENT_TYPE_I8, ELEMENT_TYPE_BYREF, ELEMENT_TYPE_I8 };
+        CHECK_EQUAL(3, module.metadata.ReferenceCount());
+        CHECK(module.metadata.DescribeReference(incrementRef) == Widen("[System.Private.CoreLib]System.Threading.Interlocked::Increment"));
+        CHECK(module.metadata.MemberRefSignature(incrementRef) == signature);
+    }
+    else if (strcmp(options.mode, "edge") == 0)
+    {
+        previousLocation = TokenFromRid(1, mdtFieldDef);
+        std::vector<BYTE> signature = { IMAGE_CEE_CS_CALLCONV_FIELD, ELEMENT_TYPE_U4 };
+        CHECK(module.metadata.DescribeField(previousLocation) == Widen("<EdgeCoverage>::previousLocation"));
+        CHECK((module.metadata.FieldFlags(previousLocation) & fdStatic) != 0);
+        CHECK(module.metadata.FieldSignature(previousLocation) == signature);
+        auto attributes = module.metadata.FieldAttributes(previousLocation);
+        if (CHECK_EQUAL(1, attributes.size()))
+            CHECK(module.metadata.DescribeReference(attributes[0]) == Widen("[System.Private.CoreLib]System.ThreadStaticAttribute::.ctor"));
+    }
+    else
+    {
+        CHECK_EQUAL(0, module.metadata.ReferenceCount());
+    }
+    CHECK_EQUAL(0, other.metadata.ReferenceCount());
+
+    // The runtime compiles on many threads at once.
+    std::vector<FunctionID> functions;
+    std::vector<FunctionID> otherFunctions;
+    for (size_t i = 0; i < module.methods.size(); i++)
+    {
+        functions.push_back(info.AddFunction(CoveredModule, module.tokens[i]));
+        otherFunctions.push_back(info.AddFunction(OtherModule, other.tokens[i]));
+    }
+    std::vector<std::thread> compilers;
+    for (size_t t = 0; t < 4; t++)
+    {
+        compilers.emplace_back([&, t]
+        {
+            for (size_t i = t; i < functions.size(); i += 4)
+            {
+                CHECK(SUCCEEDED(profiler->JITCompilationStarted(functions[i], TRUE)));
+                CHECK(SUCCEEDED(profiler->JITCompilationStarted(otherFunctions[i], TRUE)));
+            }
+        });
+    }
+    for (auto& compiler : compilers)
+        compiler.join();
+
+    for (size_t i = 0; i < module.methods.size(); i++)
+    {
+        CHECK(info.Rewritten(CoveredModule, module.tokens[i]));
+        CHECK(!info.Rewritten(OtherModule, other.tokens[i]));
+        session.bodyRequests.push_back(info.BodyRequests(CoveredModule, module.tokens[i]));
+    }
+
+    // Sample countdowns are thread-local and live as long as the thread,
+    // so each session runs its methods on a thread of its own.
+    std::thread runner([&]
+    {
+        ILInterpreter interpreter(TokenFromRid(1, mdtSignature), incrementRef, previousLocation);
+        for (size_t i = 0; i < module.methods.size(); i++)
+        {
+            const auto& method = module.methods[i];
+            ILInterpreter original(0, mdMemberRefNil, mdFieldDefNil);
+            auto body = info.CurrentBody(CoveredModule, module.tokens[i]);
+            ILMethod rewritten, source;
+            session.executed.emplace_back();
+            if (!CHECK(rewritten.Parse(body.data(), body.size())) || !CHECK(source.Parse(method.body.data(), method.body.size())))
+                continue;
+
+            for (const auto& args : method.runs)
+            {
+                INT64 expected, result;
+                CHECK(original.Run(source, args, expected));
+                if (!Check(interpreter.Run(rewritten, args, result), interpreter.Error().c_str(), __FILE__, __LINE__))
+                    break;
+                CHECK_EQUAL(expected, result);
+            }
+            session.executed.back() = original.Executed();
+        }
+    });
+    runner.join();
+
+    // Hit-once probes queue their methods for a ReJIT back to the original
+    // IL; the runtime then asks for the new body.
+    if (strcmp(options.mode, "hitonce") == 0)
+    {
+        for (int wait = 0; wait < 500 && info.ReJitRequests().size() < module.methods.size(); wait++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto requests = info.ReJitRequests();
+        CHECK_EQUAL(module.methods.size(), requests.size());
+        for (const auto& request : requests)
+        {
+            CHECK_EQUAL(CoveredModule, request.first);
+            auto index = std::find(module.tokens.begin(), module.tokens.end(), request.second) - module.tokens.begin();
+            FakeFunctionControl control;
+            CHECK(SUCCEEDED(profiler->GetReJITParameters(request.first, request.second, &control)));
+            CHECK(control.Body() == module.methods[index].body);
+        }
+    }
+
+    if (!options.edgeShm.empty())
+        session.edgeBumps = SumBytes(options.edgeShm);
+
+    {
+        QuietStdout quiet;
+        CHECK(SUCCEEDED(profiler->Shutdown()));
+    }
+    profiler->Release();
+    session.references = module.metadata.References();
+
+    for (const auto& row : ReadCsv("coverage.csv"))
+    {
+        if (!CHECK_EQUAL(6, row.size()) || !CHECK(row[0] == "Fake.Example.dll"))
+            continue;
+        auto& entry = session.report[row[1] + "." + row[2]];
+        entry.invocations = std::strtoull(row[3].c_str(), nullptr, 10);
+        entry.resumes = std::strtoull(row[4].c_str(), nullptr, 10);
+        entry.source = row[5];
+    }
+    if (options.blocks)
+    {
+        for (const auto& row : ReadCsv("coverage-blocks.csv"))
+        {
+            if (CHECK_EQUAL(6, row.size()))
+                session.blocks[row[1] + "." + row[2]].push_back(row);
+        }
+    }
+    unlink("coverage.csv");
+    unlink("coverage-blocks.csv");
+    return session;
+}
+
+static std::string ReportName(const FakeModule& module, size_t i)
+{
+    return (i + 1 == module.methods.size() ? "Fake.Program+<Loop>d__1." : "Fake.Program.") + module.methods[i].name;
+}
+
+static void CheckInvocations(const char* mode, const char* samplePeriod, bool blocks, size_t emptyModules = 0)
+{
+    SetCheckContext(std::string("profiler, ") + mode + (samplePeriod ? std::string(" ") + samplePeriod : "") + (blocks ? ", blocks" : "") +
+        (emptyModules ? ", after " + std::to_string(emptyModules) + " modules" : ""));
+    ProfilerOptions options = { mode, samplePeriod, blocks, "", "", emptyModules };
+    auto session = RunProfiler(options);
+    CHECK_EQUAL(1, session.references);
+
+    FakeModule module;
+    CHECK_EQUAL(module.methods.size(), session.report.size());
+    UINT64 calls = 0;
+    UINT64 reported = 0;
+    for (size_t i = 0; i < module.methods.size(); i++)
+    {
+        auto name = ReportName(module, i);
+        auto row = session.report.find(name);
+        if (!Check(row != session.report.end(), name.c_str(), __FILE__, __LINE__))
+            continue;
+
+        UINT64 runs = module.methods[i].runs.size();
+        calls += runs;
+        reported += row->second.invocations;
+        if (strcmp(mode, "hitonce") == 0 || strcmp(mode, "bitmap") == 0)
+            CHECK_EQUAL(1, row->second.invocations);
+        else if (strcmp(mode, "sample") != 0 || strcmp(samplePeriod, "1") == 0)
+            CHECK_EQUAL(runs, row->second.invocations);
+
+        if (!blocks || i >= session.executed.size())
+            continue;
+
+        // One row per block, each with the hits of its first instruction.
+        const auto& executed = session.executed[i];
+        const auto& rows = session.blocks[name];
+        CHECK(!rows.empty());
+        for (const auto& block : rows)
+        {
+            auto start = std::strtoul(block[3].c_str(), nullptr, 10);
+            auto hits = std::strtoull(block[5].c_str(), nullptr, 10);
+            if (CHECK(start < executed.size()))
+                CHECK_EQUAL(strcmp(mode, "bitmap") == 0 ? (executed[start] > 0 ? 1 : 0) : executed[start], hits);
+        }
+    }
+
+    // The countdown is per assembly, so across the module one call in N is
+    // recorded, starting with the first, and each stands for N calls.
+    if (strcmp(mode, "sample") == 0)
+    {
+        auto period = std::strtoull(samplePeriod, nullptr, 10);
+        CHECK_EQUAL((calls + period - 1) / period * period, reported);
+    }
+
+    // MoveNext's calls are resumes of the method that started the state
+    // machine.
+    auto moveNext = session.report["Fake.Program+<Loop>d__1.MoveNext"];
+    auto loop = session.report["Fake.Program.Loop"];
+    CHECK(moveNext.source == "Fake.Program.Loop");
+    CHECK_EQUAL(moveNext.invocations, loop.resumes);
+}
+
+// A fuzzer creates the segment at the size it wants before starting the
+// target; the profiler must map it as it is rather than resize it. With no
+// size given the profiler creates the segment itself.
+static void CheckEdgeSession(off_t existingSize)
+{
+    SetCheckContext(existingSize != 0 ? "profiler, edge, existing segment" : "profiler, edge");
+    char name[64];
+    snprintf(name, sizeof(name), "/codecoverage-harness-%d", static_cast<int>(getpid()));
+    shm_unlink(name);
+    if (existingSize != 0)
+    {
+        auto fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+        if (!CHECK(fd >= 0))
+            return;
+        CHECK(ftruncate(fd, existingSize) == 0);
+        close(fd);
+    }
+    ProfilerOptions options = { "edge", nullptr, false, "", name };
+    auto session = RunProfiler(options);
+    CHECK_EQUAL(existingSize != 0 ? existingSize : static_cast<off_t>(EdgeMap::DefaultSize), SegmentSize(name));
+    shm_unlink(name);
+
+    // At least one bump per run, and no more than one per instruction run.
+    FakeModule module;
+    UINT64 runs = 0;
+    UINT64 instructions = 0;
+    for (size_t i = 0; i < session.executed.size(); i++)
+    {
+        runs += module.methods[i].runs.size();
+        for (auto count : session.executed[i])
+            instructions += count;
+    }
+    CHECK(session.edgeBumps >= runs);
+    CHECK(session.edgeBumps <= instructions);
+    CHECK_EQUAL(module.methods.size(), session.report.size());
+}
+
+// The second session finds every body in the cache and never runs the
+// rewriter, which reads the original IL once more.
+static void CheckILCacheSessions()
+{
+    SetCheckContext("profiler, IL cache");
+    auto directory = TemporaryDirectory();
+    ProfilerOptions options = { "counter", nullptr, true, directory + "/il.cache", "" };
+    auto first = RunProfiler(options);
+    auto second = RunProfiler(options);
+    RemoveDirectory(directory);
+
+    FakeModule module;
+    for (size_t i = 0; i < module.methods.size(); i++)
+    {
+        auto name = ReportName(module, i);
+        if (!CHECK(i < first.bodyRequests.size() && i < second.bodyRequests.size()))
+            break;
+        CHECK_EQUAL(1, second.bodyRequests[i]);
+        CHECK(first.bodyRequests[i] > second.bodyRequests[i]);
+        CHECK_EQUAL(module.methods[i].runs.size(), second.report[name].invocations);
+        CHECK(first.blocks[name] == second.blocks[name]);
+    }
+}
+
+void ProfilerChecks()
+{
+    auto directory = TemporaryDirectory();
+    char* previous = getcwd(nullptr, 0);
+    if (chdir(directory.c_str()) != 0)
+    {
+        CHECK(false);
+        return;
+    }
+
+    CheckInvocations("call", nullptr, false);
+    CheckInvocations("counter", nullptr, false);
+    CheckInvocations("counter", nullptr, true);
+    CheckInvocations("bitmap", nullptr, false);
+    CheckInvocations("bitmap", nullptr, true);
+    CheckInvocations("hitonce", nullptr, false);
+    CheckInvocations("sample", "1", false);
+    CheckInvocations("sample", "4", false);
+    CheckInvocations("sample", "4", false, CorProfiler::InlineSamplers + 6);
+    CheckEdgeSession(0);
+    CheckEdgeSession(4096 + 100);
+    CheckILCacheSessions();
+    SetCheckContext("");
+
+    if (chdir(previous) != 0)
+        CHECK(false);
+    free(previous);
+    RemoveDirectory(directory);
+}
+
+// The method lookup before the RID tables: maps from module to type to
+// method, each method a separately allocated record.
+struct MapMethod
+{
+    std::string name;
+    size_t slot;
+};
+
+struct MapType
+{
+    std::map<mdMethodDef, MapMethod*> functions;
+};
+
+struct MapModule
+{
+    std::map<mdTypeDef, MapType*> types;
+};
+
+// Resolving a method at JIT time, and building the tables at module load,
+// for a module of 100k methods in 10k types: ModuleDetails' RID table
+// against the map-of-maps it replaced, which was filled with every method
+// at load. Lookups are in random order, so both pay for cache misses as
+// the runtime's would.
+static void BenchmarkMethodLookup()
+{
+    const ULONG typeCount = 10000;
+    const ULONG methodsPerType = 10;
+    const ULONG methodCount = typeCount * methodsPerType;
+    const int rounds = 20;
+
+    std::vector<std::pair<mdTypeDef, mdMethodDef>> lookups;
+    for (ULONG rid = 1; rid <= methodCount; rid++)
+        lookups.emplace_back(TokenFromRid((rid - 1) / methodsPerType + 1, mdtTypeDef), TokenFromRid(rid, mdtMethodDef));
+    srand(7);
+    for (size_t i = lookups.size() - 1; i > 0; i--)
+        std::swap(lookups[i], lookups[rand() % (i + 1)]);
+
+    ModuleCoverage coverage("Bench.dll", "", 0, 1, 0);
+    std::map<ModuleID, ModuleDetails*> modules;
+    Stopwatch ridBuild;
+    auto module = new ModuleDetails(CoveredModule, "Bench.dll", GUID(), methodCount, typeCount, &coverage);
+    modules[CoveredModule] = module;
+    double ridBuildSeconds = ridBuild.Seconds();
+
+    // The profiler creates these as methods are compiled, not at load.
+    for (const auto& lookup : lookups)
+    {
+        auto rid = RidFromToken(lookup.second);
+        module->methods[rid] = new FunctionDetails(module, lookup.first, lookup.second, module->counterBase + rid);
+    }
+
+    std::map<ModuleID, MapModule*> mapModules;
+    Stopwatch mapBuild;
+    auto mapModule = new MapModule();
+    mapModules[CoveredModule] = mapModule;
+    for (ULONG t = 1; t <= typeCount; t++)
+    {
+        auto type = new MapType();
+        mapModule->types[TokenFromRid(t, mdtTypeDef)] = type;
+        for (ULONG m = 0; m < methodsPerType; m++)
+        {
+            auto token = TokenFromRid((t - 1) * methodsPerType + m + 1, mdtMethodDef);
+            type->functions[token] = new MapMethod{ "Method" + std::to_string(token), RidFromToken(token) };
+        }
+    }
+    double mapBuildSeconds = mapBuild.Seconds();
+
+    size_t ridSum = 0;
+    Stopwatch ridLookup;
+    for (int round = 0; round < rounds; round++)
+    {
+        for (const auto& lookup : lookups)
+        {
+            auto mod = modules.find(CoveredModule);
+            auto func = mod->second->GetMethod(lookup.second);
+            ridSum += func->slot;
+        }
+    }
+    double ridLookupSeconds = ridLookup.Seconds();
+
+    size_t mapSum = 0;
+    Stopwatch mapLookup;
+    for (int round = 0; round < rounds; round++)
+    {
+        for (const auto& lookup : lookups)
+        {
+            auto mod = mapModules.find(CoveredModule);
+            auto type = mod->second->types.find(lookup.first);
+            auto func = type->second->functions.find(lookup.second);
+            mapSum += func->second->slot;
+        }
+    }
+    double mapLookupSeconds = mapLookup.Seconds();
+    KeepAlive(ridSum);
+    KeepAlive(mapSum);
+
+    double lookupCount = static_cast<double>(rounds) * methodCount;
+    printf("method lookup, %u methods: RID table %6.1f ns, map of maps %6.1f ns (slots %s)\n", methodCount,
+        ridLookupSeconds * 1e9 / lookupCount, mapLookupSeconds * 1e9 / lookupCount, ridSum == mapSum ? "agree" : "DIFFER");
+    printf("method tables, %u methods: RID table %6.2f ms, map of maps %6.2f ms at load\n", methodCount,
+        ridBuildSeconds * 1e3, mapBuildSeconds * 1e3);
+
+    delete module;
+    for (const auto& type : mapModule->types)
+    {
+        for (const auto& function : type.second->functions)
+            delete function.second;
+        delete type.second;
+    }
+    delete mapModule;
+}
+
+// CorProfiler::Get as it was: the singleton read under its creation mutex.
+static std::mutex lockedProfilerMutex;
+static CorProfiler* lockedProfiler;
+
+static CorProfiler* LockedGet()
+{
+    std::lock_guard<std::mutex> guard(lockedProfilerMutex);
+    return lockedProfiler;
+}
+
+// Every probe starts with CorProfiler::Get, from whichever managed threads
+// are running. Its acquire load against the mutex it replaced, from 1 to
+// 16 threads at once.
+static void BenchmarkGet()
+{
+    FakeProfilerInfo info;
+    auto profiler = new CorProfiler();
+    profiler->AddRef();
+    {
+        QuietStdout quiet;
+        profiler->Initialize(&info);
+    }
+    lockedProfiler = profiler;
+
+    const int calls = 10000000;
+    for (int threadCount : { 1, 4, 16 })
+    {
+        double seconds[2];
+        for (int locked = 0; locked < 2; locked++)
+        {
+            Stopwatch stopwatch;
+            std::vector<std::thread> threads;
+            for (int t = 0; t < threadCount; t++)
+            {
+                threads.emplace_back([locked]
+                {
+                    for (int i = 0; i < calls; i++)
+                        KeepAlive(locked ? LockedGet() : CorProfiler::Get());
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            seconds[locked] = stopwatch.Seconds();
+        }
+        printf("CorProfiler::Get, %2d threads  %8.1f M calls/s, under a mutex %6.1f M calls/s\n", threadCount,
+            threadCount * (calls / 1e6) / seconds[0], threadCount * (calls / 1e6) / seconds[1]);
+    }
+
+    {
+        QuietStdout quiet;
+        profiler->Shutdown();
+    }
+    profiler->Release();
+}
+
+// What one probed call costs in each mode that records invocations: the
+// inline counter's load, add and store against the native probes, called
+// through the same pointers the IL's calli uses. Only the probe itself is
+// timed; in a runtime each calli also pays the JIT's managed-to-native
+// transition.
+static void BenchmarkProbes()
+{
+    FakeProfilerInfo info;
+    auto profiler = new CorProfiler();
+    profiler->AddRef();
+    {
+        QuietStdout quiet;
+        profiler->Initialize(&info);
+    }
+
+    ModuleCoverage sampled("Bench.dll", "", 0, 100, 0);
+    ModuleCoverage overflow("Overflow.dll", "", 0, 100, CorProfiler::InlineSamplers + 100);
+    ModuleDetails sampledModule(CoveredModule, "Bench.dll", GUID(), 1, 1, &sampled);
+    ModuleDetails overflowModule(OtherModule, "Overflow.dll", GUID(), 1, 1, &overflow);
+    FunctionDetails sampledFunction(&sampledModule, TokenFromRid(1, mdtTypeDef), TokenFromRid(1, mdtMethodDef), 1);
+    FunctionDetails overflowFunction(&overflowModule, TokenFromRid(1, mdtTypeDef), TokenFromRid(1, mdtMethodDef), 2);
+
+    const int calls = 100000000;
+    // The inline counter is Interlocked.Increment, which the JIT expands to
+    // a locked add.
+    INT64 counter = 0;
+    Stopwatch inlineStopwatch;
+    for (int i = 0; i < calls; i++)
+        __sync_add_and_fetch(&counter, 1);
+    KeepAlive(counter);
+    printf("probe, %-29s %6.2f ns/call\n", "inline counter", inlineStopwatch.Seconds() * 1e9 / calls);
+
+    struct Probe
+    {
+        const char* name;
+        void(STDMETHODCALLTYPE* address)(UINT_PTR);
+        FunctionDetails* function;
+    };
+    const Probe probes[] =
+    {
+        { "SampleEnter, 1 in 100", SampleEnterMethodAddress, &sampledFunction },
+        { "SampleEnter, table countdown", SampleEnterMethodAddress, &overflowFunction },
+        { "Enter", EnterMethodAddress, &sampledFunction },
+    };
+    for (const auto& probe : probes)
+    {
+        Stopwatch stopwatch;
+        for (int i = 0; i < calls; i++)
+            probe.address(reinterpret_cast<UINT_PTR>(probe.function));
+        printf("probe, %-29s %6.2f ns/call\n", probe.name, stopwatch.Seconds() * 1e9 / calls);
+    }
+
+    {
+        QuietStdout quiet;
+        profiler->Shutdown();
+    }
+    profiler->Release();
+}
+
+void ProfilerBenchmarks()
+{
+    auto directory = TemporaryDirectory();
+    char* previous = getcwd(nullptr, 0);
+    if (chdir(directory.c_str()) != 0)
+        return;
+
+    BenchmarkMethodLookup();
+    BenchmarkGet();
+    BenchmarkProbes();
+
+    // JITCompilationStarted latency per mode over a module of many methods,
+    // the IL read, the rewrite and the new body set included.
+    const size_t methodCount = 2000;
+    const size_t methodsPerType = 20;
+    auto methods = SyntheticMethods();
+    for (const char* mode : { "call", "counter", "bitmap", "edge" })
+    {
+        SetEnvironment("CODE_COVERAGE_MODE", mode);
+        SetEnvironment("CODE_COVERAGE_FILTER", "+[Bench.dll]");
+        FakeProfilerInfo info;
+        FakeMetaData metadata;
+        mdTypeDef type = mdTypeDefNil;
+        std::vector<FunctionID> functions;
+        info.AddModule(CoveredModule, "/app/Bench.dll", &metadata);
+        for (size_t i = 0; i < methodCount; i++)
+        {
+            if (i % methodsPerType == 0)
+                type = metadata.AddType("Bench.Type" + std::to_string(i / methodsPerType));
+            auto token = metadata.AddMethod(type, "Method" + std::to_string(i));
+            info.SetOriginalBody(CoveredModule, token, methods[i % methods.size()].body);
+            functions.push_back(info.AddFunction(CoveredModule, token));
+        }
+
+        auto profiler = new CorProfiler();
+        profiler->AddRef();
+        std::vector<double> latencies;
+        {
+            QuietStdout quiet;
+            profiler->Initialize(&info);
+            profiler->ModuleLoadFinished(CoveredModule, S_OK);
+            for (auto function : functions)
+            {
+                Stopwatch stopwatch;
+                profiler->JITCompilationStarted(function, TRUE);
+                latencies.push_back(stopwatch.Seconds());
+            }
+            profiler->Shutdown();
+        }
+        profiler->Release();
+
+        double total = 0;
+        for (auto latency : latencies)
+            total += latency;
+        std::sort(latencies.begin(), latencies.end());
+        printf("JITCompilationStarted, %-8s mean %6.2f us  p99 %6.2f us\n", mode,
+            total * 1e6 / latencies.size(), latencies[latencies.size() * 99 / 100] * 1e6);
+    }
+    SetEnvironment("CODE_COVERAGE_MODE", nullptr);
+    SetEnvironment("CODE_COVERAGE_FILTER", nullptr);
+
+    if (chdir(previous) == 0)
+        free(previous);
+    RemoveDirectory(directory);
+}
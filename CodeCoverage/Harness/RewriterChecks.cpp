@@ -0,0 +1,512 @@
+#include <functional>
+#include <thread>
+#include "corprof.h"
+#include "EdgeMap.h"
+#include "FakeProfilerInfo.h"
+#include "ILBuilder.h"
+#include "Harness.h"
+#include "ILCache.h"
+#include "ILInterpreter.h"
+#include "ILRewriter.h"
+#include "SyntheticMethods.h"
+
+// Rewrites every synthetic method in every probe mode, runs the original
+// and the rewritten body on the same arguments, and checks that results
+// agree and that the probes counted what the original executed.
+
+static const ModuleID TestModule = 0x100;
+static const mdSignature ProbeSignature = TokenFromRid(0x42, mdtSignature);
+static const mdMemberRef IncrementRef = TokenFromRid(0x17, mdtMemberRef);
+static const mdFieldDef PreviousLocation = TokenFromRid(0x5, mdtFieldDef);
+
+struct CallCounts
+{
+    UINT64 enters;
+    UINT64 leaves;
+};
+
+static void STDMETHODCALLTYPE CountEnter(UINT_PTR context)
+{
+    reinterpret_cast<CallCounts*>(context)->enters++;
+}
+
+static void STDMETHODCALLTYPE CountLeave(UINT_PTR context)
+{
+    reinterpret_cast<CallCounts*>(context)->leaves++;
+}
+
+// Keeps the blocks the rewriter found, with storage for their probes.
+class RecordingBlockStorage : public BlockStorage
+{
+public:
+    explicit RecordingBlockStorage(ProbeKind kind) : kind(kind) {}
+
+    UINT_PTR Allocate(const std::vector<ILBlock>& blocks) override
+    {
+        this->blocks = blocks;
+        if (this->kind == ProbeKind::Flag)
+        {
+            this->flags.assign(blocks.size(), 0);
+            return reinterpret_cast<UINT_PTR>(this->flags.data());
+        }
+
+        this->counters.assign(blocks.size(), 0);
+        return reinterpret_cast<UINT_PTR>(this->counters.data());
+    }
+
+    ProbeKind kind;
+    std::vector<ILBlock> blocks;
+    std::vector<UINT64> counters;
+    std::vector<BYTE> flags;
+};
+
+// Runs a body on each of the method's argument lists.
+static bool RunAll(ILInterpreter& interpreter, const SyntheticMethod& method, const std::vector<BYTE>& body, std::vector<INT64>& results)
+{
+    ILMethod parsed;
+    if (!CHECK(parsed.Parse(body.data(), body.size())))
+        return false;
+
+    results.clear();
+    for (const auto& args : method.runs)
+    {
+        INT64 result;
+        if (!interpreter.Run(parsed, args, result))
+            return Check(false, interpreter.Error().c_str(), __FILE__, __LINE__);
+        results.push_back(result);
+    }
+    return true;
+}
+
+struct ReferenceInstruction
+{
+    unsigned opcode;
+    INT64 operand;
+    std::vector<size_t> targets;
+};
+
+static unsigned EncodedSize(const ReferenceInstruction& instruction)
+{
+    unsigned size = (instruction.opcode >= 0x100 ? 2 : 1) + OperandSize(instruction.opcode);
+    if (instruction.opcode == CEE_SWITCH)
+        size += static_cast<unsigned>(instruction.targets.size()) * sizeof(INT32);
+    return size;
+}
+
+// The encoder Export used before Relax: lay the code out with the current
+// branch forms, widen every short branch whose delta overflowed, and start
+// again until none did.
+static std::vector<BYTE> EncodeWithRestarts(std::vector<ReferenceInstruction> code)
+{
+    std::vector<unsigned> offsets(code.size() + 1);
+    for (;;)
+    {
+        unsigned offset = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            offsets[i] = offset;
+            offset += EncodedSize(code[i]);
+        }
+        offsets[code.size()] = offset;
+
+        bool tryAgain = false;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            auto& instruction = code[i];
+            if (!IsShortBranch(instruction.opcode))
+                continue;
+
+            int delta = offsets[instruction.targets[0]] - offsets[i + 1];
+            if (static_cast<INT8>(delta) == delta)
+                continue;
+
+            instruction.opcode = instruction.opcode == CEE_LEAVE_S ? CEE_LEAVE : instruction.opcode - CEE_BR_S + CEE_BR;
+            tryAgain = true;
+        }
+        if (!tryAgain)
+            break;
+    }
+
+    std::vector<BYTE> bytes;
+    auto put = [&bytes](INT64 value, unsigned size)
+    {
+        for (unsigned k = 0; k < size; k++)
+            bytes.push_back(static_cast<BYTE>(value >> (8 * k)));
+    };
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        const auto& instruction = code[i];
+        if (instruction.opcode >= 0x100)
+            bytes.push_back(CEE_PREFIX1);
+        bytes.push_back(static_cast<BYTE>(instruction.opcode & 0xFF));
+
+        if (instruction.opcode == CEE_SWITCH)
+        {
+            put(static_cast<INT64>(instruction.targets.size()), sizeof(INT32));
+            for (auto target : instruction.targets)
+                put(static_cast<INT64>(offsets[target]) - offsets[i + 1], sizeof(INT32));
+        }
+        else if (IsBranch(instruction.opcode))
+        {
+            put(static_cast<INT64>(offsets[instruction.targets[0]]) - offsets[i + 1], OperandSize(instruction.opcode));
+        }
+        else
+        {
+            put(instruction.operand, OperandSize(instruction.opcode));
+        }
+    }
+    return bytes;
+}
+
+// For a method that only has short branches, as the rewriter's own
+// branches are, the relaxed body must be what the restarting encoder
+// produces from the same instructions with every branch short again.
+static void CheckEncoding(const std::vector<BYTE>& original, const std::vector<BYTE>& body)
+{
+    ILMethod source, rewritten;
+    std::vector<ILInstruction> sourceCode, instructions;
+    std::string error;
+    if (!source.Parse(original.data(), original.size()) || !DecodeIL(source, sourceCode, error))
+        return;
+    for (const auto& instruction : sourceCode)
+    {
+        if (IsBranch(instruction.opcode) && !IsShortBranch(instruction.opcode))
+            return;
+    }
+
+    if (!CHECK(rewritten.Parse(body.data(), body.size())) || !Check(DecodeIL(rewritten, instructions, error), error.c_str(), __FILE__, __LINE__))
+        return;
+
+    std::vector<size_t> indexes(rewritten.code.size() + 1, 0);
+    for (size_t i = 0; i < instructions.size(); i++)
+        indexes[instructions[i].offset] = i;
+    indexes[rewritten.code.size()] = instructions.size();
+
+    std::vector<ReferenceInstruction> code;
+    for (const auto& instruction : instructions)
+    {
+        ReferenceInstruction reference = { instruction.opcode, instruction.operand, {} };
+        for (auto target : instruction.targets)
+            reference.targets.push_back(indexes[target]);
+        if (IsBranch(reference.opcode) && !IsShortBranch(reference.opcode))
+            reference.opcode = reference.opcode == CEE_LEAVE ? CEE_LEAVE_S : reference.opcode - CEE_BR + CEE_BR_S;
+        code.push_back(reference);
+    }
+    CHECK(EncodeWithRestarts(code) == rewritten.code);
+}
+
+static void CheckMethod(const SyntheticMethod& method, mdMethodDef token)
+{
+    SetCheckContext(method.name);
+    if (!CHECK(!method.body.empty()))
+        return;
+
+    ILInterpreter original(ProbeSignature, IncrementRef, PreviousLocation);
+    std::vector<INT64> expected;
+    if (!RunAll(original, method, method.body, expected))
+        return;
+    const auto& executed = original.Executed();
+    UINT64 runs = method.runs.size();
+
+    FakeProfilerInfo info;
+
+    // Rewrites the original body one way, and runs the result.
+    auto rewrite = [&](const char* mode, std::function<HRESULT()> apply) -> bool
+    {
+        SetCheckContext(method.name + ", " + mode);
+        info.SetOriginalBody(TestModule, token, method.body);
+        if (!CHECK(SUCCEEDED(apply())) || !CHECK(info.Rewritten(TestModule, token)))
+            return false;
+
+        auto body = info.CurrentBody(TestModule, token);
+        CheckEncoding(method.body, body);
+
+        ILInterpreter rewritten(ProbeSignature, IncrementRef, PreviousLocation);
+        std::vector<INT64> results;
+        if (!RunAll(rewritten, method, body, results))
+            return false;
+        return CHECK(results == expected);
+    };
+
+    CallCounts calls = { 0, 0 };
+    if (rewrite("call", [&] { return RewriteIL(&info, nullptr, TestModule, token, reinterpret_cast<FunctionID>(&calls),
+        reinterpret_cast<UINT_PTR>(&CountEnter), reinterpret_cast<UINT_PTR>(&CountLeave), ProbeSignature); }))
+    {
+        CHECK_EQUAL(runs, calls.enters);
+        CHECK_EQUAL(runs, calls.leaves);
+    }
+
+    UINT64 counter = 0;
+    if (rewrite("counter", [&] { return RewriteILWithCounter(&info, nullptr, TestModule, token, reinterpret_cast<UINT_PTR>(&counter), IncrementRef); }))
+        CHECK_EQUAL(runs, counter);
+
+    BYTE flag = 0;
+    if (rewrite("flag", [&] { return RewriteILWithFlag(&info, nullptr, TestModule, token, reinterpret_cast<UINT_PTR>(&flag)); }))
+        CHECK_EQUAL(1, flag);
+
+    // The blocks partition the code, and each block probe counts what the
+    // block's first instruction did in the original.
+    RecordingBlockStorage blockCounters(ProbeKind::Counter);
+    UINT64 methodCounter = 0;
+    if (rewrite("block counters", [&] { return RewriteILWithBlockProbes(&info, nullptr, TestModule, token, ProbeKind::Counter,
+        reinterpret_cast<UINT_PTR>(&methodCounter), IncrementRef, &blockCounters); }))
+    {
+        CHECK_EQUAL(runs, methodCounter);
+        const auto& blocks = blockCounters.blocks;
+        if (CHECK(!blocks.empty()))
+        {
+            CHECK_EQUAL(0, blocks.front().start);
+            for (size_t i = 0; i + 1 < blocks.size(); i++)
+                CHECK_EQUAL(blocks[i].end, blocks[i + 1].start);
+            for (size_t i = 0; i < blocks.size(); i++)
+                CHECK_EQUAL(executed[blocks[i].start], blockCounters.counters[i]);
+        }
+    }
+
+    RecordingBlockStorage blockFlags(ProbeKind::Flag);
+    BYTE methodFlag = 0;
+    if (rewrite("block flags", [&] { return RewriteILWithBlockProbes(&info, nullptr, TestModule, token, ProbeKind::Flag,
+        reinterpret_cast<UINT_PTR>(&methodFlag), mdMemberRefNil, &blockFlags); }))
+    {
+        CHECK_EQUAL(1, methodFlag);
+        for (size_t i = 0; i < blockFlags.blocks.size(); i++)
+            CHECK_EQUAL(executed[blockFlags.blocks[i].start] > 0 ? 1 : 0, blockFlags.flags[i]);
+    }
+
+    // Every block execution bumps one byte of the map, so with few enough
+    // executions not to wrap, the bytes add up to the block executions.
+    std::vector<BYTE> map(EdgeMap::DefaultSize, 0);
+    if (rewrite("edge", [&] { return RewriteILWithEdgeProbes(&info, nullptr, TestModule, token, reinterpret_cast<UINT_PTR>(map.data()),
+        PreviousLocation, EdgeMap::DefaultSize, token); }))
+    {
+        UINT64 blockExecutions = 0;
+        for (const auto& block : blockCounters.blocks)
+            blockExecutions += executed[block.start];
+        UINT64 bumps = 0;
+        for (auto hits : map)
+            bumps += hits;
+        CHECK_EQUAL(blockExecutions, bumps);
+    }
+
+    // ReJIT bodies go to the function control, not to the method.
+    SetCheckContext(method.name + ", rejit");
+    info.SetOriginalBody(TestModule, token, method.body);
+    FakeFunctionControl control;
+    UINT64 rejitCounter = 0;
+    if (CHECK(SUCCEEDED(RewriteILWithCounter(&info, &control, TestModule, token, reinterpret_cast<UINT_PTR>(&rejitCounter), IncrementRef))))
+    {
+        CHECK(!info.Rewritten(TestModule, token));
+        ILInterpreter rewritten(ProbeSignature, IncrementRef, PreviousLocation);
+        std::vector<INT64> results;
+        if (RunAll(rewritten, method, control.Body(), results))
+        {
+            CHECK(results == expected);
+            CHECK_EQUAL(runs, rejitCounter);
+        }
+    }
+}
+
+// Cached bodies survive a save and reload, and patched with new addresses
+// match what the rewriter produces for those addresses.
+static void CheckILCache(const SyntheticMethod& method, mdMethodDef token)
+{
+    SetCheckContext(method.name + ", IL cache");
+    auto directory = TemporaryDirectory();
+    auto path = directory + "/il.cache";
+
+    FakeProfilerInfo info;
+    UINT64 counters[2] = { 0, 0 };
+    ILCapture capture;
+    info.SetOriginalBody(TestModule, token, method.body);
+    if (!CHECK(SUCCEEDED(RewriteILWithCounter(&info, nullptr, TestModule, token, reinterpret_cast<UINT_PTR>(&counters[0]), IncrementRef, &capture))))
+        return;
+    CHECK(capture.body == info.CurrentBody(TestModule, token));
+    CHECK(!capture.relocations.empty());
+
+    std::vector<ILBlock> blocks = { { 0, 2 }, { 2, static_cast<ULONG32>(method.body.size()) } };
+    ILCacheKey key = { {}, token, 1, ILCache::Hash(method.body.data(), method.body.size()) };
+    key.mvid.Data1 = 0x12345678;
+    ILCacheEntry entry;
+    {
+        ILCache cache;
+        cache.Open(path);
+        CHECK(cache.IsOpen());
+        CHECK(!cache.Find(key, entry));
+        cache.Store(key, capture, blocks);
+        if (CHECK(cache.Find(key, entry)))
+        {
+            CHECK(std::vector<BYTE>(entry.body, entry.body + entry.bodySize) == capture.body);
+            cache.Release();
+        }
+        cache.Save();
+        CHECK(!cache.Find(key, entry));
+    }
+
+    ILCache cache;
+    cache.Open(path);
+    auto otherIL = key;
+    otherIL.ilHash++;
+    CHECK(!cache.Find(otherIL, entry));
+    auto otherMode = key;
+    otherMode.mode++;
+    CHECK(!cache.Find(otherMode, entry));
+    if (CHECK(cache.Find(key, entry)))
+    {
+        CHECK(std::vector<BYTE>(entry.body, entry.body + entry.bodySize) == capture.body);
+        CHECK_EQUAL(capture.relocations.size(), entry.relocationCount);
+        if (CHECK_EQUAL(blocks.size(), entry.blockCount))
+            CHECK_EQUAL(blocks[1].end, entry.blocks[1].end);
+
+        UINT64 params[ILParamCount] = {};
+        params[ILParamMethodProbe] = reinterpret_cast<UINT_PTR>(&counters[1]);
+        params[ILParamIncrement] = IncrementRef;
+        info.SetOriginalBody(TestModule, token, method.body);
+        CHECK(SUCCEEDED(SetRelocatedILBody(&info, TestModule, token, entry.body, entry.bodySize, entry.relocations, entry.relocationCount, params)));
+        cache.Release();
+        auto relocated = info.CurrentBody(TestModule, token);
+
+        info.SetOriginalBody(TestModule, token, method.body);
+        CHECK(SUCCEEDED(RewriteILWithCounter(&info, nullptr, TestModule, token, reinterpret_cast<UINT_PTR>(&counters[1]), IncrementRef)));
+        CHECK(relocated == info.CurrentBody(TestModule, token));
+
+        ILInterpreter interpreter(ProbeSignature, IncrementRef, PreviousLocation);
+        std::vector<INT64> results;
+        if (RunAll(interpreter, method, relocated, results))
+        {
+            CHECK_EQUAL(0, counters[0]);
+            CHECK_EQUAL(method.runs.size(), counters[1]);
+        }
+    }
+    cache.Save();
+    RemoveDirectory(directory);
+}
+
+// Counter probes running on many threads at once, all on one slot, lose
+// no counts.
+static void CheckConcurrentCounter(const SyntheticMethod& method, mdMethodDef token)
+{
+    SetCheckContext(method.name + ", concurrent counter");
+    FakeProfilerInfo info;
+    info.SetOriginalBody(TestModule, token, method.body);
+    UINT64 counter = 0;
+    if (!CHECK(SUCCEEDED(RewriteILWithCounter(&info, nullptr, TestModule, token, reinterpret_cast<UINT_PTR>(&counter), IncrementRef))))
+        return;
+
+    auto body = info.CurrentBody(TestModule, token);
+    ILMethod parsed;
+    if (!CHECK(parsed.Parse(body.data(), body.size())))
+        return;
+
+    const int threadCount = 8;
+    const int rounds = 2000;
+    std::vector<int> failures(threadCount, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&, t]
+        {
+            ILInterpreter interpreter(ProbeSignature, IncrementRef, PreviousLocation);
+            for (int round = 0; round < rounds; round++)
+            {
+                for (const auto& args : method.runs)
+                {
+                    INT64 result;
+                    if (!interpreter.Run(parsed, args, result))
+                        failures[t]++;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    for (auto failed : failures)
+        CHECK_EQUAL(0, failed);
+    CHECK_EQUAL(static_cast<UINT64>(threadCount) * rounds * method.runs.size(), counter);
+}
+
+void RewriterChecks()
+{
+    auto methods = SyntheticMethods();
+    for (size_t i = 0; i < methods.size(); i++)
+        CheckMethod(methods[i], TokenFromRid(static_cast<ULONG>(i + 1), mdtMethodDef));
+
+    CheckILCache(methods[2], TokenFromRid(3, mdtMethodDef));
+    CheckConcurrentCounter(methods[0], TokenFromRid(1, mdtMethodDef));
+    SetCheckContext("");
+}
+
+// Rewrites per second of each mode, over the given methods. The bodies go
+// through the ReJIT path, so the fake keeps no copies and only the
+// rewriter is timed.
+static void BenchmarkRewrites(const char* label, const std::vector<SyntheticMethod>& methods, int iterations)
+{
+    FakeProfilerInfo info;
+    for (size_t i = 0; i < methods.size(); i++)
+        info.SetOriginalBody(TestModule, TokenFromRid(static_cast<ULONG>(i + 1), mdtMethodDef), methods[i].body);
+
+    CallCounts calls = { 0, 0 };
+    UINT64 counter = 0;
+    RecordingBlockStorage storage(ProbeKind::Counter);
+    std::vector<BYTE> map(EdgeMap::DefaultSize, 0);
+
+    struct Mode
+    {
+        const char* name;
+        std::function<HRESULT(ICorProfilerFunctionControl*, mdMethodDef)> rewrite;
+    };
+    Mode modes[] =
+    {
+        { "call", [&](ICorProfilerFunctionControl* control, mdMethodDef token) { return RewriteIL(&info, control, TestModule, token,
+            reinterpret_cast<FunctionID>(&calls), reinterpret_cast<UINT_PTR>(&CountEnter), reinterpret_cast<UINT_PTR>(&CountLeave), ProbeSignature); } },
+        { "counter", [&](ICorProfilerFunctionControl* control, mdMethodDef token) { return RewriteILWithCounter(&info, control, TestModule, token,
+            reinterpret_cast<UINT_PTR>(&counter), IncrementRef); } },
+        { "block counters", [&](ICorProfilerFunctionControl* control, mdMethodDef token) { return RewriteILWithBlockProbes(&info, control, TestModule, token,
+            ProbeKind::Counter, reinterpret_cast<UINT_PTR>(&counter), IncrementRef, &storage); } },
+        { "edge", [&](ICorProfilerFunctionControl* control, mdMethodDef token) { return RewriteILWithEdgeProbes(&info, control, TestModule, token,
+            reinterpret_cast<UINT_PTR>(map.data()), PreviousLocation, EdgeMap::DefaultSize, token); } },
+    };
+
+    for (const auto& mode : modes)
+    {
+        FakeFunctionControl control;
+        Stopwatch stopwatch;
+        for (int n = 0; n < iterations; n++)
+        {
+            for (size_t i = 0; i < methods.size(); i++)
+                mode.rewrite(&control, TokenFromRid(static_cast<ULONG>(i + 1), mdtMethodDef));
+        }
+        auto seconds = stopwatch.Seconds();
+        auto rewrites = static_cast<double>(iterations) * methods.size();
+        printf("rewrite %s, %-15s %8.0f methods/s  %6.2f us/method\n", label, mode.name, rewrites / seconds, seconds * 1e6 / rewrites);
+        KeepAlive(control.Body());
+    }
+}
+
+void RewriterBenchmarks()
+{
+#ifdef ILREWRITER_HEAP_SCRATCH
+    printf("rewriter scratch from the heap\n");
+#else
+    printf("rewriter scratch from the arena\n");
+#endif
+    BenchmarkRewrites("synthetic", SyntheticMethods(), 20000);
+    BenchmarkRewrites("large", LargeMethods(), 200);
+}
+
+// Near-limit methods only; this is where Relax needs more than one round.
+void RelaxChecks()
+{
+    auto methods = NearLimitMethods();
+    for (size_t i = 0; i < methods.size(); i++)
+    {
+        if (CHECK(!methods[i].body.empty()))
+            CheckMethod(methods[i], TokenFromRid(static_cast<ULONG>(i + 1), mdtMethodDef));
+    }
+    SetCheckContext("");
+}
+
+void RelaxBenchmarks()
+{
+    BenchmarkRewrites("near-limit", NearLimitMethods(), 2000);
+}
@@ -0,0 +1,373 @@
+#include "ILBuilder.h"
+#include "SyntheticMethods.h"
+
+static const mdSignature LocalsSignature = TokenFromRid(0x10, mdtSignature);
+
+// return arg + 3
+static SyntheticMethod Straight()
+{
+    ILBuilder il;
+    il.Emit(CEE_LDARG_0);
+    il.Emit(CEE_LDC_I4_3);
+    il.Emit(CEE_ADD);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "Straight", il.Build(), { { 0 }, { 7 }, { -2 } } };
+}
+
+static SyntheticMethod Empty()
+{
+    ILBuilder il;
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "Empty", il.Build(), { { 0 } } };
+}
+
+// sum = 0; for (i = 0; i < arg; i++) sum += i; return sum
+static SyntheticMethod Loop()
+{
+    ILBuilder il;
+    auto body = il.NewLabel();
+    auto condition = il.NewLabel();
+    il.SetLocals(LocalsSignature);
+    il.SetMaxStack(2);
+    il.Emit(CEE_LDC_I4_0);
+    il.Emit(CEE_STLOC_0);
+    il.Emit(CEE_LDC_I4_0);
+    il.Emit(CEE_STLOC_1);
+    il.Branch(CEE_BR_S, condition);
+    il.Mark(body);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_LDLOC_1);
+    il.Emit(CEE_ADD);
+    il.Emit(CEE_STLOC_0);
+    il.Emit(CEE_LDLOC_1);
+    il.Emit(CEE_LDC_I4_1);
+    il.Emit(CEE_ADD);
+    il.Emit(CEE_STLOC_1);
+    il.Mark(condition);
+    il.Emit(CEE_LDLOC_1);
+    il.Emit(CEE_LDARG_0);
+    il.Branch(CEE_BLT_S, body);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "Loop", il.Build(), { { 0 }, { 1 }, { 5 }, { 20 } } };
+}
+
+// if (arg == 0) return 10; if (arg == 1) return 20; return arg * 2
+static SyntheticMethod MultiRet()
+{
+    ILBuilder il;
+    auto notZero = il.NewLabel();
+    auto notOne = il.NewLabel();
+    il.Emit(CEE_LDARG_0);
+    il.Branch(CEE_BRTRUE_S, notZero);
+    il.Emit(CEE_LDC_I4_S, 10);
+    il.Emit(CEE_RET);
+    il.Mark(notZero);
+    il.Emit(CEE_LDARG_0);
+    il.Emit(CEE_LDC_I4_1);
+    il.Branch(CEE_BNE_UN_S, notOne);
+    il.Emit(CEE_LDC_I4_S, 20);
+    il.Emit(CEE_RET);
+    il.Mark(notOne);
+    il.Emit(CEE_LDARG_0);
+    il.Emit(CEE_LDC_I4_2);
+    il.Emit(CEE_MUL);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "MultiRet", il.Build(), { { 0 }, { 1 }, { 2 }, { 3 } } };
+}
+
+// switch (arg) { case 0: return 5; case 1: case 2: return 6; } return 7
+static SyntheticMethod Switch()
+{
+    ILBuilder il;
+    auto zero = il.NewLabel();
+    auto oneOrTwo = il.NewLabel();
+    auto done = il.NewLabel();
+    il.SetLocals(LocalsSignature);
+    il.Emit(CEE_LDARG_0);
+    il.Switch({ zero, oneOrTwo, oneOrTwo });
+    il.Emit(CEE_LDC_I4_7);
+    il.Emit(CEE_STLOC_0);
+    il.Branch(CEE_BR_S, done);
+    il.Mark(zero);
+    il.Emit(CEE_LDC_I4_5);
+    il.Emit(CEE_STLOC_0);
+    il.Branch(CEE_BR_S, done);
+    il.Mark(oneOrTwo);
+    il.Emit(CEE_LDC_I4_6);
+    il.Emit(CEE_STLOC_0);
+    il.Mark(done);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "Switch", il.Build(), { { 0 }, { 1 }, { 2 }, { 3 }, { -1 } } };
+}
+
+// x = arg; try { if (arg > 2) x = 1; } finally { x = x * 10; } return x
+static SyntheticMethod TryFinally()
+{
+    ILBuilder il;
+    auto tryBegin = il.NewLabel();
+    auto skip = il.NewLabel();
+    auto handlerBegin = il.NewLabel();
+    auto handlerEnd = il.NewLabel();
+    il.SetLocals(LocalsSignature);
+    il.SetMaxStack(2);
+    il.Emit(CEE_LDARG_0);
+    il.Emit(CEE_STLOC_0);
+    il.Mark(tryBegin);
+    il.Emit(CEE_LDARG_0);
+    il.Emit(CEE_LDC_I4_3);
+    il.Branch(CEE_BLT_S, skip);
+    il.Emit(CEE_LDC_I4_1);
+    il.Emit(CEE_STLOC_0);
+    il.Mark(skip);
+    il.Branch(CEE_LEAVE_S, handlerEnd);
+    il.Mark(handlerBegin);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_LDC_I4_S, 10);
+    il.Emit(CEE_MUL);
+    il.Emit(CEE_STLOC_0);
+    il.Emit(CEE_ENDFINALLY);
+    il.Mark(handlerEnd);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_RET);
+    il.AddClause(COR_ILEXCEPTION_CLAUSE_FINALLY, tryBegin, handlerBegin, handlerBegin, handlerEnd);
+    return SyntheticMethod{ "TryFinally", il.Build(), { { 0 }, { 2 }, { 4 } } };
+}
+
+// A loop whose body is too long for short branches, so it uses the long
+// forms throughout.
+static SyntheticMethod LongLoop()
+{
+    ILBuilder il;
+    auto body = il.NewLabel();
+    auto condition = il.NewLabel();
+    il.SetLocals(LocalsSignature);
+    il.SetMaxStack(2);
+    il.Emit(CEE_LDC_I4_0);
+    il.Emit(CEE_STLOC_0);
+    il.Emit(CEE_LDC_I4_0);
+    il.Emit(CEE_STLOC_1);
+    il.Branch(CEE_BR, condition);
+    il.Mark(body);
+    for (int i = 0; i < 40; i++)
+    {
+        il.Emit(CEE_LDLOC_0);
+        il.Emit(CEE_LDC_I4_1);
+        il.Emit(CEE_ADD);
+        il.Emit(CEE_STLOC_0);
+    }
+    il.Emit(CEE_LDLOC_1);
+    il.Emit(CEE_LDC_I4_1);
+    il.Emit(CEE_ADD);
+    il.Emit(CEE_STLOC_1);
+    il.Mark(condition);
+    il.Emit(CEE_LDLOC_1);
+    il.Emit(CEE_LDARG_0);
+    il.Branch(CEE_BLT, body);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "LongLoop", il.Build(), { { 0 }, { 3 }, { 6 } } };
+}
+
+// x = 0;
+// if (arg == 0) goto t1; x = x + 1; ... (6 times)
+// t1: if (arg == 1) goto t2; x = x + 1; ...
+// ...
+// return x
+SyntheticMethod LargeChain(unsigned cases)
+{
+    ILBuilder il;
+    std::vector<ILBuilder::Label> targets;
+    for (unsigned i = 0; i < cases; i++)
+        targets.push_back(il.NewLabel());
+
+    il.SetLocals(LocalsSignature);
+    il.SetMaxStack(2);
+    il.Emit(CEE_LDC_I4_0);
+    il.Emit(CEE_STLOC_0);
+    for (unsigned i = 0; i < cases; i++)
+    {
+        il.Emit(CEE_LDARG_0);
+        il.Emit(CEE_LDC_I4, i);
+        il.Branch(CEE_BEQ, targets[i]);
+        for (int k = 0; k < 6; k++)
+        {
+            il.Emit(CEE_LDLOC_0);
+            il.Emit(CEE_LDC_I4_1);
+            il.Emit(CEE_ADD);
+            il.Emit(CEE_STLOC_0);
+        }
+        il.Mark(targets[i]);
+    }
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "LargeChain" + std::to_string(cases), il.Build(), { { 0 }, { 7 }, { -1 } } };
+}
+
+// switch (arg) { case 0: x = 0; break; case 1: x = 3; break; ... } return x
+SyntheticMethod LargeSwitch(unsigned cases)
+{
+    ILBuilder il;
+    std::vector<ILBuilder::Label> targets;
+    for (unsigned i = 0; i < cases; i++)
+        targets.push_back(il.NewLabel());
+    auto done = il.NewLabel();
+
+    il.SetLocals(LocalsSignature);
+    il.SetMaxStack(2);
+    il.Emit(CEE_LDC_I4_M1);
+    il.Emit(CEE_STLOC_0);
+    il.Emit(CEE_LDARG_0);
+    il.Switch(targets);
+    il.Branch(CEE_BR, done);
+    for (unsigned i = 0; i < cases; i++)
+    {
+        il.Mark(targets[i]);
+        il.Emit(CEE_LDC_I4, i * 3);
+        il.Emit(CEE_STLOC_0);
+        il.Branch(CEE_BR, done);
+    }
+    il.Mark(done);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "LargeSwitch" + std::to_string(cases), il.Build(), { { 0 }, { 5 }, { -1 } } };
+}
+
+std::vector<SyntheticMethod> LargeMethods()
+{
+    return std::vector<SyntheticMethod>
+    {
+        LargeChain(1000),
+        LargeSwitch(1000),
+    };
+}
+
+// i = arg;
+// top: if (i == 0) goto done; <padding>; i = i - 1; goto top (short)
+// done: return i + 1
+SyntheticMethod NearLimitMethod(unsigned padding)
+{
+    ILBuilder il;
+    auto top = il.NewLabel();
+    auto done = il.NewLabel();
+    il.SetLocals(LocalsSignature);
+    il.SetMaxStack(2);
+    il.Emit(CEE_LDARG_0);
+    il.Emit(CEE_STLOC_0);
+    il.Mark(top);
+    il.Emit(CEE_LDLOC_0);
+    il.Branch(CEE_BRFALSE_S, done);
+    for (unsigned i = 0; i < padding; i++)
+        il.Emit(CEE_NOP);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_LDC_I4_1);
+    il.Emit(CEE_SUB);
+    il.Emit(CEE_STLOC_0);
+    il.Branch(CEE_BR_S, top);
+    il.Mark(done);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_LDC_I4_1);
+    il.Emit(CEE_ADD);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "NearLimit" + std::to_string(padding), il.Build(), { { 0 }, { 1 }, { 4 } } };
+}
+
+// x = 1;
+// try { if (arg == 0) leave done; <padding>; x = 2; leave done }
+// finally { }
+// done: return x
+SyntheticMethod NearLimitLeave(unsigned padding)
+{
+    ILBuilder il;
+    auto tryBegin = il.NewLabel();
+    auto skip = il.NewLabel();
+    auto handlerBegin = il.NewLabel();
+    auto done = il.NewLabel();
+    il.SetLocals(LocalsSignature);
+    il.Emit(CEE_LDC_I4_1);
+    il.Emit(CEE_STLOC_0);
+    il.Mark(tryBegin);
+    il.Emit(CEE_LDARG_0);
+    il.Branch(CEE_BRTRUE_S, skip);
+    il.Branch(CEE_LEAVE_S, done);
+    il.Mark(skip);
+    for (unsigned i = 0; i < padding; i++)
+        il.Emit(CEE_NOP);
+    il.Emit(CEE_LDC_I4_2);
+    il.Emit(CEE_STLOC_0);
+    il.Branch(CEE_LEAVE_S, done);
+    il.Mark(handlerBegin);
+    il.Emit(CEE_ENDFINALLY);
+    il.Mark(done);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_RET);
+    il.AddClause(COR_ILEXCEPTION_CLAUSE_FINALLY, tryBegin, handlerBegin, handlerBegin, done);
+    return SyntheticMethod{ "NearLimitLeave" + std::to_string(padding), il.Build(), { { 0 }, { 1 } } };
+}
+
+// x = 0;
+// if (arg == 0) goto t0; x = x + 1; <padding>;
+// if (arg == 1) goto t1; t0: x = x + 1; <padding>;
+// if (arg == 2) goto t2; t1: x = x + 1; <padding>;
+// ...
+// t4: return x
+// Each test reaches over an increment, the padding and the next test.
+SyntheticMethod NearLimitCascade(unsigned padding)
+{
+    const int levels = 5;
+    ILBuilder il;
+    std::vector<ILBuilder::Label> targets;
+    for (int i = 0; i < levels; i++)
+        targets.push_back(il.NewLabel());
+
+    il.SetLocals(LocalsSignature);
+    il.SetMaxStack(2);
+    il.Emit(CEE_LDC_I4_0);
+    il.Emit(CEE_STLOC_0);
+    for (int i = 0; i < levels; i++)
+    {
+        il.Emit(CEE_LDARG_0);
+        il.Emit(CEE_LDC_I4_S, i);
+        il.Branch(CEE_BEQ_S, targets[i]);
+        if (i > 0)
+            il.Mark(targets[i - 1]);
+        il.Emit(CEE_LDLOC_0);
+        il.Emit(CEE_LDC_I4_1);
+        il.Emit(CEE_ADD);
+        il.Emit(CEE_STLOC_0);
+        for (unsigned k = 0; k < padding; k++)
+            il.Emit(CEE_NOP);
+    }
+    il.Mark(targets[levels - 1]);
+    il.Emit(CEE_LDLOC_0);
+    il.Emit(CEE_RET);
+    return SyntheticMethod{ "NearLimitCascade" + std::to_string(padding), il.Build(), { { 0 }, { 2 }, { 4 }, { 7 } } };
+}
+
+std::vector<SyntheticMethod> NearLimitMethods()
+{
+    std::vector<SyntheticMethod> methods;
+    for (unsigned padding = 96; padding <= 119; padding++)
+        methods.push_back(NearLimitMethod(padding));
+    for (unsigned padding = 100; padding <= 122; padding++)
+        methods.push_back(NearLimitLeave(padding));
+    for (unsigned padding = 100; padding <= 118; padding++)
+        methods.push_back(NearLimitCascade(padding));
+    return methods;
+}
+
+std::vector<SyntheticMethod> SyntheticMethods()
+{
+    return std::vector<SyntheticMethod>
+    {
+        Straight(),
+        Empty(),
+        Loop(),
+        MultiRet(),
+        Switch(),
+        TryFinally(),
+        LongLoop(),
+        NearLimitMethod(100),
+    };
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "cor.h"
+
+// A method body as a compiler would emit it, with the arguments to run it
+// on. Each shape exercises a different part of the rewriter: tiny and fat
+// headers, loops, several returns, switch, try/finally, long branches and
+// short branches that only just reach.
+struct SyntheticMethod
+{
+    std::string name;
+    std::vector<BYTE> body;
+    std::vector<std::vector<INT32>> runs;
+};
+
+std::vector<SyntheticMethod> SyntheticMethods();
+
+// Generated code at scale: a chain of cases comparisons, each guarding a
+// few statements, as serializers have, and a switch with cases targets.
+SyntheticMethod LargeChain(unsigned cases);
+SyntheticMethod LargeSwitch(unsigned cases);
+std::vector<SyntheticMethod> LargeMethods();
+
+// A loop whose short forward and backward branches both span padding
+// bytes of nops. At 119 bytes of padding the backward branch is exactly
+// at the -128 limit, so any probe inserted in the loop pushes it out of
+// short range; beyond that the body cannot be built.
+SyntheticMethod NearLimitMethod(unsigned padding);
+
+// A leave.s out of a try block over padding bytes of nops and the finally
+// handler; at 122 bytes it is exactly at the +127 limit.
+SyntheticMethod NearLimitLeave(unsigned padding);
+
+// Overlapping short branches, each spanning padding bytes and the next
+// branch, so that widening one pushes the one before it further. At 118
+// bytes every branch is exactly at the +127 limit.
+SyntheticMethod NearLimitCascade(unsigned padding);
+
+// Every near-limit shape, from comfortably in range to exactly at the
+// limit.
+std::vector<SyntheticMethod> NearLimitMethods();
@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# Builds harness, which runs the profiler against fake CLR interfaces; see
+# Harness.cpp. Needs the same CoreCLR headers as the profiler, and nothing
+# else from the runtime.
+#
+# Also builds harness-heap, the same with the rewriter's scratch taken from
+# the heap rather than its arena; compare their "harness --bench rewriter".
+
+[ -z "${CORECLR_PATH:-}" ] && CORECLR_PATH=~/coreclr
+[ -z "${BuildOS:-}"      ] && BuildOS=Linux
+[ -z "${BuildArch:-}"    ] && BuildArch=x64
+[ -z "${BuildType:-}"    ] && BuildType=Debug
+[ -z "${Output:-}"       ] && Output=harness
+
+printf '  CORECLR_PATH : %s\n' "$CORECLR_PATH"
+printf '  BuildOS      : %s\n' "$BuildOS"
+printf '  BuildArch    : %s\n' "$BuildArch"
+printf '  BuildType    : %s\n' "$BuildType"
+
+printf '  Building %s and %s-heap ... ' "$Output" "$Output"
+
+CXX_FLAGS="$CXX_FLAGS -O2 -pthread -Wno-invalid-noreturn -fms-extensions -DBIT64 -DPAL_STDCPP_COMPAT -DPLATFORM_UNIX -std=c++11"
+INCLUDES="-I .. -I $CORECLR_PATH/src/pal/inc/rt -I $CORECLR_PATH/src/pal/prebuilt/inc -I $CORECLR_PATH/src/pal/inc -I $CORECLR_PATH/src/inc -I $CORECLR_PATH/bin/Product/$BuildOS.$BuildArch.$BuildType/inc"
+
+PROFILER="../ControlFile.cpp ../CorProfiler.cpp ../CounterStore.cpp ../CoverageFilter.cpp ../EdgeMap.cpp ../ILCache.cpp ../ILRewriter.cpp ../MetadataScanner.cpp ../PortablePdb.cpp ../ReJitQueue.cpp ../StringPool.cpp ../Utf8.cpp"
+HARNESS="ComponentChecks.cpp FakeMetaData.cpp FakeProfilerInfo.cpp Harness.cpp ILBuilder.cpp ILInterpreter.cpp ProfilerChecks.cpp RewriterChecks.cpp SyntheticMethods.cpp"
+
+clang++ -o $Output $CXX_FLAGS $INCLUDES $PROFILER $HARNESS -lrt
+clang++ -o $Output-heap -DILREWRITER_HEAP_SCRATCH $CXX_FLAGS $INCLUDES $PROFILER $HARNESS -lrt
@@ -0,0 +1,326 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "ILCache.h"
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File layout, all little-endian and every section 8-byte aligned:
+//   header:  magic, version, entry count, reserved
+//   entry:   key, body size, relocation count, block count, reserved,
+//            then the body, the relocations and the blocks.
+static const ULONG32 Magic = 0x4C494343; // "CCIL"
+
+struct ILCacheFileHeader
+{
+    ULONG32 magic;
+    ULONG32 version;
+    ULONG32 count;
+    ULONG32 reserved;
+};
+
+struct ILCacheEntryHeader
+{
+    ILCacheKey key;
+    ULONG32 bodySize;
+    ULONG32 relocationCount;
+    ULONG32 blockCount;
+    ULONG32 reserved;
+};
+
+static size_t Align(size_t value)
+{
+    return (value + 7) & ~(size_t)7;
+}
+
+bool ILCacheKey::operator< (const ILCacheKey& other) const
+{
+    auto compare = memcmp(&mvid, &other.mvid, sizeof(GUID));
+    if (compare != 0)
+        return compare < 0;
+    if (method != other.method)
+        return method < other.method;
+    if (mode != other.mode)
+        return mode < other.mode;
+    return ilHash < other.ilHash;
+}
+
+bool ILCacheKey::SameMethod(const ILCacheKey& other) const
+{
+    return memcmp(&mvid, &other.mvid, sizeof(GUID)) == 0 && method == other.method && mode == other.mode;
+}
+
+ILCache::ILCache() : closed(false), readers(0), data(nullptr), size(0)
+#ifdef WIN32
+    , file(INVALID_HANDLE_VALUE), mapping(nullptr)
+#endif
+{
+}
+
+ILCache::~ILCache()
+{
+    Unmap();
+}
+
+void ILCache::Open(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    this->path = path;
+    if (Map() && !Parse())
+    {
+        printf("Ignoring invalid IL cache %s\r\n", path.c_str());
+        mapped.clear();
+        Unmap();
+    }
+}
+
+// FNV-1a over the original method body, header and EH sections included.
+UINT64 ILCache::Hash(const BYTE* data, size_t size)
+{
+    UINT64 hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool ILCache::Find(const ILCacheKey& key, ILCacheEntry& entry)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    if (closed)
+        return false;
+
+    auto fresh = captured.find(key);
+    if (fresh != captured.end())
+    {
+        auto& body = fresh->second;
+        entry = { body.body.data(), (ULONG32)body.body.size(), body.relocations.data(), (ULONG32)body.relocations.size(), body.blocks.data(), (ULONG32)body.blocks.size() };
+        readers++;
+        return true;
+    }
+
+    auto cached = mapped.find(key);
+    if (cached == mapped.end())
+        return false;
+
+    entry = cached->second;
+    readers++;
+    return true;
+}
+
+void ILCache::Release()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    if (--readers == 0)
+        released.notify_all();
+}
+
+void ILCache::Store(const ILCacheKey& key, const ILCapture& capture, const std::vector<ILBlock>& blocks)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    // Two threads can rewrite the same method at once; the bodies are
+    // identical, and the first may already have been handed out.
+    if (closed || captured.find(key) != captured.end())
+        return;
+
+    auto& body = captured[key];
+    body.body = capture.body;
+    body.relocations = capture.relocations;
+    body.blocks = blocks;
+}
+
+void ILCache::Save()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // No entry is handed out from here on, and those already out are
+    // finished with before the file is unmapped below.
+    closed = true;
+    released.wait(lock, [this] { return readers == 0; });
+
+    if (path.empty() || captured.empty())
+        return;
+
+    // Bodies from the file survive unless this run produced a body for the
+    // same method and mode, in which case the IL has changed.
+    std::vector<std::pair<const ILCacheKey*, ILCacheEntry>> entries;
+    for (const auto& [key, entry] : mapped)
+    {
+        auto next = captured.lower_bound(key);
+        bool superseded = (next != captured.end() && next->first.SameMethod(key)) ||
+            (next != captured.begin() && std::prev(next)->first.SameMethod(key));
+        if (!superseded)
+            entries.push_back({ &key, entry });
+    }
+    for (const auto& [key, body] : captured)
+    {
+        entries.push_back({ &key, { body.body.data(), (ULONG32)body.body.size(), body.relocations.data(), (ULONG32)body.relocations.size(), body.blocks.data(), (ULONG32)body.blocks.size() } });
+    }
+
+    // Written next to the file and renamed over it, so a process that has
+    // the old file mapped, or starts while this one is writing, never sees
+    // a partial cache.
+#ifdef WIN32
+    auto temporary = path + ".tmp" + std::to_string(GetCurrentProcessId());
+#else
+    auto temporary = path + ".tmp" + std::to_string(getpid());
+#endif
+    std::ofstream output(temporary, std::ios::binary | std::ios::trunc);
+    if (!output)
+        return;
+
+    static const BYTE padding[8] = {};
+    auto write = [&output](const void* p, size_t bytes)
+    {
+        output.write(reinterpret_cast<const char*>(p), bytes);
+        output.write(reinterpret_cast<const char*>(padding), Align(bytes) - bytes);
+    };
+
+    ILCacheFileHeader header = { Magic, Version, (ULONG32)entries.size(), 0 };
+    write(&header, sizeof(header));
+
+    for (const auto& [key, entry] : entries)
+    {
+        ILCacheEntryHeader entryHeader = { *key, entry.bodySize, entry.relocationCount, entry.blockCount, 0 };
+        write(&entryHeader, sizeof(entryHeader));
+        write(entry.body, entry.bodySize);
+        write(entry.relocations, entry.relocationCount * sizeof(ILRelocation));
+        write(entry.blocks, entry.blockCount * sizeof(ILBlock));
+    }
+
+    output.close();
+    if (!output)
+    {
+        std::remove(temporary.c_str());
+        return;
+    }
+
+    // Everything from the old file has been copied out; Windows won't
+    // replace a file that is still mapped.
+    mapped.clear();
+    Unmap();
+
+#ifdef WIN32
+    if (!MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+        std::remove(temporary.c_str());
+#else
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+        std::remove(temporary.c_str());
+#endif
+}
+
+bool ILCache::Map()
+{
+#ifdef WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        return false;
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+        return false;
+
+    data = (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    size = (size_t)fileSize.QuadPart;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+        return false;
+
+    data = (const BYTE*)view;
+    size = (size_t)info.st_size;
+#endif
+    return data != nullptr;
+}
+
+void ILCache::Unmap()
+{
+#ifdef WIN32
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mapping != nullptr)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (data != nullptr)
+        munmap((void*)data, size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+bool ILCache::Parse()
+{
+    if (size < sizeof(ILCacheFileHeader))
+        return false;
+
+    auto header = reinterpret_cast<const ILCacheFileHeader*>(data);
+    if (header->magic != Magic || header->version != Version)
+        return false;
+
+    size_t offset = sizeof(ILCacheFileHeader);
+    for (ULONG32 i = 0; i < header->count; i++)
+    {
+        if (size - offset < sizeof(ILCacheEntryHeader))
+            return false;
+
+        auto entryHeader = reinterpret_cast<const ILCacheEntryHeader*>(data + offset);
+        offset += sizeof(ILCacheEntryHeader);
+
+        size_t bodyBytes = Align(entryHeader->bodySize);
+        size_t relocationBytes = Align((size_t)entryHeader->relocationCount * sizeof(ILRelocation));
+        size_t blockBytes = Align((size_t)entryHeader->blockCount * sizeof(ILBlock));
+        if (size - offset < bodyBytes + relocationBytes + blockBytes)
+            return false;
+
+        ILCacheEntry entry;
+        entry.body = data + offset;
+        entry.bodySize = entryHeader->bodySize;
+        entry.relocations = reinterpret_cast<const ILRelocation*>(data + offset + bodyBytes);
+        entry.relocationCount = entryHeader->relocationCount;
+        entry.blocks = reinterpret_cast<const ILBlock*>(data + offset + bodyBytes + relocationBytes);
+        entry.blockCount = entryHeader->blockCount;
+        offset += bodyBytes + relocationBytes + blockBytes;
+
+        for (ULONG32 r = 0; r < entry.relocationCount; r++)
+        {
+            const auto& relocation = entry.relocations[r];
+            if (relocation.param >= ILParamCount || relocation.offset > entry.bodySize || entry.bodySize - relocation.offset < relocation.size)
+                return false;
+        }
+
+        mapped[entryHeader->key] = entry;
+    }
+
+    return true;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "ILRewriter.h"
+
+struct ILCacheKey
+{
+    GUID mvid;
+    mdMethodDef method;
+    ULONG32 mode;
+    UINT64 ilHash;
+
+    bool operator< (const ILCacheKey& other) const;
+
+    // Same method and mode, whatever the IL.
+    bool SameMethod(const ILCacheKey& other) const;
+};
+
+// A cached instrumented body, pointing into the cache file or into a body
+// captured during this run. Valid until the matching ILCache::Release.
+struct ILCacheEntry
+{
+    const BYTE* body;
+    ULONG32 bodySize;
+    const ILRelocation* relocations;
+    ULONG32 relocationCount;
+    const ILBlock* blocks;
+    ULONG32 blockCount;
+};
+
+// Instrumented IL bodies kept across runs. The file is memory-mapped
+// read-only when the profiler starts, and rewritten on shutdown with the
+// bodies produced during the run. A body is found only if the module MVID,
+// method token, instrumentation mode and a hash of the original IL all
+// match, so a rebuilt assembly just misses and its stale bodies are
+// replaced. A file that fails any check is ignored as a whole.
+class ILCache
+{
+public:
+    // Bump whenever the shape of the emitted probes changes.
+    static constexpr ULONG32 Version = 4;
+
+    ILCache();
+    ~ILCache();
+
+    ILCache(const ILCache&) = delete;
+    ILCache& operator= (const ILCache&) = delete;
+
+    void Open(const std::string& path);
+    bool IsOpen() const { return !path.empty(); }
+
+    static UINT64 Hash(const BYTE* data, size_t size);
+
+    // On success the entry stays valid, and the file mapped, until Release
+    // is called. Always misses once the cache has been saved.
+    bool Find(const ILCacheKey& key, ILCacheEntry& entry);
+    void Release();
+
+    // Keeps the first body stored for a key, so entries handed out by Find
+    // never see their storage reassigned.
+    void Store(const ILCacheKey& key, const ILCapture& capture, const std::vector<ILBlock>& blocks);
+
+    // Writes the cache back, replacing the file atomically, and closes it.
+    // Waits for every entry found to be released before unmapping.
+    void Save();
+
+private:
+    struct CapturedBody
+    {
+        std::vector<BYTE> body;
+        std::vector<ILRelocation> relocations;
+        std::vector<ILBlock> blocks;
+    };
+
+    std::string path;
+    std::mutex mutex;
+    std::condition_variable released;
+    bool closed;
+    size_t readers;
+
+    const BYTE* data;
+    size_t size;
+#ifdef WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+    std::map<ILCacheKey, ILCacheEntry> mapped;
+    std::map<ILCacheKey, CapturedBody> captured;
+
+    bool Map();
+    void Unmap();
+    bool Parse();
+};
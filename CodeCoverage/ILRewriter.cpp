@@ -3,6 +3,9 @@
 #include "ILRewriter.h"
 #include <corhlpr.cpp>
 #include <cassert>
+#include <climits>
+#include <cstdlib>
+#include <new>
 #include <stdexcept>
 
 #undef IfFailRet
@@ -11,17 +14,19 @@
 #undef IfNullRet
 #define IfNullRet(EXPR) do { if ((EXPR) == NULL) return E_OUTOFMEMORY; } while (0)
 
+// Instructions are kept in contiguous arrays and refer to each other by
+// position. Positions below the sentinel index are the imported
+// instructions, the sentinel stands for the end of the method, and
+// positions after it are inserted instructions, in the order they were
+// emitted.
 struct ILInstr
 {
-    ILInstr *       m_pNext;
-    ILInstr *       m_pPrev;
-
     unsigned        m_opcode;
     unsigned        m_offset;
 
     union
     {
-        ILInstr *   m_pTarget;
+        unsigned    m_target;
         INT8        m_Arg8;
         INT16       m_Arg16;
         INT32       m_Arg32;
@@ -32,17 +37,35 @@ struct ILInstr
 struct EHClause
 {
     CorExceptionFlag            m_Flags;
-    ILInstr *                   m_pTryBegin;
-    ILInstr *                   m_pTryEnd;
-    ILInstr *                   m_pHandlerBegin;    // First instruction inside the handler
-    ILInstr *                   m_pHandlerEnd;      // Last instruction inside the handler
+    unsigned                    m_tryBegin;
+    unsigned                    m_tryEnd;
+    unsigned                    m_handlerBegin;     // First instruction inside the handler
+    unsigned                    m_handlerEnd;       // First instruction after the handler
     union
     {
         DWORD                   m_ClassToken;   // use for type-based exception handlers
-        ILInstr *               m_pFilter;      // use for filter-based exception handlers (COR_ILEXCEPTION_CLAUSE_FILTER is set)
+        unsigned                m_filter;       // use for filter-based exception handlers (COR_ILEXCEPTION_CLAUSE_FILTER is set)
     };
 };
 
+// An inserted instruction whose operand is a process-specific parameter.
+struct ILPendingRelocation
+{
+    unsigned    m_position;     // Inserted position, final index after materializing
+    ULONG32     m_param;
+    UINT64      m_addend;
+};
+
+// A run of inserted instructions, spliced in ahead of an imported
+// instruction when the method is exported.
+struct ILSplice
+{
+    unsigned    m_index;        // Imported instruction the run goes in front of
+    bool        m_fRetarget;    // Branches and EH boundaries at m_index now reach the run
+    unsigned    m_first;        // First inserted instruction of the run
+    unsigned    m_count;
+};
+
 typedef enum
 {
 #define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) c,
@@ -50,6 +73,7 @@ typedef enum
 #undef OPDEF
     CEE_COUNT,
     CEE_SWITCH_ARG, // special internal instructions
+    CEE_LABEL,      // zero-sized branch target
 } OPCODE;
 
 #define OPCODEFLAGS_SizeMask        0x0F
@@ -101,6 +125,7 @@ static const BYTE s_OpCodeFlags[] =
 #undef InlineSwitch
     0,                              // CEE_COUNT
     4 | OPCODEFLAGS_BranchTarget,   // CEE_SWITCH_ARG
+    0,                              // CEE_LABEL
 };
 
 static int k_rgnStackPushes[] = {
@@ -131,7 +156,178 @@ static int k_rgnStackPushes[] = {
 #undef VarPush 
 #undef OPDEF
     0,  // CEE_COUNT
-    0   // CEE_SWITCH_ARG
+    0,  // CEE_SWITCH_ARG
+    0   // CEE_LABEL
+};
+
+// Bump allocator for the rewriter's per-method scratch: instructions, EH
+// clauses, splices, the offset table and the layout tables. There is one per thread,
+// and it is reset when the outermost rewriter on the thread is destroyed, so
+// a rewriter created while another is alive cannot free its memory. The biggest
+// chunk is kept across resets, so after warm-up a rewrite does not call
+// into the heap at all.
+//
+// Building with ILREWRITER_HEAP_SCRATCH gives every allocation its own heap
+// block instead, freed on reset, as before the arena; the harness uses it to
+// measure what the arena saves.
+class ILArena
+{
+    struct Chunk
+    {
+        Chunk * m_pNext;
+        size_t  m_size;
+    };
+
+    static const size_t MinChunkSize = 64 * 1024;
+    static const size_t Alignment = 16;
+    static const size_t HeaderSize = (sizeof(Chunk) + Alignment - 1) & ~(Alignment - 1);
+
+    Chunk * m_pChunks;  // Most recent, and largest, first
+    BYTE *  m_pCurrent;
+    BYTE *  m_pLimit;
+    unsigned m_users;   // Live rewriters on this thread
+
+    bool Grow(size_t size)
+    {
+        size_t chunkSize = m_pChunks ? m_pChunks->m_size * 2 : MinChunkSize;
+        while (chunkSize < size + HeaderSize)
+            chunkSize *= 2;
+
+        Chunk * pChunk = (Chunk *)malloc(chunkSize);
+        if (pChunk == NULL)
+            return false;
+
+        pChunk->m_pNext = m_pChunks;
+        pChunk->m_size = chunkSize;
+        m_pChunks = pChunk;
+        m_pCurrent = (BYTE *)pChunk + HeaderSize;
+        m_pLimit = (BYTE *)pChunk + chunkSize;
+        return true;
+    }
+
+public:
+    ILArena() : m_pChunks(NULL), m_pCurrent(NULL), m_pLimit(NULL), m_users(0)
+    {
+    }
+
+    ~ILArena()
+    {
+        while (m_pChunks != NULL)
+        {
+            Chunk * pNext = m_pChunks->m_pNext;
+            free(m_pChunks);
+            m_pChunks = pNext;
+        }
+    }
+
+    ILArena(const ILArena&) = delete;
+    ILArena& operator= (const ILArena&) = delete;
+
+    void * Allocate(size_t size)
+    {
+#ifdef ILREWRITER_HEAP_SCRATCH
+        Chunk * pChunk = (Chunk *)malloc(HeaderSize + size);
+        if (pChunk == NULL)
+            return NULL;
+
+        pChunk->m_pNext = m_pChunks;
+        pChunk->m_size = HeaderSize + size;
+        m_pChunks = pChunk;
+        return (BYTE *)pChunk + HeaderSize;
+#else
+        size = (size + Alignment - 1) & ~(Alignment - 1);
+        if ((size_t)(m_pLimit - m_pCurrent) < size && !Grow(size))
+            return NULL;
+
+        void * p = m_pCurrent;
+        m_pCurrent += size;
+        return p;
+#endif
+    }
+
+    // Uninitialized storage for count elements of T.
+    template <typename T>
+    T * AllocateArray(size_t count)
+    {
+        return (T *)Allocate(sizeof(T) * count);
+    }
+
+    void AddUser()
+    {
+        m_users++;
+    }
+
+    // Resets the arena once the last user is gone.
+    void RemoveUser()
+    {
+        assert(m_users > 0);
+        if (--m_users == 0)
+            Reset();
+    }
+
+    // Releases everything allocated since the last reset. Only the newest
+    // chunk is kept; it is the largest, so it fits whatever method needed
+    // the older ones.
+    void Reset()
+    {
+#ifdef ILREWRITER_HEAP_SCRATCH
+        while (m_pChunks != NULL)
+        {
+            Chunk * pNext = m_pChunks->m_pNext;
+            free(m_pChunks);
+            m_pChunks = pNext;
+        }
+        return;
+#endif
+        if (m_pChunks == NULL)
+            return;
+
+        Chunk * pOlder = m_pChunks->m_pNext;
+        while (pOlder != NULL)
+        {
+            Chunk * pNext = pOlder->m_pNext;
+            free(pOlder);
+            pOlder = pNext;
+        }
+        m_pChunks->m_pNext = NULL;
+        m_pCurrent = (BYTE *)m_pChunks + HeaderSize;
+    }
+};
+
+static thread_local ILArena s_arena;
+
+// Growable array in the arena. Growing leaves the old storage behind until
+// the arena is reset, which is cheaper than freeing it.
+template <typename T>
+class ILArenaList
+{
+    T *         m_pItems;
+    unsigned    m_count;
+    unsigned    m_capacity;
+
+public:
+    ILArenaList() : m_pItems(NULL), m_count(0), m_capacity(0)
+    {
+    }
+
+    T * Append()
+    {
+        if (m_count == m_capacity)
+        {
+            unsigned capacity = m_capacity ? m_capacity * 2 : 64;
+            T * pItems = s_arena.AllocateArray<T>(capacity);
+            if (pItems == NULL)
+                return NULL;
+            if (m_count != 0)
+                CopyMemory(pItems, m_pItems, m_count * sizeof(T));
+            m_pItems = pItems;
+            m_capacity = capacity;
+        }
+        return &m_pItems[m_count++];
+    }
+
+    unsigned Count() const { return m_count; }
+    T & operator[] (unsigned index) { return m_pItems[index]; }
 };
 
 class ILRewriter
@@ -148,20 +344,34 @@ private:
     unsigned    m_flags;
     bool        m_fGenerateTinyHeader;
 
-    ILInstr m_IL; // Double linked list of all il instructions
+    // Imported instructions in IL order, followed by the sentinel at
+    // m_pInstrs[m_nInstrs]. Never moved or reordered, so positions stay
+    // valid while probes are added.
+    ILInstr *   m_pInstrs;
+    unsigned    m_nInstrs;
 
     unsigned    m_nEH;
     EHClause *  m_pEH;
 
     // Helper table for importing.  Sparse array that maps BYTE offset of beginning of an
-    // instruction to that instruction's ILInstr*.  BYTE offsets that don't correspond
-    // to the beginning of an instruction are mapped to NULL.
-    ILInstr **  m_pOffsetToInstr;
+    // instruction to that instruction's index.  BYTE offsets that don't correspond
+    // to the beginning of an instruction are mapped to UINT_MAX.
+    unsigned *  m_pOffsetToInstr;
     unsigned    m_CodeSize;
 
-    unsigned    m_nInstrs;
+    // Inserted instructions and the runs they form. Only materialized into
+    // one array, with the imported instructions, on export.
+    ILArenaList<ILInstr>    m_inserted;
+    ILArenaList<ILSplice>   m_splices;
+    ILSplice *              m_pOpenSplice;
+    bool                    m_fOutOfMemory;
+
+    // Every run leaves the stack as it found it, so the deepest any run can
+    // push, on top of the original method's max stack, bounds the new one.
+    unsigned                m_runStack;
+    unsigned                m_maxRunStack;
 
-    BYTE *      m_pOutputBuffer;
+    ILArenaList<ILPendingRelocation>    m_relocations;
 
     IMethodMalloc * m_pIMethodMalloc;
 
@@ -169,26 +379,17 @@ public:
     ILRewriter(ICorProfilerInfo * pICorProfilerInfo, ICorProfilerFunctionControl * pICorProfilerFunctionControl, ModuleID moduleID, mdToken tkMethod)
         : m_pICorProfilerInfo(pICorProfilerInfo), m_pICorProfilerFunctionControl(pICorProfilerFunctionControl),
         m_moduleId(moduleID), m_tkMethod(tkMethod), m_fGenerateTinyHeader(false),
-        m_pEH(nullptr), m_pOffsetToInstr(nullptr), m_pOutputBuffer(nullptr), m_pIMethodMalloc(nullptr)
+        m_pInstrs(nullptr), m_nInstrs(0), m_nEH(0), m_pEH(nullptr), m_pOffsetToInstr(nullptr),
+        m_pOpenSplice(nullptr), m_fOutOfMemory(false), m_runStack(0), m_maxRunStack(0),
+        m_pIMethodMalloc(nullptr)
     {
-        m_IL.m_pNext = &m_IL;
-        m_IL.m_pPrev = &m_IL;
-
-        m_nInstrs = 0;
+        s_arena.AddUser();
     }
 
     ~ILRewriter()
     {
-        ILInstr * p = m_IL.m_pNext;
-        while (p != &m_IL)
-        {
-            ILInstr * t = p->m_pNext;
-            delete p;
-            p = t;
-        }
-        delete[] m_pEH;
-        delete[] m_pOffsetToInstr;
-        delete[] m_pOutputBuffer;
+        // Instructions, EH clauses and buffers all live in the arena.
+        s_arena.RemoveUser();
 
         if (m_pIMethodMalloc)
             m_pIMethodMalloc->Release();
@@ -225,14 +426,15 @@ public:
 
     HRESULT ImportIL(LPCBYTE pIL)
     {
-        m_pOffsetToInstr = new ILInstr*[m_CodeSize + 1];
+        m_pOffsetToInstr = s_arena.AllocateArray<unsigned>(m_CodeSize + 1);
         IfNullRet(m_pOffsetToInstr);
 
-        ZeroMemory(m_pOffsetToInstr, m_CodeSize * sizeof(ILInstr*));
+        memset(m_pOffsetToInstr, 0xFF, m_CodeSize * sizeof(unsigned));
 
-        // Set the sentinel instruction
-        m_pOffsetToInstr[m_CodeSize] = &m_IL;
-        m_IL.m_opcode = -1;
+        // Every instruction, switch targets included, takes at least one
+        // byte, so the code size bounds the instruction count.
+        m_pInstrs = s_arena.AllocateArray<ILInstr>(m_CodeSize + 1);
+        IfNullRet(m_pInstrs);
 
         bool fBranch = false;
         unsigned offset = 0;
@@ -273,14 +475,12 @@ public:
                 return COR_E_INVALIDPROGRAM;
             }
 
-            ILInstr * pInstr = NewILInstr();
-            IfNullRet(pInstr);
+            m_pOffsetToInstr[startOffset] = m_nInstrs;
 
+            ILInstr * pInstr = &m_pInstrs[m_nInstrs++];
             pInstr->m_opcode = opcode;
-
-            InsertBefore(&m_IL, pInstr);
-
-            m_pOffsetToInstr[startOffset] = pInstr;
+            pInstr->m_offset = startOffset;
+            pInstr->m_Arg64 = 0;
 
             switch (flags)
             {
@@ -328,15 +528,12 @@ public:
                         return COR_E_INVALIDPROGRAM;
                     }
 
-                    pInstr = NewILInstr();
-                    IfNullRet(pInstr);
-
+                    pInstr = &m_pInstrs[m_nInstrs++];
                     pInstr->m_opcode = CEE_SWITCH_ARG;
+                    pInstr->m_offset = offset;
 
                     pInstr->m_Arg32 = base + *(UNALIGNED INT32 *)&(pIL[offset]);
                     offset += sizeof(INT32);
-
-                    InsertBefore(&m_IL, pInstr);
                 }
                 fBranch = true;
                 break;
@@ -349,13 +546,24 @@ public:
         }
         assert(offset == m_CodeSize);
 
+        // Set the sentinel instruction
+        m_pOffsetToInstr[m_CodeSize] = m_nInstrs;
+        m_pInstrs[m_nInstrs].m_opcode = -1;
+        m_pInstrs[m_nInstrs].m_offset = m_CodeSize;
+
         if (fBranch)
         {
             // Go over all control flow instructions and resolve the targets
-            for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+            for (unsigned i = 0; i < m_nInstrs; i++)
             {
+                ILInstr * pInstr = &m_pInstrs[i];
                 if (s_OpCodeFlags[pInstr->m_opcode] & OPCODEFLAGS_BranchTarget)
-                    pInstr->m_pTarget = GetInstrFromOffset(pInstr->m_Arg32);
+                {
+                    unsigned target = GetInstrFromOffset(pInstr->m_Arg32);
+                    if (target == UINT_MAX)
+                        return COR_E_INVALIDPROGRAM;
+                    pInstr->m_target = target;
+                }
             }
         }
 
@@ -371,7 +579,7 @@ public:
         if (nEH == 0)
             return S_OK;
 
-        IfNullRet(m_pEH = new EHClause[m_nEH]);
+        IfNullRet(m_pEH = s_arena.AllocateArray<EHClause>(m_nEH));
         for (unsigned iEH = 0; iEH < m_nEH; iEH++)
         {
             // If the EH clause is in tiny form, the call to pILEH->EHClause() below will
@@ -384,67 +592,237 @@ public:
             EHClause* clause = &(m_pEH[iEH]);
             clause->m_Flags = ehInfo->GetFlags();
 
-            clause->m_pTryBegin = GetInstrFromOffset(ehInfo->GetTryOffset());
-            clause->m_pTryEnd = GetInstrFromOffset(ehInfo->GetTryOffset() + ehInfo->GetTryLength());
-            clause->m_pHandlerBegin = GetInstrFromOffset(ehInfo->GetHandlerOffset());
-            clause->m_pHandlerEnd = GetInstrFromOffset(ehInfo->GetHandlerOffset() + ehInfo->GetHandlerLength())->m_pPrev;
+            clause->m_tryBegin = GetInstrFromOffset(ehInfo->GetTryOffset());
+            clause->m_tryEnd = GetInstrFromOffset(ehInfo->GetTryOffset() + ehInfo->GetTryLength());
+            clause->m_handlerBegin = GetInstrFromOffset(ehInfo->GetHandlerOffset());
+            clause->m_handlerEnd = GetInstrFromOffset(ehInfo->GetHandlerOffset() + ehInfo->GetHandlerLength());
             if ((clause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0)
                 clause->m_ClassToken = ehInfo->GetClassToken();
             else
-                clause->m_pFilter = GetInstrFromOffset(ehInfo->GetFilterOffset());
+                clause->m_filter = GetInstrFromOffset(ehInfo->GetFilterOffset());
         }
 
         return S_OK;
     }
 
-    ILInstr* NewILInstr()
+    unsigned GetInstrFromOffset(unsigned offset)
     {
-        m_nInstrs++;
-        return new ILInstr();
+        unsigned index = UINT_MAX;
+
+        if (offset <= m_CodeSize)
+            index = m_pOffsetToInstr[offset];
+
+        assert(index != UINT_MAX);
+        return index;
     }
 
-    ILInstr* GetInstrFromOffset(unsigned offset)
+    /////////////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // I N S E R T I O N
+    //
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Number of imported instructions; this is also the sentinel's position.
+    unsigned GetInstrCount()
     {
-        ILInstr * pInstr = NULL;
+        return m_nInstrs;
+    }
 
-        if (offset <= m_CodeSize)
-            pInstr = m_pOffsetToInstr[offset];
+    const ILInstr & GetInstr(unsigned index)
+    {
+        return m_pInstrs[index];
+    }
+
+    // Starts a run of inserted code ahead of imported instruction index,
+    // or at the end of the method for the sentinel. Without fRetarget,
+    // branches to index skip the run, so it only executes on fall-through.
+    // With fRetarget, branches and EH boundaries at index move to the start
+    // of the run. Runs at the same index keep the order they were started
+    // in, except that all plain runs come before all retargeted ones.
+    HRESULT BeginInsert(unsigned index, bool fRetarget)
+    {
+        assert(m_pOpenSplice == NULL && index <= m_nInstrs);
+
+        m_pOpenSplice = m_splices.Append();
+        IfNullRet(m_pOpenSplice);
 
-        assert(pInstr != NULL);
-        return pInstr;
+        m_pOpenSplice->m_index = index;
+        m_pOpenSplice->m_fRetarget = fRetarget;
+        m_pOpenSplice->m_first = m_inserted.Count();
+        m_pOpenSplice->m_count = 0;
+        m_runStack = 0;
+        return S_OK;
+    }
+
+    // Closes the open run. Fails if any instruction in it could not be
+    // allocated.
+    HRESULT EndInsert()
+    {
+        assert(m_pOpenSplice != NULL);
+        m_pOpenSplice = NULL;
+        if (m_runStack > m_maxRunStack)
+            m_maxRunStack = m_runStack;
+        return m_fOutOfMemory ? E_OUTOFMEMORY : S_OK;
     }
 
-    void InsertBefore(ILInstr * pWhere, ILInstr * pWhat)
+    // Appends an instruction to the open run and returns its position. The
+    // argument is stored according to the opcode's operand size; branch
+    // targets are set afterwards with SetTarget.
+    unsigned Emit(unsigned opcode, INT64 arg = 0)
     {
-        pWhat->m_pNext = pWhere;
-        pWhat->m_pPrev = pWhere->m_pPrev;
+        assert(m_pOpenSplice != NULL);
+
+        ILInstr * pInstr = m_inserted.Append();
+        if (pInstr == NULL)
+        {
+            m_fOutOfMemory = true;
+            return UINT_MAX;
+        }
+
+        pInstr->m_opcode = opcode;
+        pInstr->m_offset = 0;
+        pInstr->m_Arg64 = 0;
+        switch (s_OpCodeFlags[opcode] & OPCODEFLAGS_SizeMask)
+        {
+        case 1: pInstr->m_Arg8 = (INT8)arg; break;
+        case 2: pInstr->m_Arg16 = (INT16)arg; break;
+        case 4: pInstr->m_Arg32 = (INT32)arg; break;
+        case 8: pInstr->m_Arg64 = arg; break;
+        }
 
-        pWhat->m_pNext->m_pPrev = pWhat;
-        pWhat->m_pPrev->m_pNext = pWhat;
+        m_pOpenSplice->m_count++;
+        m_runStack += k_rgnStackPushes[opcode];
 
-        AdjustState(pWhat);
+        return m_nInstrs + m_inserted.Count();
     }
 
-    void InsertAfter(ILInstr * pWhere, ILInstr * pWhat)
+    // Appends an instruction whose operand is params[param] + addend, and
+    // records it so the body can be relocated for another process.
+    unsigned EmitOperand(unsigned opcode, ILParam param, UINT64 value, UINT64 addend = 0)
     {
-        pWhat->m_pNext = pWhere->m_pNext;
-        pWhat->m_pPrev = pWhere;
+        unsigned position = Emit(opcode, value + addend);
+        if (position == UINT_MAX)
+            return position;
 
-        pWhat->m_pNext->m_pPrev = pWhat;
-        pWhat->m_pPrev->m_pNext = pWhat;
+        ILPendingRelocation * pRelocation = m_relocations.Append();
+        if (pRelocation == NULL)
+        {
+            m_fOutOfMemory = true;
+            return UINT_MAX;
+        }
 
-        AdjustState(pWhat);
+        pRelocation->m_position = position;
+        pRelocation->m_param = param;
+        pRelocation->m_addend = addend;
+        return position;
     }
 
-    void AdjustState(ILInstr * pNewInstr)
+    // Appends a zero-sized instruction that marks a branch target.
+    unsigned EmitLabel()
     {
-        m_maxStack += k_rgnStackPushes[pNewInstr->m_opcode];
+        return Emit(CEE_LABEL);
     }
 
+    void SetTarget(unsigned position, unsigned target)
+    {
+        if (position == UINT_MAX)
+            return;
+
+        assert(position > m_nInstrs);
+        m_inserted[position - m_nInstrs - 1].m_target = target;
+    }
+
+    // Turns imported instruction index into a branch to target. Only meant
+    // for instructions that take no operand, such as RET; the short form is
+    // widened on export if the target ends up out of range.
+    void ReplaceWithBranch(unsigned index, unsigned target)
+    {
+        assert(index < m_nInstrs && (s_OpCodeFlags[m_pInstrs[index].m_opcode] & OPCODEFLAGS_SizeMask) == 0);
+        if (target == UINT_MAX)
+            return;
+
+        m_pInstrs[index].m_opcode = CEE_BR_S;
+        m_pInstrs[index].m_target = target;
+    }
 
-    ILInstr * GetILList()
+    // Splits the imported method into basic blocks. A leader is the first
+    // instruction, any branch, switch or EH boundary target, and any
+    // instruction that follows a transfer of control. Works on the imported
+    // instructions only, so it is unaffected by code already inserted.
+    HRESULT FindBasicBlocks(std::vector<unsigned> & leaders, std::vector<ILBlock> & blocks)
     {
-        return &m_IL;
+        BYTE * isLeader = s_arena.AllocateArray<BYTE>(m_nInstrs + 1);
+        IfNullRet(isLeader);
+
+        ZeroMemory(isLeader, m_nInstrs + 1);
+        isLeader[0] = true;
+
+        for (unsigned i = 0; i < m_nInstrs; i++)
+        {
+            ILInstr * pInstr = &m_pInstrs[i];
+            switch (pInstr->m_opcode)
+            {
+            case CEE_SWITCH:
+                if (m_pInstrs[i + 1].m_opcode != CEE_SWITCH_ARG)
+                    isLeader[i + 1] = true;
+                break;
+            case CEE_SWITCH_ARG:
+                isLeader[pInstr->m_target] = true;
+                if (m_pInstrs[i + 1].m_opcode != CEE_SWITCH_ARG)
+                    isLeader[i + 1] = true;
+                break;
+            case CEE_RET:
+            case CEE_THROW:
+            case CEE_RETHROW:
+            case CEE_ENDFINALLY:
+            case CEE_ENDFILTER:
+            case CEE_JMP:
+                isLeader[i + 1] = true;
+                break;
+            default:
+                if (s_OpCodeFlags[pInstr->m_opcode] & OPCODEFLAGS_BranchTarget)
+                {
+                    isLeader[pInstr->m_target] = true;
+                    isLeader[i + 1] = true;
+                }
+                break;
+            }
+        }
+
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+        {
+            EHClause * pClause = &m_pEH[iEH];
+            isLeader[pClause->m_tryBegin] = true;
+            isLeader[pClause->m_tryEnd] = true;
+            isLeader[pClause->m_handlerBegin] = true;
+            isLeader[pClause->m_handlerEnd] = true;
+            if (pClause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER)
+                isLeader[pClause->m_filter] = true;
+        }
+
+        unsigned nLeaders = 0;
+        for (unsigned i = 0; i < m_nInstrs; i++)
+        {
+            if (m_pInstrs[i].m_opcode == CEE_SWITCH_ARG)
+                isLeader[i] = false;
+            nLeaders += isLeader[i];
+        }
+        leaders.reserve(nLeaders);
+        blocks.reserve(nLeaders);
+
+        for (unsigned i = 0; i < m_nInstrs; i++)
+        {
+            if (!isLeader[i])
+                continue;
+
+            if (!blocks.empty())
+                blocks.back().end = m_pInstrs[i].m_offset;
+
+            leaders.push_back(i);
+            blocks.push_back({ m_pInstrs[i].m_offset, m_CodeSize });
+        }
+
+        return S_OK;
     }
 
     /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -453,27 +831,225 @@ public:
     //
     ////////////////////////////////////////////////////////////////////////////////////////////////
 
+    // Lays the imported and inserted instructions out in their final order
+    // and rewrites every EH boundary as an index into it. pFinal maps each
+    // position to its final index; Relax applies it to the branch targets,
+    // which saves a pass over the code.
+    HRESULT Materialize(ILInstr *& pCode, unsigned & nCode, unsigned *& pFinal)
+    {
+        unsigned nInserted = m_inserted.Count();
+        unsigned nSplices = m_splices.Count();
+
+        nCode = m_nInstrs + nInserted;
+        pCode = s_arena.AllocateArray<ILInstr>(nCode + 1);
+        IfNullRet(pCode);
+
+        // Final index of every position: the landing point for imported
+        // instructions and the sentinel, the exact slot for inserted ones.
+        pFinal = s_arena.AllocateArray<unsigned>(m_nInstrs + 1 + nInserted);
+        IfNullRet(pFinal);
+
+        // Probes are added walking the method forward, so the splices are
+        // usually in (index, retarget) order already. Otherwise a stable
+        // counting sort puts them in it.
+        unsigned * pOrder = NULL;
+        for (unsigned iSplice = 1; iSplice < nSplices; iSplice++)
+        {
+            if (SpliceBucket(m_splices[iSplice]) < SpliceBucket(m_splices[iSplice - 1]))
+            {
+                IfFailRet(SortSplices(pOrder));
+                break;
+            }
+        }
 
-    HRESULT Export()
+        // Imported instructions go over in blocks between the splice points.
+        // landed is the imported position whose final index a retargeted
+        // run has already set.
+        unsigned next = 0;
+        unsigned copied = 0;
+        unsigned landed = UINT_MAX;
+        for (unsigned iOrder = 0; iOrder < nSplices; iOrder++)
+        {
+            const ILSplice & splice = m_splices[pOrder != NULL ? pOrder[iOrder] : iOrder];
+            unsigned index = splice.m_index;
+            if (index > copied)
+            {
+                next = CopyImported(pCode, pFinal, copied, index, next, landed);
+                copied = index;
+            }
+
+            if (splice.m_fRetarget && landed != index)
+            {
+                pFinal[index] = next;
+                landed = index;
+            }
+
+            if (splice.m_count != 0)
+            {
+                CopyMemory(&pCode[next], &m_inserted[splice.m_first], splice.m_count * sizeof(ILInstr));
+                unsigned * pRun = &pFinal[m_nInstrs + 1 + splice.m_first];
+                for (unsigned k = 0; k < splice.m_count; k++)
+                    pRun[k] = next + k;
+                next += splice.m_count;
+            }
+        }
+        next = CopyImported(pCode, pFinal, copied, m_nInstrs + 1, next, landed);
+        assert(next == nCode + 1);
+
+        for (unsigned iRelocation = 0; iRelocation < m_relocations.Count(); iRelocation++)
+            m_relocations[iRelocation].m_position = pFinal[m_relocations[iRelocation].m_position];
+
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+        {
+            EHClause * pClause = &m_pEH[iEH];
+            pClause->m_tryBegin = pFinal[pClause->m_tryBegin];
+            pClause->m_tryEnd = pFinal[pClause->m_tryEnd];
+            pClause->m_handlerBegin = pFinal[pClause->m_handlerBegin];
+            pClause->m_handlerEnd = pFinal[pClause->m_handlerEnd];
+            if (pClause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER)
+                pClause->m_filter = pFinal[pClause->m_filter];
+        }
+
+        return S_OK;
+    }
+
+    // Copies imported positions [first, last) to pCode starting at next,
+    // and returns the index after them.
+    unsigned CopyImported(ILInstr * pCode, unsigned * pFinal, unsigned first, unsigned last, unsigned next, unsigned landed)
     {
-        // One instruction produces 2 + sizeof(native int) bytes in the worst case which can be 10 bytes for 64-bit.
-        // For simplification we just use 10 here.
-        unsigned maxSize = m_nInstrs * 10;
+        CopyMemory(&pCode[next], &m_pInstrs[first], (last - first) * sizeof(ILInstr));
 
-        m_pOutputBuffer = new BYTE[maxSize];
-        IfNullRet(m_pOutputBuffer);
+        unsigned shift = next - first;
+        for (unsigned i = (landed == first) ? first + 1 : first; i < last; i++)
+            pFinal[i] = i + shift;
 
-    again:
-        BYTE * pIL = m_pOutputBuffer;
+        return next + (last - first);
+    }
 
-        bool fBranch = false;
-        unsigned offset = 0;
+    // Stable counting sort of the splices by (index, retarget), so runs
+    // come out in the order the splice list describes.
+    HRESULT SortSplices(unsigned *& pOrder)
+    {
+        unsigned nSplices = m_splices.Count();
+        unsigned nBuckets = (m_nInstrs + 1) * 2;
+        unsigned * pBucketStart = s_arena.AllocateArray<unsigned>(nBuckets + 1);
+        pOrder = s_arena.AllocateArray<unsigned>(nSplices);
+        IfNullRet(pBucketStart);
+        IfNullRet(pOrder);
+
+        ZeroMemory(pBucketStart, (nBuckets + 1) * sizeof(unsigned));
+        for (unsigned iSplice = 0; iSplice < nSplices; iSplice++)
+            pBucketStart[SpliceBucket(m_splices[iSplice]) + 1]++;
+        for (unsigned iBucket = 0; iBucket < nBuckets; iBucket++)
+            pBucketStart[iBucket + 1] += pBucketStart[iBucket];
+        for (unsigned iSplice = 0; iSplice < nSplices; iSplice++)
+            pOrder[pBucketStart[SpliceBucket(m_splices[iSplice])]++] = iSplice;
+
+        return S_OK;
+    }
+
+    static unsigned SpliceBucket(const ILSplice & splice)
+    {
+        return splice.m_index * 2 + (splice.m_fRetarget ? 1 : 0);
+    }
 
-        // Go over all instructions and produce code for them
-        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+    // Bytes the instruction takes in the output. A switch counts its
+    // opcode and target count; each target is a CEE_SWITCH_ARG of its own.
+    static unsigned EncodedSize(const ILInstr & instr)
+    {
+        unsigned opcode = instr.m_opcode;
+        unsigned size = 0;
+
+        if (opcode < CEE_COUNT)
+            size = (opcode >= 0x100) ? 2 : 1;
+
+        BYTE flags = s_OpCodeFlags[opcode];
+        if (flags & OPCODEFLAGS_Switch)
+            size += sizeof(INT32);
+
+        return size + (flags & OPCODEFLAGS_SizeMask);
+    }
+
+    // Points every branch at its final index and assigns final offsets,
+    // widening every short branch whose target is out of INT8 range.
+    // Branches only ever grow, so offsets only ever increase and the loop
+    // reaches a fixpoint; each round just recomputes offsets, nothing is
+    // encoded, and only the branches still short are checked again. pShort
+    // is scratch for nCode indices. Returns the code size.
+    static unsigned Relax(ILInstr * pCode, unsigned nCode, const unsigned * pFinal, unsigned * pShort)
+    {
+        unsigned nShort = 0;
+        unsigned offset = 0;
+        for (unsigned i = 0; i < nCode; i++)
         {
-            assert(offset < maxSize);
+            ILInstr * pInstr = &pCode[i];
+            BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
+            if (flags & OPCODEFLAGS_BranchTarget)
+            {
+                pInstr->m_target = pFinal[pInstr->m_target];
+                if (flags == (1 | OPCODEFLAGS_BranchTarget))
+                    pShort[nShort++] = i;
+            }
             pInstr->m_offset = offset;
+            offset += EncodedSize(*pInstr);
+        }
+        pCode[nCode].m_offset = offset;
+
+        for (;;)
+        {
+            bool fWidened = false;
+            unsigned nStillShort = 0;
+            for (unsigned iShort = 0; iShort < nShort; iShort++)
+            {
+                unsigned i = pShort[iShort];
+                ILInstr * pInstr = &pCode[i];
+
+                // Check if delta is too big to fit into an INT8.
+                int delta = pCode[pInstr->m_target].m_offset - pCode[i + 1].m_offset;
+                if ((INT8)delta == delta)
+                {
+                    pShort[nStillShort++] = i;
+                    continue;
+                }
+
+                unsigned opcode = pInstr->m_opcode;
+                if (opcode == CEE_LEAVE_S)
+                {
+                    pInstr->m_opcode = CEE_LEAVE;
+                }
+                else
+                {
+                    assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
+                    pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
+                    assert(pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN);
+                }
+                fWidened = true;
+            }
+
+            if (!fWidened)
+                return offset;
+
+            nShort = nStillShort;
+            offset = 0;
+            for (unsigned i = 0; i < nCode; i++)
+            {
+                pCode[i].m_offset = offset;
+                offset += EncodedSize(pCode[i]);
+            }
+            pCode[nCode].m_offset = offset;
+        }
+    }
+
+    // Writes the code in one pass. Relax has fixed every offset, so branch
+    // deltas are known as each instruction is written.
+    static void Encode(const ILInstr * pCode, unsigned nCode, BYTE * pIL)
+    {
+        unsigned switchBase = 0;
+
+        for (unsigned i = 0; i < nCode; i++)
+        {
+            const ILInstr * pInstr = &pCode[i];
+            unsigned offset = pInstr->m_offset;
 
             unsigned opcode = pInstr->m_opcode;
             if (opcode < CEE_COUNT)
@@ -482,15 +1058,15 @@ public:
                 // the lead byte of multi-byte opcodes. For now, the only lead byte
                 // supported is CEE_PREFIX1 = 0xFE.
                 if (opcode >= 0x100)
-                    m_pOutputBuffer[offset++] = CEE_PREFIX1;
+                    pIL[offset++] = CEE_PREFIX1;
 
                 // This appears to depend on an implicit conversion from
                 // unsigned opcode down to BYTE, to deliberately lose data and have
                 // opcode >= 0x100 wrap around to 0.
-                m_pOutputBuffer[offset++] = (opcode & 0xFF);
+                pIL[offset++] = (opcode & 0xFF);
             }
 
-            BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
+            BYTE flags = s_OpCodeFlags[opcode];
             switch (flags)
             {
             case 0:
@@ -508,98 +1084,56 @@ public:
                 *(UNALIGNED INT64 *)&(pIL[offset]) = pInstr->m_Arg64;
                 break;
             case 1 | OPCODEFLAGS_BranchTarget:
-                fBranch = true;
+                *(UNALIGNED INT8 *)&(pIL[offset]) = (INT8)(pCode[pInstr->m_target].m_offset - pCode[i + 1].m_offset);
                 break;
             case 4 | OPCODEFLAGS_BranchTarget:
-                fBranch = true;
+                if (opcode == CEE_SWITCH_ARG)
+                {
+                    // Switch args are relative to the end of the whole table
+                    *(UNALIGNED INT32 *)&(pIL[offset]) = pCode[pInstr->m_target].m_offset - switchBase;
+                }
+                else
+                {
+                    *(UNALIGNED INT32 *)&(pIL[offset]) = pCode[pInstr->m_target].m_offset - pCode[i + 1].m_offset;
+                }
                 break;
             case 0 | OPCODEFLAGS_Switch:
                 *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_Arg32;
-                offset += sizeof(INT32);
+                switchBase = pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
                 break;
             default:
                 assert(false);
                 break;
             }
-            offset += (flags & OPCODEFLAGS_SizeMask);
         }
-        m_IL.m_offset = offset;
-
-        if (fBranch)
-        {
-            bool fTryAgain = false;
-            unsigned switchBase = 0;
-
-            // Go over all control flow instructions and resolve the targets
-            for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
-            {
-                unsigned opcode = pInstr->m_opcode;
+    }
 
-                if (pInstr->m_opcode == CEE_SWITCH)
-                {
-                    switchBase = pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
-                    continue;
-                }
-                if (opcode == CEE_SWITCH_ARG)
-                {
-                    // Switch args are special
-                    *(UNALIGNED INT32 *)&(pIL[pInstr->m_offset]) = pInstr->m_pTarget->m_offset - switchBase;
-                    continue;
-                }
+    // Sends the rewritten method to the runtime. With pCapture, also keeps
+    // a copy of the body and where its relocated operands are.
+    HRESULT Export(ILCapture * pCapture = NULL)
+    {
+        assert(m_pOpenSplice == NULL);
 
-                BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
+        ILInstr * pCode;
+        unsigned nCode;
+        unsigned * pFinal;
+        IfFailRet(Materialize(pCode, nCode, pFinal));
 
-                if (flags & OPCODEFLAGS_BranchTarget)
-                {
-                    int delta = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
+        unsigned * pShort = s_arena.AllocateArray<unsigned>(nCode);
+        IfNullRet(pShort);
 
-                    switch (flags)
-                    {
-                    case 1 | OPCODEFLAGS_BranchTarget:
-                        // Check if delta is too big to fit into an INT8.
-                        // 
-                        // (see #pragma at top of file)
-                        if ((INT8)delta != delta)
-                        {
-                            if (opcode == CEE_LEAVE_S)
-                            {
-                                pInstr->m_opcode = CEE_LEAVE;
-                            }
-                            else
-                            {
-                                assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
-                                pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
-                                assert(pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN);
-                            }
-                            fTryAgain = true;
-                            continue;
-                        }
-                        *(UNALIGNED INT8 *)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT8)]) = delta;
-                        break;
-                    case 4 | OPCODEFLAGS_BranchTarget:
-                        *(UNALIGNED INT32 *)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT32)]) = delta;
-                        break;
-                    default:
-                        assert(false);
-                        break;
-                    }
-                }
-            }
+        unsigned codeSize = Relax(pCode, nCode, pFinal, pShort);
+        unsigned maxStack = m_maxStack + m_maxRunStack;
 
-            // Do the whole thing again if we changed the size of some branch targets
-            if (fTryAgain)
-                goto again;
-        }
+        // Small methods without locals or EH keep a tiny header, which
+        // implies a max stack of 8.
+        m_fGenerateTinyHeader = m_nEH == 0 && RidFromToken(m_tkLocalVarSig) == 0 && maxStack <= 8 && codeSize < 64;
 
-        unsigned codeSize = offset;
+        // The code is encoded straight into the body, after the header.
         unsigned totalSize;
         LPBYTE pBody = NULL;
         if (m_fGenerateTinyHeader)
         {
-            // Make sure we can fit in a tiny header
-            if (codeSize >= 64)
-                return E_FAIL;
-
             totalSize = sizeof(IMAGE_COR_ILMETHOD_TINY) + codeSize;
             pBody = AllocateILMemory(totalSize);
             IfNullRet(pBody);
@@ -611,13 +1145,13 @@ public:
             pCurrent += sizeof(IMAGE_COR_ILMETHOD_TINY);
 
             // And the body
-            CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
+            Encode(pCode, nCode, pCurrent);
         }
         else
         {
             // Use FAT header
 
-            unsigned alignedCodeSize = (offset + 3) & ~3;
+            unsigned alignedCodeSize = (codeSize + 3) & ~3;
 
             totalSize = sizeof(IMAGE_COR_ILMETHOD_FAT) + alignedCodeSize +
                 (m_nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH) : 0);
@@ -630,13 +1164,13 @@ public:
             IMAGE_COR_ILMETHOD_FAT *pHeader = (IMAGE_COR_ILMETHOD_FAT *)pCurrent;
             pHeader->Flags = m_flags | (m_nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
             pHeader->Size = sizeof(IMAGE_COR_ILMETHOD_FAT) / sizeof(DWORD);
-            pHeader->MaxStack = m_maxStack;
-            pHeader->CodeSize = offset;
+            pHeader->MaxStack = maxStack;
+            pHeader->CodeSize = codeSize;
             pHeader->LocalVarSigTok = m_tkLocalVarSig;
 
             pCurrent = (BYTE*)(pHeader + 1);
 
-            CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
+            Encode(pCode, nCode, pCurrent);
             pCurrent += alignedCodeSize;
 
             if (m_nEH != 0)
@@ -653,20 +1187,41 @@ public:
                     IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT * pDst = (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *)pCurrent;
 
                     pDst->Flags = pSrc->m_Flags;
-                    pDst->TryOffset = pSrc->m_pTryBegin->m_offset;
-                    pDst->TryLength = pSrc->m_pTryEnd->m_offset - pSrc->m_pTryBegin->m_offset;
-                    pDst->HandlerOffset = pSrc->m_pHandlerBegin->m_offset;
-                    pDst->HandlerLength = pSrc->m_pHandlerEnd->m_pNext->m_offset - pSrc->m_pHandlerBegin->m_offset;
+                    pDst->TryOffset = pCode[pSrc->m_tryBegin].m_offset;
+                    pDst->TryLength = pCode[pSrc->m_tryEnd].m_offset - pCode[pSrc->m_tryBegin].m_offset;
+                    pDst->HandlerOffset = pCode[pSrc->m_handlerBegin].m_offset;
+                    pDst->HandlerLength = pCode[pSrc->m_handlerEnd].m_offset - pCode[pSrc->m_handlerBegin].m_offset;
                     if ((pSrc->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0)
                         pDst->ClassToken = pSrc->m_ClassToken;
                     else
-                        pDst->FilterOffset = pSrc->m_pFilter->m_offset;
+                        pDst->FilterOffset = pCode[pSrc->m_filter].m_offset;
 
                     pCurrent = (BYTE*)(pDst + 1);
                 }
             }
         }
 
+        if (pCapture != NULL)
+        {
+            unsigned headerSize = m_fGenerateTinyHeader ? sizeof(IMAGE_COR_ILMETHOD_TINY) : sizeof(IMAGE_COR_ILMETHOD_FAT);
+
+            pCapture->body.assign(pBody, pBody + totalSize);
+            pCapture->relocations.clear();
+            for (unsigned iRelocation = 0; iRelocation < m_relocations.Count(); iRelocation++)
+            {
+                ILPendingRelocation & pending = m_relocations[iRelocation];
+                const ILInstr & instr = pCode[pending.m_position];
+
+                ILRelocation relocation;
+                relocation.offset = headerSize + instr.m_offset + (instr.m_opcode >= 0x100 ? 2 : 1);
+                relocation.param = pending.m_param;
+                relocation.size = s_OpCodeFlags[instr.m_opcode] & OPCODEFLAGS_SizeMask;
+                relocation.reserved = 0;
+                relocation.addend = pending.m_addend;
+                pCapture->relocations.push_back(relocation);
+            }
+        }
+
         IfFailRet(SetILFunctionBody(totalSize, pBody));
         DeallocateILMemory(pBody);
 
@@ -693,9 +1248,9 @@ public:
     {
         if (m_pICorProfilerFunctionControl != NULL)
         {
-            // We're supplying IL for a rejit, so we can just allocate from
-            // the heap
-            return new BYTE[size];
+            // We're supplying IL for a rejit, which the runtime copies, so
+            // the body can come from the arena like the rest of the scratch
+            return s_arena.AllocateArray<BYTE>(size);
         }
 
         // Else, this is "classic-style" instrumentation on first JIT, and
@@ -709,41 +1264,208 @@ public:
 
     void DeallocateILMemory(LPBYTE pBody)
     {
-        if (m_pICorProfilerFunctionControl == NULL)
-        {
-            // Old-style instrumentation does not provide a way to free up bytes
-            return;
-        }
-
-        delete[] pBody;
+        // Old-style instrumentation does not provide a way to free up bytes,
+        // and rejit bodies are released with the arena
     }
 };
 
+// The Add*Probe functions below emit into the run the caller has opened
+// with BeginInsert, and leave closing it to the caller.
+
+// Pushes baseAddress + offset as a native int. A value that fits in 32 bits
+// is loaded with ldc.i4 and zero-extended by conv.u, four bytes shorter than
+// ldc.i8; a wider one is loaded with ldc.i8, then conv.i if fConvertWide.
+static void EmitNativeInt(
+    ILRewriter * pilr,
+    ILParam param,
+    UINT_PTR baseAddress,
+    UINT_PTR offset,
+    bool fConvertWide = true)
+{
+    if ((UINT64)baseAddress + offset <= 0xFFFFFFFF)
+    {
+        pilr->EmitOperand(CEE_LDC_I4, param, baseAddress, offset);
+        pilr->Emit(CEE_CONV_U);
+    }
+    else
+    {
+        pilr->EmitOperand(CEE_LDC_I8, param, baseAddress, offset);
+        if (fConvertWide)
+            pilr->Emit(CEE_CONV_I);
+    }
+}
+
+// Pushes an int32 constant using the shortest ldc.i4 form.
+static void EmitInt32(
+    ILRewriter * pilr,
+    INT32 value)
+{
+    if (value == -1)
+        pilr->Emit(CEE_LDC_I4_M1);
+    else if (value >= 0 && value <= 8)
+        pilr->Emit(CEE_LDC_I4_0 + value);
+    else if (value >= -128 && value <= 127)
+        pilr->Emit(CEE_LDC_I4_S, value);
+    else
+        pilr->Emit(CEE_LDC_I4, value);
+}
+
 HRESULT AddProbe(
     ILRewriter * pilr,
     FunctionID functionId,
+    ILParam methodParam,
     UINT_PTR methodAddress,
-    ULONG32 methodSignature,
-    ILInstr * pInsertProbeBeforeThisInstr)
+    ULONG32 methodSignature)
+{
+    // The callee takes native ints, which an int64 already is on 64-bit.
+    EmitNativeInt(pilr, ILParamFunctionId, functionId, 0, false);
+    EmitNativeInt(pilr, methodParam, methodAddress, 0, false);
+    pilr->EmitOperand(CEE_CALLI, ILParamSignature, methodSignature);
+
+    return S_OK;
+}
+
+// Emits an atomic increment of the counter at baseAddress + counterOffset:
+//   ldc.i counterAddress; conv; call Interlocked::Increment(int64&); pop
+// Threads running the same method bump the same slot, which a plain load,
+// add and store would lose counts on. The JIT expands Increment into a
+// locked add, and the slot is resolved when the method is JIT-compiled, so
+// there is still no transition into native code on the probe path.
+HRESULT AddCounterProbe(
+    ILRewriter * pilr,
+    ILParam param,
+    UINT_PTR baseAddress,
+    UINT_PTR counterOffset,
+    mdMemberRef incrementRef)
+{
+    EmitNativeInt(pilr, param, baseAddress, counterOffset);
+    pilr->EmitOperand(CEE_CALL, ILParamIncrement, incrementRef);
+    pilr->Emit(CEE_POP);
+
+    return S_OK;
+}
+
+// Emits a test-before-set of the byte at baseAddress + flagOffset:
+//   ldc.i flagAddress; conv; ldind.u1; brtrue.s skip
+//   ldc.i flagAddress; conv; ldc.i4.1; stind.i1
+// skip:
+// Once the flag is set the probe only reads it, so hot code never writes
+// to the shared cache line again.
+HRESULT AddFlagProbe(
+    ILRewriter * pilr,
+    ILParam param,
+    UINT_PTR baseAddress,
+    UINT_PTR flagOffset)
+{
+    EmitNativeInt(pilr, param, baseAddress, flagOffset);
+    pilr->Emit(CEE_LDIND_U1);
+    unsigned skip = pilr->Emit(CEE_BRTRUE_S);
+
+    EmitNativeInt(pilr, param, baseAddress, flagOffset);
+    pilr->Emit(CEE_LDC_I4_1);
+    pilr->Emit(CEE_STIND_I1);
+
+    pilr->SetTarget(skip, pilr->EmitLabel());
+
+    return S_OK;
+}
+
+// Adds a counter or flag probe at the start of every basic block. The
+// probe writes element i of the array returned by pBlockStorage for block i.
+HRESULT AddBlockProbes(
+    ILRewriter * pilr,
+    ProbeKind kind,
+    mdMemberRef incrementRef,
+    BlockStorage * pBlockStorage)
+{
+    std::vector<unsigned> leaders;
+    std::vector<ILBlock> blocks;
+    IfFailRet(pilr->FindBasicBlocks(leaders, blocks));
+
+    UINT_PTR storage = pBlockStorage->Allocate(blocks);
+    if (storage == 0)
+        return E_FAIL;
+
+    for (size_t i = 0; i < leaders.size(); i++)
+    {
+        // Retargeted, so branches into the block run its probe.
+        IfFailRet(pilr->BeginInsert(leaders[i], true));
+
+        if (kind == ProbeKind::Counter)
+            IfFailRet(AddCounterProbe(pilr, ILParamBlockStorage, storage, i * sizeof(UINT64), incrementRef));
+        else
+            IfFailRet(AddFlagProbe(pilr, ILParamBlockStorage, storage, i * sizeof(BYTE)));
+
+        IfFailRet(pilr->EndInsert());
+    }
+
+    return S_OK;
+}
+
+// Emits an AFL-style edge probe for the block with the given ID:
+//   ldc.i mapAddress; conv; ldsfld previousLocation
+//   ldc.i4 blockId; xor; conv.u; add; dup; ldind.u1; ldc.i4.1; add; stind.i1
+//   ldc.i4 blockId >> 1; stsfld previousLocation
+// The counter byte wraps at 256, as AFL's does. previousLocation is
+// thread-static, so blocks running on other threads don't make up edges.
+HRESULT AddEdgeProbe(
+    ILRewriter * pilr,
+    UINT_PTR mapAddress,
+    mdFieldDef previousLocation,
+    ULONG32 blockId)
 {
-    ILInstr * pNewInstr = nullptr;
+    EmitNativeInt(pilr, ILParamEdgeMap, mapAddress, 0);
+    pilr->EmitOperand(CEE_LDSFLD, ILParamEdgePrevious, previousLocation);
+    EmitInt32(pilr, blockId);
+    pilr->Emit(CEE_XOR);
+    pilr->Emit(CEE_CONV_U);
+    pilr->Emit(CEE_ADD);
+    pilr->Emit(CEE_DUP);
+    pilr->Emit(CEE_LDIND_U1);
+    pilr->Emit(CEE_LDC_I4_1);
+    pilr->Emit(CEE_ADD);
+    pilr->Emit(CEE_STIND_I1);
+
+    EmitInt32(pilr, blockId >> 1);
+    pilr->EmitOperand(CEE_STSFLD, ILParamEdgePrevious, previousLocation);
 
-    constexpr auto CEE_LDC_I = sizeof(size_t) == 8 ? CEE_LDC_I8 : sizeof(size_t) == 4 ? CEE_LDC_I4 : throw std::logic_error("size_t must be defined as 8 or 4");
+    return S_OK;
+}
 
-    pNewInstr = pilr->NewILInstr();
-    pNewInstr->m_opcode = CEE_LDC_I;
-    pNewInstr->m_Arg64 = functionId;
-    pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+// Scrambles a block index into a map location. Derived only from the seed
+// and the index, so the same block gets the same ID in every run, which
+// keeps a fuzzer's saved coverage comparable between executions.
+static ULONG32 EdgeBlockId(ULONG32 seed, ULONG32 block, ULONG32 mapSize)
+{
+    ULONG32 h = seed ^ (block * 0x9E3779B1u);
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h & (mapSize - 1);
+}
 
-    pNewInstr = pilr->NewILInstr();
-    pNewInstr->m_opcode = CEE_LDC_I;
-    pNewInstr->m_Arg64 = methodAddress;
-    pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+// Adds an edge probe at the start of every basic block.
+HRESULT AddEdgeProbes(
+    ILRewriter * pilr,
+    UINT_PTR mapAddress,
+    mdFieldDef previousLocation,
+    ULONG32 mapSize,
+    ULONG32 seed)
+{
+    std::vector<unsigned> leaders;
+    std::vector<ILBlock> blocks;
+    IfFailRet(pilr->FindBasicBlocks(leaders, blocks));
+
+    for (size_t i = 0; i < leaders.size(); i++)
+    {
+        ULONG32 blockId = EdgeBlockId(seed, static_cast<ULONG32>(i), mapSize);
 
-    pNewInstr = pilr->NewILInstr();
-    pNewInstr->m_opcode = CEE_CALLI;
-    pNewInstr->m_Arg32 = methodSignature;
-    pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+        IfFailRet(pilr->BeginInsert(leaders[i], true));
+        IfFailRet(AddEdgeProbe(pilr, mapAddress, previousLocation, blockId));
+        IfFailRet(pilr->EndInsert());
+    }
 
     return S_OK;
 }
@@ -754,9 +1476,11 @@ HRESULT AddEnterProbe(
     UINT_PTR methodAddress,
     ULONG32 methodSignature)
 {
-    ILInstr * pFirstOriginalInstr = pilr->GetILList()->m_pNext;
-
-    return AddProbe(pilr, functionId, methodAddress, methodSignature, pFirstOriginalInstr);
+    // Not retargeted: a branch back to the start of the method is not a
+    // new call.
+    IfFailRet(pilr->BeginInsert(0, false));
+    IfFailRet(AddProbe(pilr, functionId, ILParamEnterProbe, methodAddress, methodSignature));
+    return pilr->EndInsert();
 }
 
 
@@ -766,56 +1490,52 @@ HRESULT AddExitProbe(
     UINT_PTR methodAddress,
     ULONG32 methodSignature)
 {
-    HRESULT hr;
-    BOOL fAtLeastOneProbeAdded = FALSE;
-
-    // Find all RETs, and insert a call to the exit probe before each one.
-    for (ILInstr * pInstr = pilr->GetILList()->m_pNext; pInstr != pilr->GetILList(); pInstr = pInstr->m_pNext)
+    unsigned nRets = 0;
+    unsigned lastRet = 0;
+    for (unsigned i = 0; i < pilr->GetInstrCount(); i++)
     {
-        switch (pInstr->m_opcode)
+        if (pilr->GetInstr(i).m_opcode == CEE_RET)
         {
-        case CEE_RET:
-        {
-            // We want any branches or leaves that targeted the RET instruction to
-            // actually target the epilog instructions we're adding. So turn the "RET"
-            // into ["NOP", "RET"], and THEN add the epilog between the NOP & RET. That
-            // ensures that any branches that went to the RET will now go to the NOP and
-            // then execute our epilog.
-
-            // NOTE: The NOP is not strictly required, but is a simplification of the implementation.
-            // RET->NOP
-            pInstr->m_opcode = CEE_NOP;
-
-            // Add the new RET after
-            ILInstr * pNewRet = pilr->NewILInstr();
-            pNewRet->m_opcode = CEE_RET;
-            pilr->InsertAfter(pInstr, pNewRet);
-
-            // Add now insert the epilog before the new RET
-            hr = AddProbe(pilr, functionId, methodAddress, methodSignature, pNewRet);
-            if (FAILED(hr))
-                return hr;
-            fAtLeastOneProbeAdded = TRUE;
-
-            // Advance pInstr after all this gunk so the for loop continues properly
-            pInstr = pNewRet;
-            break;
-        }
-
-        default:
-            break;
+            nRets++;
+            lastRet = i;
         }
     }
 
-    if (!fAtLeastOneProbeAdded)
+    if (nRets == 0)
         return E_FAIL;
 
+    if (nRets == 1)
+    {
+        // Insert the exit probe right before the RET. The epilog is
+        // retargeted, so any branches that targeted the RET execute it too.
+        IfFailRet(pilr->BeginInsert(lastRet, true));
+        IfFailRet(AddProbe(pilr, functionId, ILParamExitProbe, methodAddress, methodSignature));
+        return pilr->EndInsert();
+    }
+
+    // With several RETs, each becomes a branch to one shared epilog at the
+    // end of the method, carrying the return value on the stack. RET is not
+    // allowed inside protected regions, so none of the branches leaves one,
+    // and retargeting at the end keeps the epilog out of a trailing handler.
+    IfFailRet(pilr->BeginInsert(pilr->GetInstrCount(), true));
+    unsigned epilog = pilr->EmitLabel();
+    IfFailRet(AddProbe(pilr, functionId, ILParamExitProbe, methodAddress, methodSignature));
+    pilr->Emit(CEE_RET);
+    IfFailRet(pilr->EndInsert());
+
+    for (unsigned i = 0; i <= lastRet; i++)
+    {
+        if (pilr->GetInstr(i).m_opcode == CEE_RET)
+            pilr->ReplaceWithBranch(i, epilog);
+    }
+
     return S_OK;
 }
 
 
 // Uses the general-purpose ILRewriter class to import original
-// IL, rewrite it, and send the result to the CLR
+// IL, rewrite it, and send the result to the CLR. An exitMethodAddress
+// of 0 leaves out the exit probes.
 HRESULT RewriteIL(
     ICorProfilerInfo * pICorProfilerInfo,
     ICorProfilerFunctionControl * pICorProfilerFunctionControl,
@@ -824,8 +1544,8 @@ HRESULT RewriteIL(
     FunctionID functionId,
     UINT_PTR enterMethodAddress,
     UINT_PTR exitMethodAddress,
-
-    ULONG32 methodSignature)
+    ULONG32 methodSignature,
+    ILCapture * pCapture)
 {
     ILRewriter rewriter(pICorProfilerInfo, pICorProfilerFunctionControl, moduleID, methodDef);
 
@@ -833,9 +1553,161 @@ HRESULT RewriteIL(
     {
         // Adds enter/exit probes
         IfFailRet(AddEnterProbe(&rewriter, functionId, enterMethodAddress, methodSignature));
-        IfFailRet(AddExitProbe(&rewriter, functionId, exitMethodAddress, methodSignature));
+        if (exitMethodAddress != 0)
+            IfFailRet(AddExitProbe(&rewriter, functionId, exitMethodAddress, methodSignature));
+    }
+    IfFailRet(rewriter.Export(pCapture));
+
+    return S_OK;
+}
+
+// Same as RewriteIL, but instead of calling back into the profiler the
+// method entry bumps its counter slot directly, through incrementRef, a
+// memberref to Interlocked.Increment(ref long) in the method's module. No
+// exit probe is added.
+HRESULT RewriteILWithCounter(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ICorProfilerFunctionControl * pICorProfilerFunctionControl,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    UINT_PTR counterAddress,
+    mdMemberRef incrementRef,
+    ILCapture * pCapture)
+{
+    ILRewriter rewriter(pICorProfilerInfo, pICorProfilerFunctionControl, moduleID, methodDef);
+
+    IfFailRet(rewriter.Import());
+    {
+        IfFailRet(rewriter.BeginInsert(0, false));
+        IfFailRet(AddCounterProbe(&rewriter, ILParamMethodProbe, counterAddress, 0, incrementRef));
+        IfFailRet(rewriter.EndInsert());
     }
-    IfFailRet(rewriter.Export());
+    IfFailRet(rewriter.Export(pCapture));
 
     return S_OK;
 }
+
+// Same as RewriteILWithCounter, but only records that the method ran by
+// setting the byte at flagAddress.
+HRESULT RewriteILWithFlag(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ICorProfilerFunctionControl * pICorProfilerFunctionControl,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    UINT_PTR flagAddress,
+    ILCapture * pCapture)
+{
+    ILRewriter rewriter(pICorProfilerInfo, pICorProfilerFunctionControl, moduleID, methodDef);
+
+    IfFailRet(rewriter.Import());
+    {
+        IfFailRet(rewriter.BeginInsert(0, false));
+        IfFailRet(AddFlagProbe(&rewriter, ILParamMethodProbe, flagAddress, 0));
+        IfFailRet(rewriter.EndInsert());
+    }
+    IfFailRet(rewriter.Export(pCapture));
+
+    return S_OK;
+}
+
+// Block coverage: a probe of the given kind at method entry, writing
+// methodProbeAddress, plus one at every basic block leader. incrementRef is
+// as for RewriteILWithCounter, and only used by counters.
+HRESULT RewriteILWithBlockProbes(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ICorProfilerFunctionControl * pICorProfilerFunctionControl,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    ProbeKind kind,
+    UINT_PTR methodProbeAddress,
+    mdMemberRef incrementRef,
+    BlockStorage * pBlockStorage,
+    ILCapture * pCapture)
+{
+    ILRewriter rewriter(pICorProfilerInfo, pICorProfilerFunctionControl, moduleID, methodDef);
+
+    IfFailRet(rewriter.Import());
+    {
+        IfFailRet(AddBlockProbes(&rewriter, kind, incrementRef, pBlockStorage));
+
+        // Not retargeted, so it lands ahead of the first block's probe and
+        // branches back to the start of the method skip it.
+        IfFailRet(rewriter.BeginInsert(0, false));
+        if (kind == ProbeKind::Counter)
+            IfFailRet(AddCounterProbe(&rewriter, ILParamMethodProbe, methodProbeAddress, 0, incrementRef));
+        else
+            IfFailRet(AddFlagProbe(&rewriter, ILParamMethodProbe, methodProbeAddress, 0));
+        IfFailRet(rewriter.EndInsert());
+    }
+    IfFailRet(rewriter.Export(pCapture));
+
+    return S_OK;
+}
+
+// Edge coverage for fuzzing: every basic block records the transition from
+// the block the thread ran before, kept in the thread-static uint32 field
+// previousLocation of the method's module, into the map at mapAddress.
+// mapSize must be a power of two; seed should differ between methods so
+// their blocks land in different parts of the map.
+HRESULT RewriteILWithEdgeProbes(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ICorProfilerFunctionControl * pICorProfilerFunctionControl,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    UINT_PTR mapAddress,
+    mdFieldDef previousLocation,
+    ULONG32 mapSize,
+    ULONG32 seed,
+    ILCapture * pCapture)
+{
+    ILRewriter rewriter(pICorProfilerInfo, pICorProfilerFunctionControl, moduleID, methodDef);
+
+    IfFailRet(rewriter.Import());
+    {
+        IfFailRet(AddEdgeProbes(&rewriter, mapAddress, previousLocation, mapSize, seed));
+    }
+    IfFailRet(rewriter.Export(pCapture));
+
+    return S_OK;
+}
+
+HRESULT SetRelocatedILBody(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    const BYTE * pBody,
+    ULONG cbBody,
+    const ILRelocation * pRelocations,
+    ULONG cRelocations,
+    const UINT64 * params)
+{
+    ILRewriter rewriter(pICorProfilerInfo, NULL, moduleID, methodDef);
+
+    LPBYTE pCopy = rewriter.AllocateILMemory(cbBody);
+    IfNullRet(pCopy);
+    CopyMemory(pCopy, pBody, cbBody);
+
+    for (ULONG i = 0; i < cRelocations; i++)
+    {
+        const ILRelocation & relocation = pRelocations[i];
+        if (relocation.param >= ILParamCount || relocation.offset + relocation.size > cbBody)
+            return COR_E_INVALIDPROGRAM;
+
+        UINT64 value = params[relocation.param] + relocation.addend;
+        switch (relocation.size)
+        {
+        case 4:
+            if (value > 0xFFFFFFFF)
+                return E_FAIL;
+            *(UNALIGNED INT32 *)&(pCopy[relocation.offset]) = (INT32)value;
+            break;
+        case 8:
+            *(UNALIGNED INT64 *)&(pCopy[relocation.offset]) = (INT64)value;
+            break;
+        default:
+            return COR_E_INVALIDPROGRAM;
+        }
+    }
+
+    return rewriter.SetILFunctionBody(cbBody, pCopy);
+}
\ No newline at end of file
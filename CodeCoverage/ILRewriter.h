@@ -1,5 +1,68 @@
 #pragma once
 
+#include <vector>
+
+// Original IL offset range [start, end) of a basic block.
+struct ILBlock
+{
+    ULONG32 start;
+    ULONG32 end;
+};
+
+enum class ProbeKind
+{
+    Counter,    // 64-bit counter, incremented atomically on every execution
+    Flag        // byte, set on first execution
+};
+
+// Operands that are only valid in the current process, such as probe and
+// counter addresses. Exported bodies record where each one was written, so
+// a cached body can be patched with this process's values.
+enum ILParam
+{
+    ILParamFunctionId,      // FunctionID or context passed to the native probes
+    ILParamEnterProbe,
+    ILParamExitProbe,
+    ILParamSignature,       // calli signature token of the native probes
+    ILParamMethodProbe,     // method counter or flag
+    ILParamBlockStorage,    // array returned by BlockStorage::Allocate
+    ILParamEdgeMap,
+    ILParamEdgePrevious,    // thread-static field holding the previous block
+    ILParamIncrement,       // memberref token of Interlocked.Increment(ref long)
+    ILParamCount
+};
+
+// Operand of size bytes at offset in a method body, holding the value of
+// param plus addend.
+struct ILRelocation
+{
+    ULONG32 offset;
+    ULONG32 param;
+    ULONG32 size;
+    ULONG32 reserved;
+    UINT64 addend;
+};
+
+// Receives a copy of the method body sent to the runtime, with the
+// locations of its process-specific operands.
+struct ILCapture
+{
+    std::vector<BYTE> body;
+    std::vector<ILRelocation> relocations;
+};
+
+// Supplies the storage that block probes write to, once the rewriter knows
+// how many blocks a method has.
+class BlockStorage
+{
+public:
+    virtual ~BlockStorage() {}
+
+    // Returns the address of a dense array with one element per block
+    // (UINT64 for counters, BYTE for flags), or 0 to skip the method.
+    virtual UINT_PTR Allocate(const std::vector<ILBlock>& blocks) = 0;
+};
+
 HRESULT RewriteIL(
     ICorProfilerInfo * pICorProfilerInfo,
     ICorProfilerFunctionControl * pICorProfilerFunctionControl,
@@ -8,4 +71,56 @@ HRESULT RewriteIL(
     FunctionID functionId,
     UINT_PTR enterMethodAddress,
     UINT_PTR exitMethodAddress,
-    ULONG32 methodSignature);
\ No newline at end of file
+    ULONG32 methodSignature,
+    ILCapture * pCapture = nullptr);
+
+HRESULT RewriteILWithCounter(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ICorProfilerFunctionControl * pICorProfilerFunctionControl,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    UINT_PTR counterAddress,
+    mdMemberRef incrementRef,
+    ILCapture * pCapture = nullptr);
+
+HRESULT RewriteILWithFlag(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ICorProfilerFunctionControl * pICorProfilerFunctionControl,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    UINT_PTR flagAddress,
+    ILCapture * pCapture = nullptr);
+
+HRESULT RewriteILWithBlockProbes(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ICorProfilerFunctionControl * pICorProfilerFunctionControl,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    ProbeKind kind,
+    UINT_PTR methodProbeAddress,
+    mdMemberRef incrementRef,
+    BlockStorage * pBlockStorage,
+    ILCapture * pCapture = nullptr);
+
+HRESULT RewriteILWithEdgeProbes(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ICorProfilerFunctionControl * pICorProfilerFunctionControl,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    UINT_PTR mapAddress,
+    mdFieldDef previousLocation,
+    ULONG32 mapSize,
+    ULONG32 seed,
+    ILCapture * pCapture = nullptr);
+
+// Sends a copy of a previously captured body to the runtime, with every
+// relocation patched to params[param] + addend.
+HRESULT SetRelocatedILBody(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    const BYTE * pBody,
+    ULONG cbBody,
+    const ILRelocation * pRelocations,
+    ULONG cRelocations,
+    const UINT64 * params);
\ No newline at end of file
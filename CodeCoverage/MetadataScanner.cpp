@@ -0,0 +1,88 @@
+#include "MetadataScanner.h"
+
+MetadataScanner::MetadataScanner() : stopping(false)
+{
+}
+
+MetadataScanner::~MetadataScanner()
+{
+    Stop();
+}
+
+void MetadataScanner::Start()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    if (!workers.empty())
+    {
+        return;
+    }
+
+    auto count = std::thread::hardware_concurrency();
+    if (count == 0)
+        count = 1;
+    if (count > MaxThreads)
+        count = MaxThreads;
+
+    stopping = false;
+    for (unsigned i = 0; i < count; i++)
+    {
+        workers.emplace_back(&MetadataScanner::Run, this);
+    }
+}
+
+void MetadataScanner::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (auto& worker : workers)
+    {
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+}
+
+void MetadataScanner::Enqueue(std::function<void()> scan)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (!stopping && !workers.empty())
+        {
+            pending.push_back(std::move(scan));
+            scan = nullptr;
+        }
+    }
+
+    if (scan)
+    {
+        scan();
+        return;
+    }
+    wake.notify_one();
+}
+
+void MetadataScanner::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        wake.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty())
+        {
+            break;
+        }
+
+        auto scan = std::move(pending.front());
+        pending.pop_front();
+        lock.unlock();
+
+        scan();
+
+        lock.lock();
+    }
+}
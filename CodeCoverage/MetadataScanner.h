@@ -0,0 +1,42 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small pool of background threads that read module metadata, so the
+// loader thread that reports a module only has to queue it. Modules are
+// scanned in parallel, each by a single thread.
+class MetadataScanner
+{
+public:
+    // Upper bound on workers, whatever the number of cores.
+    static constexpr unsigned MaxThreads = 4;
+
+    MetadataScanner();
+    ~MetadataScanner();
+
+    MetadataScanner(const MetadataScanner&) = delete;
+    MetadataScanner& operator= (const MetadataScanner&) = delete;
+
+    void Start();
+
+    // Runs whatever is still queued, then joins the workers. Work queued
+    // afterwards, or when the pool never started, runs on the caller.
+    void Stop();
+
+    void Enqueue(std::function<void()> scan);
+
+private:
+    std::deque<std::function<void()>> pending;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    void Run();
+};
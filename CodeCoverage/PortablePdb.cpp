@@ -0,0 +1,429 @@
+#include <cstring>
+#include "PortablePdb.h"
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// ECMA-335 II.24.2 and the Portable PDB v1.0 specification.
+static const ULONG MetadataSignature = 0x424A5342;
+static const ULONG DocumentTable = 0x30;
+static const ULONG MethodDebugInformationTable = 0x31;
+
+static ULONG ReadU16(const BYTE* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static ULONG ReadU32(const BYTE* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((ULONG)p[3] << 24);
+}
+
+static UINT64 ReadU64(const BYTE* p)
+{
+    return ReadU32(p) | ((UINT64)ReadU32(p + 4) << 32);
+}
+
+// Compressed unsigned integer (II.23.2). Returns false past the end.
+static bool ReadCompressed(const BYTE*& p, const BYTE* end, ULONG& value, ULONG& bytes)
+{
+    if (p >= end)
+        return false;
+
+    if ((p[0] & 0x80) == 0)
+    {
+        value = p[0];
+        bytes = 1;
+    }
+    else if ((p[0] & 0xC0) == 0x80)
+    {
+        if (p + 2 > end)
+            return false;
+        value = ((p[0] & 0x3F) << 8) | p[1];
+        bytes = 2;
+    }
+    else if ((p[0] & 0xE0) == 0xC0)
+    {
+        if (p + 4 > end)
+            return false;
+        value = ((p[0] & 0x1F) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        bytes = 4;
+    }
+    else
+    {
+        return false;
+    }
+
+    p += bytes;
+    return true;
+}
+
+static bool ReadCompressedUnsigned(const BYTE*& p, const BYTE* end, ULONG& value)
+{
+    ULONG bytes;
+    return ReadCompressed(p, end, value, bytes);
+}
+
+// Compressed signed integer: the two's complement value is rotated left by
+// one within the 7, 14 or 29 bits available, so the sign ends up in bit 0.
+static bool ReadCompressedSigned(const BYTE*& p, const BYTE* end, LONG& value)
+{
+    ULONG raw, bytes;
+    if (!ReadCompressed(p, end, raw, bytes))
+        return false;
+
+    value = (LONG)(raw >> 1);
+    if (raw & 1)
+        value -= bytes == 1 ? 0x40 : bytes == 2 ? 0x2000 : 0x10000000;
+    return true;
+}
+
+PortablePdb::PortablePdb(std::string path) :
+    path(path), valid(false), data(nullptr), size(0),
+#ifdef WIN32
+    file(INVALID_HANDLE_VALUE), mapping(nullptr),
+#endif
+    blobs(nullptr), blobsSize(0), blobIndexSize(2), guidIndexSize(2),
+    documentTable(nullptr), documentRows(0), documentRowSize(0),
+    methodDebugTable(nullptr), methodDebugRows(0), methodDebugRowSize(0), documentIndexSize(2)
+{
+}
+
+PortablePdb::~PortablePdb()
+{
+    Unmap();
+}
+
+void PortablePdb::Open()
+{
+    std::call_once(opened, [this]
+    {
+        valid = Map() && Parse();
+        if (!valid)
+            Unmap();
+    });
+}
+
+bool PortablePdb::Map()
+{
+#ifdef WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        return false;
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+        return false;
+
+    data = (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    size = (size_t)fileSize.QuadPart;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+        return false;
+
+    data = (const BYTE*)view;
+    size = (size_t)info.st_size;
+#endif
+    return data != nullptr;
+}
+
+void PortablePdb::Unmap()
+{
+#ifdef WIN32
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mapping != nullptr)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (data != nullptr)
+        munmap((void*)data, size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+bool PortablePdb::Parse()
+{
+    // Metadata root: signature, versions, reserved, version string length.
+    if (size < 20 || ReadU32(data) != MetadataSignature)
+        return false;
+
+    size_t offset = 16 + (size_t)ReadU32(data + 12);
+    if (offset + 4 > size)
+        return false;
+
+    ULONG streamCount = ReadU16(data + offset + 2);
+    offset += 4;
+
+    const BYTE* tables = nullptr;
+    ULONG tablesSize = 0;
+    const BYTE* pdb = nullptr;
+    ULONG pdbSize = 0;
+
+    for (ULONG i = 0; i < streamCount; i++)
+    {
+        if (offset + 8 > size)
+            return false;
+
+        ULONG streamOffset = ReadU32(data + offset);
+        ULONG streamSize = ReadU32(data + offset + 4);
+        const char* name = (const char*)(data + offset + 8);
+        size_t nameLength = strnlen(name, size - offset - 8);
+        offset += 8 + ((nameLength + 4) & ~(size_t)3);
+
+        if ((size_t)streamOffset + streamSize > size)
+            return false;
+
+        const BYTE* stream = data + streamOffset;
+        if (strcmp(name, "#~") == 0)
+        {
+            tables = stream;
+            tablesSize = streamSize;
+        }
+        else if (strcmp(name, "#Blob") == 0)
+        {
+            blobs = stream;
+            blobsSize = streamSize;
+        }
+        else if (strcmp(name, "#Pdb") == 0)
+        {
+            pdb = stream;
+            pdbSize = streamSize;
+        }
+    }
+
+    if (tables == nullptr || blobs == nullptr || pdb == nullptr || tablesSize < 24)
+        return false;
+
+    // #Pdb: PDB id (20 bytes), entry point, the module's type system tables
+    // the debug tables refer to, and a row count for each of them.
+    if (pdbSize < 32)
+        return false;
+
+    UINT64 referenced = ReadU64(pdb + 24);
+    if (referenced & ~((1ULL << DocumentTable) - 1))
+        return false;
+
+    size_t referencedTables = 0;
+    for (; referenced != 0; referenced &= referenced - 1)
+        referencedTables++;
+    if (32 + 4 * referencedTables > pdbSize)
+        return false;
+
+    BYTE heapSizes = tables[6];
+    UINT64 present = ReadU64(tables + 8);
+
+    // Type system tables belong to the module, not to a standalone PDB.
+    if (present & ((1ULL << DocumentTable) - 1))
+        return false;
+
+    ULONG rows[64] = {};
+    const BYTE* p = tables + 24;
+    const BYTE* end = tables + tablesSize;
+    for (ULONG table = 0; table < 64; table++)
+    {
+        if ((present & (1ULL << table)) == 0)
+            continue;
+        if (p + 4 > end)
+            return false;
+        rows[table] = ReadU32(p);
+        p += 4;
+    }
+
+    blobIndexSize = (heapSizes & 0x04) ? 4 : 2;
+    guidIndexSize = (heapSizes & 0x02) ? 4 : 2;
+
+    // Document: Name (blob), HashAlgorithm (guid), Hash (blob), Language (guid).
+    documentRows = rows[DocumentTable];
+    documentRowSize = 2 * blobIndexSize + 2 * guidIndexSize;
+    documentTable = p;
+    p += (size_t)documentRows * documentRowSize;
+
+    // MethodDebugInformation: Document (row index), SequencePoints (blob).
+    methodDebugRows = rows[MethodDebugInformationTable];
+    documentIndexSize = documentRows < 0x10000 ? 2 : 4;
+    methodDebugRowSize = documentIndexSize + blobIndexSize;
+    methodDebugTable = p;
+    p += (size_t)methodDebugRows * methodDebugRowSize;
+
+    return p <= end;
+}
+
+ULONG PortablePdb::ReadIndex(const BYTE* p, ULONG indexSize)
+{
+    return indexSize == 2 ? ReadU16(p) : ReadU32(p);
+}
+
+bool PortablePdb::GetBlob(ULONG index, const BYTE*& blob, ULONG& length) const
+{
+    if (index >= blobsSize)
+        return false;
+
+    const BYTE* p = blobs + index;
+    const BYTE* end = blobs + blobsSize;
+    if (!ReadCompressedUnsigned(p, end, length) || p + length > end)
+        return false;
+
+    blob = p;
+    return true;
+}
+
+bool PortablePdb::GetSequencePoints(mdMethodDef method, std::vector<SequencePoint>& points)
+{
+    Open();
+    if (!valid)
+        return false;
+
+    // MethodDebugInformation rows are parallel to the module's MethodDef table.
+    ULONG rid = RidFromToken(method);
+    if (rid == 0 || rid > methodDebugRows)
+        return false;
+
+    const BYTE* row = methodDebugTable + (size_t)(rid - 1) * methodDebugRowSize;
+    ULONG document = ReadIndex(row, documentIndexSize);
+    ULONG blobIndex = ReadIndex(row + documentIndexSize, blobIndexSize);
+    if (blobIndex == 0)
+        return true;
+
+    const BYTE* p;
+    ULONG length;
+    if (!GetBlob(blobIndex, p, length))
+        return false;
+    const BYTE* end = p + length;
+
+    // Header: LocalSignature, then InitialDocument when the row has none.
+    ULONG localSignature;
+    if (!ReadCompressedUnsigned(p, end, localSignature))
+        return false;
+    if (document == 0 && !ReadCompressedUnsigned(p, end, document))
+        return false;
+
+    bool first = true;
+    bool haveStart = false;
+    ULONG ilOffset = 0;
+    LONG startLine = 0;
+    LONG startColumn = 0;
+
+    while (p < end)
+    {
+        ULONG deltaIL;
+        if (!ReadCompressedUnsigned(p, end, deltaIL))
+            return false;
+
+        // A zero offset delta after the first record switches documents.
+        if (!first && deltaIL == 0)
+        {
+            if (!ReadCompressedUnsigned(p, end, document))
+                return false;
+            continue;
+        }
+
+        ilOffset = first ? deltaIL : ilOffset + deltaIL;
+        first = false;
+
+        ULONG deltaLines;
+        if (!ReadCompressedUnsigned(p, end, deltaLines))
+            return false;
+
+        LONG deltaColumns;
+        if (deltaLines == 0)
+        {
+            ULONG columns;
+            if (!ReadCompressedUnsigned(p, end, columns))
+                return false;
+            deltaColumns = (LONG)columns;
+        }
+        else if (!ReadCompressedSigned(p, end, deltaColumns))
+        {
+            return false;
+        }
+
+        // Hidden sequence point.
+        if (deltaLines == 0 && deltaColumns == 0)
+            continue;
+
+        if (!haveStart)
+        {
+            ULONG line, column;
+            if (!ReadCompressedUnsigned(p, end, line) || !ReadCompressedUnsigned(p, end, column))
+                return false;
+            startLine = (LONG)line;
+            startColumn = (LONG)column;
+            haveStart = true;
+        }
+        else
+        {
+            LONG deltaLine, deltaColumn;
+            if (!ReadCompressedSigned(p, end, deltaLine) || !ReadCompressedSigned(p, end, deltaColumn))
+                return false;
+            startLine += deltaLine;
+            startColumn += deltaColumn;
+        }
+
+        points.push_back({ ilOffset, document, (ULONG32)startLine, (ULONG32)startColumn,
+            (ULONG32)(startLine + deltaLines), (ULONG32)(startColumn + deltaColumns) });
+    }
+
+    return true;
+}
+
+std::string PortablePdb::GetDocumentName(ULONG32 document)
+{
+    Open();
+    if (!valid || document == 0 || document > documentRows)
+        return "";
+
+    const BYTE* row = documentTable + (size_t)(document - 1) * documentRowSize;
+    const BYTE* p;
+    ULONG length;
+    if (!GetBlob(ReadIndex(row, blobIndexSize), p, length) || length == 0)
+        return "";
+    const BYTE* end = p + length;
+
+    // Document name blob: a separator character, then blob indices of the
+    // UTF-8 parts to join with it.
+    char separator = (char)*p++;
+    std::string name;
+    bool firstPart = true;
+    while (p < end)
+    {
+        ULONG partIndex;
+        if (!ReadCompressedUnsigned(p, end, partIndex))
+            break;
+
+        if (!firstPart && separator != 0)
+            name += separator;
+        firstPart = false;
+
+        const BYTE* part;
+        ULONG partLength;
+        if (partIndex != 0 && GetBlob(partIndex, part, partLength))
+            name.append((const char*)part, partLength);
+    }
+
+    return name;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cor.h"
+
+struct SequencePoint
+{
+    ULONG32 ilOffset;
+    ULONG32 document;
+    ULONG32 startLine;
+    ULONG32 startColumn;
+    ULONG32 endLine;
+    ULONG32 endColumn;
+};
+
+// Reader for the portable PDB that sits next to a module. Nothing is read
+// until the first query; the file is then memory-mapped and only the
+// metadata root and table headers are parsed. Sequence point blobs and
+// document names are decoded straight from the mapping, on request.
+class PortablePdb
+{
+public:
+    explicit PortablePdb(std::string path);
+    ~PortablePdb();
+
+    PortablePdb(const PortablePdb&) = delete;
+    PortablePdb& operator= (const PortablePdb&) = delete;
+
+    // Appends the non-hidden sequence points of method, in IL offset order.
+    bool GetSequencePoints(mdMethodDef method, std::vector<SequencePoint>& points);
+
+    std::string GetDocumentName(ULONG32 document);
+
+private:
+    std::string path;
+    std::once_flag opened;
+    bool valid;
+
+    const BYTE* data;
+    size_t size;
+#ifdef WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+    const BYTE* blobs;
+    ULONG blobsSize;
+
+    ULONG blobIndexSize;
+    ULONG guidIndexSize;
+
+    const BYTE* documentTable;
+    ULONG documentRows;
+    ULONG documentRowSize;
+
+    const BYTE* methodDebugTable;
+    ULONG methodDebugRows;
+    ULONG methodDebugRowSize;
+    ULONG documentIndexSize;
+
+    void Open();
+    bool Map();
+    void Unmap();
+    bool Parse();
+
+    bool GetBlob(ULONG index, const BYTE*& blob, ULONG& length) const;
+    static ULONG ReadIndex(const BYTE* p, ULONG indexSize);
+};
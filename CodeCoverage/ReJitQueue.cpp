@@ -0,0 +1,146 @@
+#include <chrono>
+#include <cstdio>
+#include "ReJitQueue.h"
+
+ReJitQueue::ReJitQueue() : corProfilerInfo(nullptr), issuing(false), stopping(false)
+{
+}
+
+ReJitQueue::~ReJitQueue()
+{
+    Stop();
+}
+
+void ReJitQueue::Start(ICorProfilerInfo4* corProfilerInfo)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    if (worker.joinable())
+    {
+        return;
+    }
+
+    this->corProfilerInfo = corProfilerInfo;
+    stopping = false;
+    worker = std::thread(&ReJitQueue::Run, this);
+}
+
+void ReJitQueue::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+}
+
+void ReJitQueue::Enqueue(ModuleID moduleId, mdMethodDef methodId)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        pendingModules.push_back(moduleId);
+        pendingMethods.push_back(methodId);
+    }
+    wake.notify_one();
+}
+
+void ReJitQueue::EnqueueRevert(ModuleID moduleId, mdMethodDef methodId)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        pendingRevertModules.push_back(moduleId);
+        pendingRevertMethods.push_back(methodId);
+    }
+    wake.notify_one();
+}
+
+// Removes the entries of moduleId from a pair of parallel lists.
+static void RemoveModule(std::vector<ModuleID>& modules, std::vector<mdMethodDef>& methods, ModuleID moduleId)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        if (modules[i] != moduleId)
+        {
+            modules[kept] = modules[i];
+            methods[kept] = methods[i];
+            kept++;
+        }
+    }
+    modules.resize(kept);
+    methods.resize(kept);
+}
+
+void ReJitQueue::Forget(ModuleID moduleId)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // The worker takes a batch and marks it issuing under the same lock, so
+    // every request is either still pending here or already issued.
+    issued.wait(lock, [this] { return !issuing; });
+
+    RemoveModule(pendingModules, pendingMethods, moduleId);
+    RemoveModule(pendingRevertModules, pendingRevertMethods, moduleId);
+}
+
+void ReJitQueue::Run()
+{
+    std::vector<ModuleID> modules;
+    std::vector<mdMethodDef> methods;
+    std::vector<ModuleID> revertModules;
+    std::vector<mdMethodDef> revertMethods;
+    std::vector<HRESULT> revertStatus;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        wake.wait(lock, [this] { return stopping || !pendingModules.empty() || !pendingRevertModules.empty(); });
+        if (stopping)
+        {
+            break;
+        }
+
+        // Give the other methods hit during warm-up a chance to join this
+        // batch; each RequestReJIT call suspends the runtime.
+        wake.wait_for(lock, std::chrono::milliseconds(BatchDelayMilliseconds), [this] { return stopping; });
+
+        modules.swap(pendingModules);
+        methods.swap(pendingMethods);
+        revertModules.swap(pendingRevertModules);
+        revertMethods.swap(pendingRevertMethods);
+        bool discard = stopping;
+        issuing = true;
+        lock.unlock();
+
+        if (!discard && !modules.empty())
+        {
+            auto hr = corProfilerInfo->RequestReJIT(static_cast<ULONG>(modules.size()), modules.data(), methods.data());
+            if (FAILED(hr))
+            {
+                printf("RequestReJIT failed for %zu methods: %x\r\n", modules.size(), hr);
+            }
+        }
+
+        if (!discard && !revertModules.empty())
+        {
+            revertStatus.resize(revertModules.size());
+            auto hr = corProfilerInfo->RequestRevert(static_cast<ULONG>(revertModules.size()), revertModules.data(), revertMethods.data(), revertStatus.data());
+            if (FAILED(hr))
+            {
+                printf("RequestRevert failed for %zu methods: %x\r\n", revertModules.size(), hr);
+            }
+        }
+
+        modules.clear();
+        methods.clear();
+        revertModules.clear();
+        revertMethods.clear();
+        lock.lock();
+        issuing = false;
+        issued.notify_all();
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+
+// Batches ReJIT and revert requests onto a background thread, so the probe
+// that discovers a method only has to append it to a list.
+class ReJitQueue
+{
+public:
+    // How long the worker waits for more methods before issuing a batch.
+    static constexpr int BatchDelayMilliseconds = 50;
+
+    ReJitQueue();
+    ~ReJitQueue();
+
+    ReJitQueue(const ReJitQueue&) = delete;
+    ReJitQueue& operator= (const ReJitQueue&) = delete;
+
+    void Start(ICorProfilerInfo4* corProfilerInfo);
+    void Stop();
+
+    void Enqueue(ModuleID moduleId, mdMethodDef methodId);
+
+    // Queues the method to go back to the body it was first JIT-compiled
+    // with, discarding any ReJIT.
+    void EnqueueRevert(ModuleID moduleId, mdMethodDef methodId);
+
+    // Drops every request for a module that is unloading. If a batch is
+    // being issued, waits for it, so no request for the module reaches the
+    // runtime once this returns.
+    void Forget(ModuleID moduleId);
+
+private:
+    ICorProfilerInfo4* corProfilerInfo;
+
+    std::vector<ModuleID> pendingModules;
+    std::vector<mdMethodDef> pendingMethods;
+    std::vector<ModuleID> pendingRevertModules;
+    std::vector<mdMethodDef> pendingRevertMethods;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable issued;
+    bool issuing;
+    bool stopping;
+    std::thread worker;
+
+    void Run();
+};
@@ -0,0 +1,173 @@
+#include <cstring>
+#include "StringPool.h"
+#include "Utf8.h"
+
+StringPool::StringPool() : chunkCount(1), chunkUsed(1), slots(1024, Empty), count(0)
+{
+    for (auto& chunk : chunks)
+    {
+        chunk = nullptr;
+    }
+
+    // Id 0 points at the NUL that starts the first chunk.
+    chunks[0] = new char[ChunkSize];
+    chunks[0][0] = 0;
+}
+
+StringPool::~StringPool()
+{
+    for (size_t i = 0; i < chunkCount; i++)
+    {
+        delete[] chunks[i];
+    }
+}
+
+StringPool::Id StringPool::Intern(const char* text, size_t length)
+{
+    if (length == 0)
+    {
+        return Empty;
+    }
+
+    // Longer names would not fit a chunk; metadata names are far shorter.
+    if (length > ChunkSize - 1)
+    {
+        length = ChunkSize - 1;
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+
+    size_t index;
+    auto id = Find(text, length, index);
+    if (id != Empty)
+    {
+        return id;
+    }
+
+    // A full arena interns nothing more; the name reads as empty.
+    auto stored = Reserve(length);
+    if (stored == nullptr)
+    {
+        return Empty;
+    }
+
+    memcpy(stored, text, length);
+    return Commit(length, index);
+}
+
+StringPool::Id StringPool::Intern(const WCHAR* text, size_t length)
+{
+    if (length == 0)
+    {
+        return Empty;
+    }
+
+    if (length > (ChunkSize - 1) / MaxUtf8PerUtf16)
+    {
+        length = (ChunkSize - 1) / MaxUtf8PerUtf16;
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+
+    // The name is encoded at the end of the arena and only kept there if
+    // it turns out to be new.
+    auto stored = Reserve(length * MaxUtf8PerUtf16);
+    if (stored == nullptr)
+    {
+        return Empty;
+    }
+
+    auto encoded = Utf16ToUtf8(text, length, stored);
+
+    size_t index;
+    auto id = Find(stored, encoded, index);
+    if (id != Empty)
+    {
+        return id;
+    }
+    return Commit(encoded, index);
+}
+
+// FNV-1a.
+size_t StringPool::Hash(const char* text, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ static_cast<uint8_t>(text[i])) * 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash);
+}
+
+// The id of text if it is stored, or Empty with index set to the free
+// slot it would take.
+StringPool::Id StringPool::Find(const char* text, size_t length, size_t& index) const
+{
+    auto mask = slots.size() - 1;
+    index = Hash(text, length) & mask;
+    while (slots[index] != Empty)
+    {
+        auto stored = Get(slots[index]);
+        if (memcmp(stored, text, length) == 0 && stored[length] == 0)
+        {
+            return slots[index];
+        }
+        index = (index + 1) & mask;
+    }
+    return Empty;
+}
+
+// Room at the end of the arena for length bytes and a NUL, or nullptr when
+// the arena is full.
+char* StringPool::Reserve(size_t length)
+{
+    if (chunkUsed + length + 1 > ChunkSize)
+    {
+        if (chunkCount == MaxChunks)
+        {
+            return nullptr;
+        }
+        chunks[chunkCount++] = new char[ChunkSize];
+        chunkUsed = 0;
+    }
+
+    return chunks[chunkCount - 1] + chunkUsed;
+}
+
+// Keeps the length bytes written at the reserved position, and files them
+// under the free slot index.
+StringPool::Id StringPool::Commit(size_t length, size_t index)
+{
+    auto chunk = chunkCount - 1;
+    auto start = chunkUsed;
+    chunks[chunk][start + length] = 0;
+    chunkUsed += length + 1;
+
+    auto id = static_cast<Id>((chunk << ChunkBits) | start);
+    slots[index] = id;
+    if (++count * 2 > slots.size())
+    {
+        Grow();
+    }
+    return id;
+}
+
+void StringPool::Grow()
+{
+    std::vector<Id> grown(slots.size() * 2, Empty);
+    auto mask = grown.size() - 1;
+    for (auto id : slots)
+    {
+        if (id == Empty)
+            continue;
+
+        auto text = Get(id);
+        auto index = Hash(text, strlen(text)) & mask;
+        while (grown[index] != Empty)
+        {
+            index = (index + 1) & mask;
+        }
+        grown[index] = id;
+    }
+    slots.swap(grown);
+}
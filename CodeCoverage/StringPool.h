@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cor.h"
+
+// Append-only arena of interned, NUL-terminated names. Each distinct name
+// is stored once and referred to by a 32-bit id, so tables of names cost
+// four bytes per entry. The arena grows in chunks that never move, which
+// lets Get run without the lock for any id the caller was handed.
+class StringPool
+{
+public:
+    typedef uint32_t Id;
+
+    // The id of the empty string.
+    static constexpr Id Empty = 0;
+
+    static constexpr size_t ChunkBits = 20;
+    static constexpr size_t ChunkSize = size_t(1) << ChunkBits;
+    static constexpr size_t MaxChunks = 4096;
+
+    StringPool();
+    ~StringPool();
+
+    StringPool(const StringPool&) = delete;
+    StringPool& operator= (const StringPool&) = delete;
+
+    Id Intern(const char* text, size_t length);
+    Id Intern(const std::string& text) { return Intern(text.data(), text.length()); }
+
+    // Converts a metadata name straight into the arena; nothing is copied
+    // when the name is already there.
+    Id Intern(const WCHAR* text, size_t length);
+
+    const char* Get(Id id) const
+    {
+        return chunks[id >> ChunkBits] + (id & (ChunkSize - 1));
+    }
+
+private:
+    char* chunks[MaxChunks];
+    size_t chunkCount;
+    size_t chunkUsed;
+
+    // Open-addressed table of the ids stored so far; Empty marks a free
+    // slot. Kept at most half full.
+    std::vector<Id> slots;
+    size_t count;
+
+    std::mutex mutex;
+
+    static size_t Hash(const char* text, size_t length);
+    Id Find(const char* text, size_t length, size_t& index) const;
+    char* Reserve(size_t length);
+    Id Commit(size_t length, size_t index);
+    void Grow();
+};
@@ -0,0 +1,93 @@
+#include "Utf8.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define UTF8_SSE2
+#endif
+
+size_t Utf16Length(const WCHAR* text)
+{
+    size_t length = 0;
+    while (text[length] != 0)
+    {
+        length++;
+    }
+    return length;
+}
+
+size_t Utf16ToUtf8(const WCHAR* text, size_t length, char* output)
+{
+    auto out = reinterpret_cast<unsigned char*>(output);
+    size_t i = 0;
+
+#ifdef UTF8_SSE2
+    const __m128i nonAscii = _mm_set1_epi16(static_cast<short>(0xFF80));
+    const __m128i zero = _mm_setzero_si128();
+#endif
+
+    while (i < length)
+    {
+#ifdef UTF8_SSE2
+        // Eight units at a time while they are all ASCII: each one narrows
+        // to its low byte.
+        while (i + 8 <= length)
+        {
+            auto units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, nonAscii), zero)) != 0xFFFF)
+                break;
+
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(units, units));
+            i += 8;
+            out += 8;
+        }
+        if (i == length)
+            break;
+#endif
+
+        uint32_t c = static_cast<uint16_t>(text[i++]);
+        if (c < 0x80)
+        {
+            *out++ = static_cast<unsigned char>(c);
+            continue;
+        }
+
+        if (c < 0x800)
+        {
+            *out++ = static_cast<unsigned char>(0xC0 | (c >> 6));
+            *out++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+            continue;
+        }
+
+        if (c >= 0xD800 && c <= 0xDFFF)
+        {
+            uint32_t low = i < length ? static_cast<uint16_t>(text[i]) : 0;
+            if (c <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF)
+            {
+                // Four bytes from two units, within the three per unit
+                // the caller allows for.
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+                *out++ = static_cast<unsigned char>(0xF0 | (c >> 18));
+                *out++ = static_cast<unsigned char>(0x80 | ((c >> 12) & 0x3F));
+                *out++ = static_cast<unsigned char>(0x80 | ((c >> 6) & 0x3F));
+                *out++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+                continue;
+            }
+            c = 0xFFFD;
+        }
+
+        *out++ = static_cast<unsigned char>(0xE0 | (c >> 12));
+        *out++ = static_cast<unsigned char>(0x80 | ((c >> 6) & 0x3F));
+        *out++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+    }
+
+    return out - reinterpret_cast<unsigned char*>(output);
+}
+
+std::string Utf16ToUtf8(const WCHAR* text)
+{
+    auto length = Utf16Length(text);
+    std::string result(length * MaxUtf8PerUtf16, '\0');
+    result.resize(Utf16ToUtf8(text, length, &result[0]));
+    return result;
+}
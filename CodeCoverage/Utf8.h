@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "cor.h"
+
+// Metadata names are UTF-16; the reports, the filter and the control file
+// work in UTF-8.
+
+// The most UTF-8 bytes one UTF-16 code unit can turn into.
+static constexpr size_t MaxUtf8PerUtf16 = 3;
+
+size_t Utf16Length(const WCHAR* text);
+
+// Encodes length code units of text into output, which must have room for
+// MaxUtf8PerUtf16 bytes per unit, and returns the number of bytes written.
+// Runs of ASCII are converted eight units at a time where SSE2 is
+// available. Unpaired surrogates become U+FFFD.
+size_t Utf16ToUtf8(const WCHAR* text, size_t length, char* output);
+
+std::string Utf16ToUtf8(const WCHAR* text);
@@ -13,8 +13,22 @@
 #define CoTaskMemAlloc(cb) malloc(cb)
 #define CoTaskMemFree(cb) free(cb)
 
+inline void* AlignedAlloc(size_t cb, size_t alignment)
+{
+    void* p;
+    return posix_memalign(&p, alignment, cb) == 0 ? p : nullptr;
+}
+#define AlignedFree(p) free(p)
+
 #define UINT_PTR_FORMAT "lx"
 
 #else
+#include <malloc.h>
+
+#define AlignedAlloc(cb, alignment) _aligned_malloc(cb, alignment)
+#define AlignedFree(p) _aligned_free(p)
+
+#define W(str) L##str
+
 #define UINT_PTR_FORMAT "llx"
 #endif
\ No newline at end of file